@@ -5,6 +5,11 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <csse2310a1.h>
 
 #define USAGE_ERR 1
@@ -13,6 +18,9 @@
 #define NO_MATCH 4
 #define DEFAULT_LEN 5
 #define LINE_LEN 50
+#define MIN_LEN 4
+#define MAX_LEN 9
+#define INDEX_MAGIC "WHX2"
 
 struct Arguments {
     char* argType;
@@ -26,6 +34,23 @@ struct Arguments {
 // Variable for storing command line args.
 struct Arguments arguments;
 
+// Header of a dictionary index built by -build-index. Words are stored
+// uppercased and NUL terminated, bucketed by length: the counts[len]
+// words of length len start at byte offsets[len] of the file, each
+// taking len + 1 bytes, in the order they appear in the dictionary.
+// The dictionary it was built from is recorded so that it is only used
+// for that same, unchanged file.
+struct IndexHeader {
+    char magic[4];
+    uint32_t counts[MAX_LEN + 1];
+    uint32_t offsets[MAX_LEN + 1];
+    uint64_t dictDev;
+    uint64_t dictIno;
+    int64_t dictSize;
+    int64_t dictSec;
+    int64_t dictNsec;
+};
+
 // Error Handling
 
 // Handles command line usage error 
@@ -49,13 +74,20 @@ void invalid_file(char* fileName) {
     exit(FILE_ERR);
 }
 
+// Handles an index file that cannot be written
+void invalid_index(char* fileName) {
+    fprintf(stderr, "wordle-helper: index"
+            " file \"%s\" cannot be written\n", fileName);
+    exit(FILE_ERR);
+}
+
 // Checks if the length of the word is valid 
 bool is_word_length_valid(char* arg) {
     if (strlen(arg) > 1 || isalpha(arg[0]) != 0) {
         return false;
     }
     int wordLen = atoi(arg);
-    if ((wordLen < 4) || (wordLen > 9)) {
+    if ((wordLen < MIN_LEN) || (wordLen > MAX_LEN)) {
         return false;
     }
     return true;
@@ -307,6 +339,146 @@ char** wordle_helper(char** wordleData, int arrLen, int* len) {
     return outputArr;
 }
 
+// Returns the path of the index for the dictionary: WORDLE_INDEX if it
+// is set, otherwise the dictionary path with ".idx" added
+char* index_path() {
+    if (getenv("WORDLE_INDEX") != NULL) {
+        return getenv("WORDLE_INDEX");
+    }
+    char* path = (char *)malloc(strlen(arguments.filePath) + 5);
+    sprintf(path, "%s.idx", arguments.filePath);
+    return path;
+}
+
+// Checks if the index header was built from the dictionary with these
+// stats, down to the nanosecond it was last changed
+bool is_index_current(struct IndexHeader* header, struct stat* dictStat) {
+    return header->dictDev == dictStat->st_dev 
+            && header->dictIno == dictStat->st_ino 
+            && header->dictSize == dictStat->st_size 
+            && header->dictSec == dictStat->st_mtim.tv_sec 
+            && header->dictNsec == dictStat->st_mtim.tv_nsec;
+}
+
+// Writes an index of the dictionary's valid words, read the same way
+// process_file() reads them, so later runs can map it instead
+void build_index() {
+    // stats taken before reading, so a change made while it is read
+    // leaves an index that does not match
+    struct stat dictStat;
+    if (stat(arguments.filePath, &dictStat) != 0) {
+        invalid_file(arguments.filePath);
+    }
+    int fileLen = 0;
+    char** rawData = process_file(arguments.filePath, &fileLen);
+    struct IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.dictDev = dictStat.st_dev;
+    header.dictIno = dictStat.st_ino;
+    header.dictSize = dictStat.st_size;
+    header.dictSec = dictStat.st_mtim.tv_sec;
+    header.dictNsec = dictStat.st_mtim.tv_nsec;
+
+    int* lengths = (int *)malloc(fileLen * sizeof(int));
+    for (int i = 0; i < fileLen; i++) {
+        lengths[i] = strlen(rawData[i]);
+        if (lengths[i] < MIN_LEN || lengths[i] > MAX_LEN 
+                || !is_string_valid(rawData[i])) {
+            lengths[i] = 0;
+        }
+        header.counts[lengths[i]]++;
+    }
+    header.counts[0] = 0;
+    uint32_t offset = sizeof(header);
+    for (int len = MIN_LEN; len <= MAX_LEN; len++) {
+        header.offsets[len] = offset;
+        offset += header.counts[len] * (len + 1);
+    }
+
+    // Written to a temporary file of its own next to the index and
+    // renamed, so neither a run reading the index nor another build
+    // ever sees it half written
+    char* path = index_path();
+    char* tmpPath = (char *)malloc(strlen(path) + 8);
+    sprintf(tmpPath, "%s.XXXXXX", path);
+    int fd = mkstemp(tmpPath);
+    FILE* file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+        invalid_index(path);
+    }
+    fchmod(fd, 0644);
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int len = MIN_LEN; len <= MAX_LEN; len++) {
+        for (int i = 0; i < fileLen && written; i++) {
+            if (lengths[i] == len) {
+                char upper[MAX_LEN + 1];
+                for (int j = 0; j <= len; j++) {
+                    upper[j] = toupper(rawData[i][j]);
+                }
+                written = fwrite(upper, 1, len + 1, file) == len + 1;
+            }
+        }
+    }
+    if (fclose(file) != 0 || !written || rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        invalid_index(path);
+    }
+}
+
+// Maps the dictionary's index if there is one and it was built from the
+// dictionary as it is now. Returns NULL if the dictionary has to be read
+// instead.
+struct IndexHeader* map_index() {
+    char* path = index_path();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat indexStat;
+    struct stat dictStat;
+    if (fstat(fd, &indexStat) != 0 || stat(arguments.filePath, &dictStat) 
+            != 0 || indexStat.st_size < sizeof(struct IndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+    struct IndexHeader* header = mmap(NULL, indexStat.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+    int len = arguments.argLen;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 
+            || !is_index_current(header, &dictStat) 
+            || header->offsets[len] + (off_t)header->counts[len] * (len + 1)
+            > indexStat.st_size) {
+        munmap(header, indexStat.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+// Process the mapped index without sorting type. Only the bucket for
+// the word length is scanned and the words are used where they lie.
+char** index_helper(struct IndexHeader* header, int* len) {
+    int wordLen = arguments.argLen;
+    int count = header->counts[wordLen];
+    char* words = (char *)header + header->offsets[wordLen];
+    char** outputArr = (char **)malloc((count + 1) * sizeof(char *));
+    int counter = 0;
+
+    for (int i = 0; i < count; i++) {
+        char* word = words + i * (wordLen + 1);
+        if (check_pattern(arguments.argPattern, word)) {
+            outputArr[counter] = word;
+            counter++;
+        }
+    }
+    *len = counter;
+    return outputArr;
+}
+
 // Function for constant of qsort sorting for alpha
 int comparator(const void* word1, const void* word2) {
     const char* temp1 = *(const char* const *)word1;
@@ -404,18 +576,30 @@ int main(int argc, char** argv) {
         usage_err();
     }
 
+    // Building the index for the dictionary
+    if (argc == 2 && strcmp(argv[1], "-build-index") == 0) {
+        set_file_path();
+        build_index();
+        return 0;
+    }
+
     // Processes command line arguments
     process_arguments(argc, argv);
 
     // Checking whether file can be opened
     set_file_path();
     
-    // Reading file
-    int fileLen = 0;
-    char** rawData = process_file(arguments.filePath, &fileLen);
-
+    // Reading the index, or the file if there is no index
     int outputArrLen = 0;
-    char** outputArr = wordle_helper(rawData, fileLen, &outputArrLen);
+    char** outputArr;
+    struct IndexHeader* index = map_index();
+    if (index != NULL) {
+        outputArr = index_helper(index, &outputArrLen);
+    } else {
+        int fileLen = 0;
+        char** rawData = process_file(arguments.filePath, &fileLen);
+        outputArr = wordle_helper(rawData, fileLen, &outputArrLen);
+    }
     int printCounter = 0;
     if (arguments.argType != NULL) {
         if (strcmp(arguments.argType, "-alpha") == 0) {
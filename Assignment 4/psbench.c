@@ -0,0 +1,778 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "psproto.h"
+#include "pshist.h"
+#include "psshm.h"
+
+// Load generator for psserver. Opens pubs + subs connections to a
+// server on loopback (or its Unix domain socket if given a path, where
+// --shm makes subscribers read from shared memory rings), spread over a few threads each running an epoll
+// loop. Subscribers are spread evenly over the topics and each
+// publisher sends to one topic. Every payload starts with the
+// CLOCK_MONOTONIC time it was sent, so subscribers can work out the
+// end to end latency of each delivery. Until every subscription is in
+// place the first publisher on each topic sends warmup messages, which
+// are not counted. Publishers send DEFAULT_RATE messages a second each
+// unless --rate says otherwise. --rate 0 has them send as fast as the
+// server takes messages, which measures throughput but lets queues
+// build up, so latency is only reported for runs that kept up with
+// their rate: a run that did not is saturated and its delays are time
+// spent queueing.
+// --policy has every subscriber ask the server for that send policy, to
+// compare latency mode against corked throughput mode. --ids (binary)
+// has publishers ask the server for their topic's id once and publish
+// with PUBID frames, so the server routes them without a name lookup.
+
+// Width of the send timestamp at the start of each payload
+#define STAMP_LEN 16
+// Bytes of messages a publisher queues at once when not rate limited
+#define PUB_FILL (64 * 1024)
+// Messages a second each publisher sends without --rate
+#define DEFAULT_RATE 1000
+// A run is saturated if publishers fell this far short of their rate
+#define RATE_SHORTFALL 0.95
+// or deliveries were still arriving this long after publishing stopped
+#define DRAIN_SECS 0.5
+
+typedef struct BenchConfig {
+    int port;
+    int threads;
+    int pubs;
+    int subs;
+    int topics;
+    int size;           // payload bytes, including the timestamp
+    long rate;          // messages per second per publisher, 0 for no limit
+    int duration;       // seconds of publishing
+    int binary;
+    char *path;         // Unix domain socket to use instead of TCP
+    int shm;            // subscribers use shared memory rings
+    char *policy;       // send policy subscribers ask for, NULL for default
+    int ids;            // publishers publish by topic id
+} BenchConfig;
+
+typedef struct BenchConn {
+    int fd;
+    int isPub;
+    int topic;
+    char *buf;          // publisher: bytes to send, subscriber: received
+    int len;
+    int off;            // publisher: bytes of buf already sent
+    int cap;
+    int skip;           // hello bytes still to be skipped
+    int warmer;         // publisher sending warmup messages for its topic
+    int ready;          // subscriber has seen a warmup message
+    int shm;            // subscriber reads from ring instead of fd
+    PsShmRing ring;
+    long sent;          // messages queued by a publisher
+    uint32_t topicId;   // --ids: id of the topic, in network order
+} BenchConn;
+
+typedef struct BenchThread {
+    pthread_t tid;
+    BenchConn *conns;
+    int count;
+    int epfd;
+    PsHist hist;
+    unsigned long received;
+    unsigned long published;
+    struct timespec lastRecv;
+} BenchThread;
+
+BenchConfig config = {0, 4, 1, 8, 1, 64, DEFAULT_RATE, 5, 0, NULL, 0,
+        NULL, 0};
+
+// messages sent to each topic and subscribers on each topic
+unsigned long *topicSent;
+int *topicSubs;
+
+// subscribers that have seen a warmup message, and warmup messages seen
+int readySubs = 0;
+unsigned long warmupsSeen = 0;
+
+// set by main once every subscription is in place, to end publishing,
+// then to end the run
+volatile int measuring = 0;
+volatile int stopPublish = 0;
+volatile int stopAll = 0;
+
+struct timespec startTime;
+
+// **********************************************************************
+// Nanoseconds on the monotonic clock
+// **********************************************************************
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double elapsed_secs(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// **********************************************************************
+// Make sure conn->buf can hold need more bytes
+// **********************************************************************
+void reserve(BenchConn *conn, int need) {
+    if (conn->len + need > conn->cap) {
+        while (conn->len + need > conn->cap) {
+            conn->cap *= 2;
+        }
+        conn->buf = realloc(conn->buf, conn->cap);
+    }
+}
+
+// **********************************************************************
+// Queue one message on a publisher. The payload is the send time in hex
+// padded out to the configured size, or "warmup" padded the same way.
+// **********************************************************************
+void queue_msg(BenchConn *conn, int warmup) {
+    char topic[32];
+    char stamp[STAMP_LEN + 1];
+    int topicLen = sprintf(topic, "bench%d", conn->topic);
+    int frameLen = config.binary
+            ? PSPROTO_HEADER_LEN + topicLen + config.size
+            : 4 + topicLen + 1 + config.size + 1;
+    if (config.ids) {
+        frameLen = PSPROTO_HEADER_LEN + 4 + config.size;
+        topicLen = 0;
+    }
+    reserve(conn, frameLen);
+    char *p = conn->buf + conn->len;
+    if (config.ids) {
+        psproto_encode((unsigned char*) p, PS_OP_PUBID, 0, 0,
+                4 + config.size);
+        memcpy(p + PSPROTO_HEADER_LEN, &conn->topicId, 4);
+        p += PSPROTO_HEADER_LEN + 4;
+    } else if (config.binary) {
+        psproto_encode((unsigned char*) p, PS_OP_PUB, 0, topicLen,
+                config.size);
+        p += PSPROTO_HEADER_LEN;
+    } else {
+        memcpy(p, "pub ", 4);
+        p += 4;
+    }
+    memcpy(p, topic, topicLen);
+    p += topicLen;
+    if (!config.binary) {
+        *p++ = ' ';
+    }
+    if (warmup) {
+        strcpy(stamp, "warmupwarmupwarm");
+    } else {
+        sprintf(stamp, "%016llx", (unsigned long long)now_ns());
+    }
+    memcpy(p, stamp, STAMP_LEN);
+    memset(p + STAMP_LEN, 'x', config.size - STAMP_LEN);
+    p += config.size;
+    if (!config.binary) {
+        *p++ = '\n';
+    }
+    conn->len += frameLen;
+    if (!warmup) {
+        conn->sent++;
+        __atomic_add_fetch(&topicSent[conn->topic], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// **********************************************************************
+// Write as much of a publisher's queue as the socket takes. Returns 1
+// if everything was written, 0 if the socket is full and -1 on error.
+// **********************************************************************
+int flush_pub(BenchThread *thread, BenchConn *conn) {
+    while (conn->off < conn->len) {
+        ssize_t n = send(conn->fd, conn->buf + conn->off,
+                conn->len - conn->off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct epoll_event ev = {EPOLLIN | EPOLLOUT, {.ptr = conn}};
+            epoll_ctl(thread->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        conn->off += n;
+    }
+    conn->off = 0;
+    conn->len = 0;
+    return 1;
+}
+
+// **********************************************************************
+// Queue and send whatever a publisher owes. Rate limited publishers
+// catch up to rate * elapsed time; others refill whenever their queue
+// has drained. Returns 1 if the publisher could take more straight away.
+// **********************************************************************
+int pump_pub(BenchThread *thread, BenchConn *conn) {
+    if (conn->len > 0 || !measuring || stopPublish) {
+        return 0;
+    }
+    long due;
+    if (config.rate > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        due = (long)(elapsed_secs(&startTime, &now) * config.rate)
+                - conn->sent;
+        if (due * (config.size + 32) > PUB_FILL) {
+            due = PUB_FILL / (config.size + 32) + 1;
+        }
+    } else {
+        due = PUB_FILL / (config.size + 32) + 1;
+    }
+    for (long i = 0; i < due; i++) {
+        queue_msg(conn, 0);
+    }
+    thread->published += due;
+    return due > 0 && flush_pub(thread, conn) == 1 && config.rate == 0;
+}
+
+// **********************************************************************
+// Record the latency of one delivered payload
+// **********************************************************************
+void got_payload(BenchThread *thread, BenchConn *conn, char *payload,
+        int len) {
+    char stamp[STAMP_LEN + 1];
+    if (len < STAMP_LEN) {
+        return;
+    }
+    if (payload[0] == 'w') {
+        __atomic_add_fetch(&warmupsSeen, 1, __ATOMIC_RELAXED);
+        if (!conn->ready) {
+            conn->ready = 1;
+            __atomic_add_fetch(&readySubs, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    memcpy(stamp, payload, STAMP_LEN);
+    stamp[STAMP_LEN] = '\0';
+    uint64_t sentAt = strtoull(stamp, NULL, 16);
+    uint64_t now = now_ns();
+    pshist_record(&thread->hist, now > sentAt ? now - sentAt : 0);
+    thread->received++;
+}
+
+// **********************************************************************
+// Pull complete deliveries out of a subscriber's buffer. Text lines look
+// like name:topic:payload; binary deliveries are MSG frames.
+// **********************************************************************
+void parse_deliveries(BenchThread *thread, BenchConn *conn) {
+    int pos = 0;
+    while (pos < conn->len) {
+        char *p = conn->buf + pos;
+        int left = conn->len - pos;
+        if (config.binary) {
+            PsFrame frame;
+            if (left < PSPROTO_HEADER_LEN) {
+                break;
+            }
+            psproto_decode((unsigned char*) p, &frame);
+            int frameLen = psproto_frame_len(&frame);
+            if (left < frameLen) {
+                reserve(conn, frameLen);
+                break;
+            }
+            if (frame.opcode == PS_OP_MSG) {
+                got_payload(thread, conn, p + frameLen - frame.payloadLen,
+                        frame.payloadLen);
+            }
+            pos += frameLen;
+        } else {
+            char *end = memchr(p, '\n', left);
+            if (end == NULL) {
+                break;
+            }
+            char *colon = memchr(p, ':', end - p);
+            if (colon != NULL) {
+                colon = memchr(colon + 1, ':', end - colon - 1);
+            }
+            if (colon != NULL) {
+                got_payload(thread, conn, colon + 1, end - colon - 1);
+            }
+            pos += end - p + 1;
+        }
+    }
+    memmove(conn->buf, conn->buf + pos, conn->len - pos);
+    conn->len -= pos;
+}
+
+// **********************************************************************
+// Drain a subscriber's shared memory ring after its eventfd fired, then
+// ask to be woken again
+// **********************************************************************
+void read_ring(BenchThread *thread, BenchConn *conn) {
+    psshm_end_wait(&conn->ring);
+    while (1) {
+        int ack;
+        reserve(conn, 65536);
+        int n = psshm_read(&conn->ring, conn->buf + conn->len,
+                conn->cap - conn->len, &ack);
+        if (ack) {
+            psshm_send_ack(conn->fd, config.binary);
+        }
+        if (n > 0) {
+            conn->len += n;
+            parse_deliveries(thread, conn);
+            clock_gettime(CLOCK_MONOTONIC, &thread->lastRecv);
+        } else if (!psshm_prepare_wait(&conn->ring)) {
+            return;
+        }
+    }
+}
+
+// **********************************************************************
+// Read what has arrived on a connection. Publishers only get :invalid
+// replies and the hello, which are thrown away.
+// **********************************************************************
+void read_conn(BenchThread *thread, BenchConn *conn) {
+    char scratch[4096];
+    if (conn->shm) {
+        read_ring(thread, conn);
+        return;
+    }
+    while (1) {
+        char *dest = scratch;
+        int room = sizeof(scratch);
+        if (!conn->isPub) {
+            reserve(conn, 4096);
+            dest = conn->buf + conn->len;
+            room = conn->cap - conn->len;
+        }
+        ssize_t n = recv(conn->fd, dest, room, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        if (conn->isPub) {
+            continue;
+        }
+        if (conn->skip > 0) {
+            int drop = n < conn->skip ? n : conn->skip;
+            memmove(dest, dest + drop, n - drop);
+            n -= drop;
+            conn->skip -= drop;
+        }
+        conn->len += n;
+        parse_deliveries(thread, conn);
+        clock_gettime(CLOCK_MONOTONIC, &thread->lastRecv);
+    }
+}
+
+// **********************************************************************
+// Event loop for one thread's share of the connections
+// **********************************************************************
+void *bench_thread(void *arg) {
+    BenchThread *thread = arg;
+    struct epoll_event events[256];
+    // warmups back off so a slow server is not flooded with them
+    uint64_t lastWarmup = 0, warmupGap = 20000000;
+    while (!stopAll) {
+        int busy = 0;
+        if (!measuring && now_ns() - lastWarmup > warmupGap) {
+            for (int i = 0; i < thread->count; i++) {
+                BenchConn *conn = &thread->conns[i];
+                if (conn->warmer && conn->len == 0) {
+                    queue_msg(conn, 1);
+                    flush_pub(thread, conn);
+                }
+            }
+            lastWarmup = now_ns();
+            if (warmupGap < 1000000000) {
+                warmupGap *= 2;
+            }
+        }
+        for (int i = 0; i < thread->count; i++) {
+            if (thread->conns[i].isPub) {
+                busy |= pump_pub(thread, &thread->conns[i]);
+            }
+        }
+        int timeout = busy ? 0 : 1;
+        int n = epoll_wait(thread->epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            BenchConn *conn = events[i].data.ptr;
+            if (events[i].events & EPOLLIN) {
+                read_conn(thread, conn);
+            }
+            if ((events[i].events & EPOLLOUT)
+                    && flush_pub(thread, conn) == 1) {
+                struct epoll_event ev = {EPOLLIN, {.ptr = conn}};
+                epoll_ctl(thread->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+            }
+        }
+    }
+    return NULL;
+}
+
+// **********************************************************************
+// Write a whole command to a blocking socket
+// **********************************************************************
+int send_all(int fd, char *data, int len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Read exactly len bytes from a blocking socket
+// **********************************************************************
+int recv_all(int fd, char *data, int len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Ask the server for the id of a publisher's topic and wait for it.
+// The hello the server sends first is read here too.
+// **********************************************************************
+int get_topic_id(BenchConn *conn, char *topic) {
+    char cmd[64], reply[PSPROTO_HELLO_LEN + PSPROTO_HEADER_LEN + 64];
+    PsFrame frame;
+    int topicLen = strlen(topic);
+    psproto_encode((unsigned char*) cmd, PS_OP_TOPICID, 0, topicLen, 0);
+    memcpy(cmd + PSPROTO_HEADER_LEN, topic, topicLen);
+    if (send_all(conn->fd, cmd, PSPROTO_HEADER_LEN + topicLen) != 0
+            || recv_all(conn->fd, reply,
+            PSPROTO_HELLO_LEN + PSPROTO_HEADER_LEN) != 0) {
+        return -1;
+    }
+    psproto_decode((unsigned char*) reply + PSPROTO_HELLO_LEN, &frame);
+    if (frame.opcode != PS_OP_TOPICID || frame.topicLen != topicLen
+            || frame.payloadLen != 4 || recv_all(conn->fd, reply,
+            topicLen + 4) != 0) {
+        fprintf(stderr, "psbench: server gave no id for %s\n", topic);
+        return -1;
+    }
+    memcpy(&conn->topicId, reply + topicLen, 4);
+    conn->skip = 0;
+    return 0;
+}
+
+// **********************************************************************
+// Connect one client, name it and subscribe it if needed
+// **********************************************************************
+int open_conn(BenchConn *conn, int index) {
+    char cmd[128], name[32], topic[32];
+    if (config.path != NULL) {
+        struct sockaddr_un uAddr;
+        memset(&uAddr, 0, sizeof(uAddr));
+        uAddr.sun_family = AF_UNIX;
+        strncpy(uAddr.sun_path, config.path, sizeof(uAddr.sun_path) - 1);
+        conn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (conn->fd < 0 || connect(conn->fd, (struct sockaddr *)&uAddr,
+                sizeof(uAddr)) == -1) {
+            return -1;
+        }
+    } else {
+        struct sockaddr_in sAddr;
+        conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+        sAddr.sin_family = AF_INET;
+        sAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        sAddr.sin_port = htons(config.port);
+        if (conn->fd < 0 || connect(conn->fd, (struct sockaddr *)&sAddr,
+                sizeof(sAddr)) == -1) {
+            return -1;
+        }
+    }
+    if (config.shm && !conn->isPub) {
+        // also exchanges the binary hello
+        if (psshm_request(conn->fd, config.binary, &conn->ring) != 0) {
+            fprintf(stderr, "psbench: server refused a shared memory ring\n");
+            return -1;
+        }
+        conn->shm = 1;
+        psshm_prepare_wait(&conn->ring);
+    }
+    // the pid keeps names apart from a previous run still being cleaned up
+    sprintf(name, "%s%d_%d", conn->isPub ? "bp" : "bs", (int)getpid(),
+            index);
+    sprintf(topic, "bench%d", conn->topic);
+    int len = 0;
+    if (config.binary) {
+        if (!conn->shm) {
+            memcpy(cmd, PSPROTO_HELLO, PSPROTO_HELLO_LEN);
+            len = PSPROTO_HELLO_LEN;
+            conn->skip = PSPROTO_HELLO_LEN;
+        }
+        psproto_encode((unsigned char*) cmd + len, PS_OP_NAME, strlen(name),
+                0, 0);
+        len += PSPROTO_HEADER_LEN;
+        len += sprintf(cmd + len, "%s", name);
+        if (!conn->isPub) {
+            psproto_encode((unsigned char*) cmd + len, PS_OP_SUB, 0,
+                    strlen(topic), 0);
+            len += PSPROTO_HEADER_LEN;
+            len += sprintf(cmd + len, "%s", topic);
+        }
+        if (!conn->isPub && config.policy != NULL) {
+            psproto_encode((unsigned char*) cmd + len, PS_OP_TEXT, 0, 0,
+                    strlen("policy ") + strlen(config.policy));
+            len += PSPROTO_HEADER_LEN;
+            len += sprintf(cmd + len, "policy %s", config.policy);
+        }
+    } else if (conn->isPub) {
+        len = sprintf(cmd, "name %s\n", name);
+    } else {
+        len = sprintf(cmd, "name %s\nsub %s\n", name, topic);
+        if (config.policy != NULL) {
+            len += sprintf(cmd + len, "policy %s\n", config.policy);
+        }
+    }
+    if (send_all(conn->fd, cmd, len) != 0
+            || (config.ids && conn->isPub && get_topic_id(conn, topic) != 0)) {
+        return -1;
+    }
+    // measure the server rather than Nagle delays on our own sends
+    int one = 1;
+    if (config.path == NULL) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    conn->cap = 8192;
+    conn->buf = malloc(conn->cap);
+    return 0;
+}
+
+// **********************************************************************
+// Parse leading --option value pairs into config. Returns the number of
+// arguments used or -1 if an option is not known.
+// **********************************************************************
+int parse_options(int argc, char **argv) {
+    int used = 0;
+    while (used + 1 < argc && strncmp(argv[used + 1], "--", 2) == 0) {
+        char *opt = argv[used + 1];
+        if (strcmp(opt, "--binary") == 0 || strcmp(opt, "--shm") == 0
+                || strcmp(opt, "--ids") == 0) {
+            if (strcmp(opt, "--shm") == 0) {
+                config.shm = 1;
+            } else {
+                config.ids |= (strcmp(opt, "--ids") == 0);
+                config.binary = 1;
+            }
+            used++;
+            continue;
+        }
+        if (used + 2 >= argc) {
+            return -1;
+        }
+        long value = atol(argv[used + 2]);
+        if (strcmp(opt, "--policy") == 0) {
+            config.policy = argv[used + 2];
+        } else if (strcmp(opt, "--threads") == 0) {
+            config.threads = value;
+        } else if (strcmp(opt, "--pubs") == 0) {
+            config.pubs = value;
+        } else if (strcmp(opt, "--subs") == 0) {
+            config.subs = value;
+        } else if (strcmp(opt, "--topics") == 0) {
+            config.topics = value;
+        } else if (strcmp(opt, "--size") == 0) {
+            config.size = value;
+        } else if (strcmp(opt, "--rate") == 0) {
+            config.rate = value;
+        } else if (strcmp(opt, "--duration") == 0) {
+            config.duration = value;
+        } else {
+            return -1;
+        }
+        used += 2;
+    }
+    return used;
+}
+
+// **********************************************************************
+// Print throughput and, unless the run was saturated, the latency
+// distribution of the run
+// **********************************************************************
+void report(BenchThread *threads, double pubSecs) {
+    PsHist hist;
+    unsigned long received = 0, published = 0, expected = 0;
+    struct timespec last = startTime;
+    pshist_init(&hist);
+    for (int i = 0; i < config.threads; i++) {
+        pshist_merge(&hist, &threads[i].hist);
+        received += threads[i].received;
+        published += threads[i].published;
+        if (elapsed_secs(&last, &threads[i].lastRecv) > 0) {
+            last = threads[i].lastRecv;
+        }
+    }
+    for (int t = 0; t < config.topics; t++) {
+        expected += topicSent[t] * topicSubs[t];
+    }
+    double recvSecs = elapsed_secs(&startTime, &last);
+    printf("connections   %d pubs, %d subs, %d topics, %d threads, %s,"
+            " %s policy\n", config.pubs, config.subs, config.topics,
+            config.threads, config.ids ? "binary by id"
+            : config.binary ? "binary" : "text",
+            config.policy != NULL ? config.policy : "server");
+    printf("published     %lu msgs in %.2fs (%.0f msgs/s)\n", published,
+            pubSecs, published / pubSecs);
+    printf("delivered     %lu of %lu (%.0f deliveries/s)\n", received,
+            expected, recvSecs > 0 ? received / recvSecs : 0);
+    double asked = (double) config.rate * config.pubs * pubSecs;
+    double drainSecs = recvSecs - pubSecs;
+    if (config.rate == 0) {
+        printf("latency usec  not reported: --rate 0 saturates the"
+                " server\n");
+        return;
+    }
+    if (published < asked * RATE_SHORTFALL || drainSecs > DRAIN_SECS) {
+        printf("latency usec  not reported: saturated (%.0f%% of the rate"
+                " published, deliveries ended %.2fs after publishing)\n",
+                100 * published / asked, drainSecs);
+        return;
+    }
+    printf("latency usec  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f"
+            "  mean %.1f\n",
+            pshist_percentile(&hist, 50) / 1e3,
+            pshist_percentile(&hist, 99) / 1e3,
+            pshist_percentile(&hist, 99.9) / 1e3, hist.max / 1e3,
+            pshist_mean(&hist) / 1e3);
+}
+
+int main(int argc, char **argv) {
+    int used = parse_options(argc, argv);
+    if (used >= 0 && argc - used == 2 && strchr(argv[used + 1], '/')) {
+        config.path = argv[used + 1];
+    }
+    if (used < 0 || argc - used != 2
+            || (config.path == NULL && atoi(argv[used + 1]) <= 0)
+            || (config.shm && config.path == NULL)
+            || config.threads < 1 || config.pubs < 0 || config.subs < 0
+            || config.topics < 1 || config.size < STAMP_LEN
+            || config.size > PSPROTO_MAX_PAYLOAD || config.rate < 0
+            || config.duration < 1 || (config.policy != NULL
+            && strcmp(config.policy, "latency") != 0
+            && strcmp(config.policy, "throughput") != 0)) {
+        fprintf(stderr, "Usage: psbench [--threads n] [--pubs n] [--subs n]"
+                " [--topics n] [--size bytes] [--rate msgs/s] [--duration"
+                " secs] [--policy latency|throughput] [--binary] [--ids]"
+                " [--shm] portnum|socketpath\n");
+        return 1;
+    }
+    config.port = atoi(argv[used + 1]);
+
+    // every connection needs a descriptor
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    topicSent = calloc(config.topics, sizeof(unsigned long));
+    topicSubs = calloc(config.topics, sizeof(int));
+    BenchThread *threads = calloc(config.threads, sizeof(BenchThread));
+    int total = config.pubs + config.subs;
+    for (int i = 0; i < config.threads; i++) {
+        threads[i].conns = calloc(total / config.threads + 1,
+                sizeof(BenchConn));
+        threads[i].epfd = epoll_create1(0);
+        pshist_init(&threads[i].hist);
+    }
+    for (int i = 0; i < total; i++) {
+        BenchThread *thread = &threads[i % config.threads];
+        BenchConn *conn = &thread->conns[thread->count++];
+        conn->isPub = i < config.pubs;
+        conn->topic = (conn->isPub ? i : i - config.pubs) % config.topics;
+        conn->warmer = conn->isPub && i < config.topics;
+        if (open_conn(conn, i) != 0) {
+            fprintf(stderr, "psbench: unable to connect to %s"
+                    " (connection %d)\n", argv[used + 1], i);
+            return 2;
+        }
+        if (!conn->isPub) {
+            topicSubs[conn->topic]++;
+        }
+        struct epoll_event ev = {EPOLLIN, {.ptr = conn}};
+        epoll_ctl(thread->epfd, EPOLL_CTL_ADD,
+                conn->shm ? conn->ring.eventfd : conn->fd, &ev);
+    }
+    for (int i = 0; i < config.threads; i++) {
+        pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i]);
+    }
+    // wait for every subscriber on a topic with a publisher to hear a
+    // warmup message, so none of the measured messages are missed
+    int wantReady = 0;
+    for (int t = 0; t < config.topics && t < config.pubs; t++) {
+        wantReady += topicSubs[t];
+    }
+    for (int waited = 0; __atomic_load_n(&readySubs, __ATOMIC_RELAXED)
+            < wantReady; waited++) {
+        if (waited == 600) {
+            fprintf(stderr, "psbench: only %d of %d subscribers ready\n",
+                    readySubs, wantReady);
+            break;
+        }
+        usleep(100000);
+    }
+    // and for the last warmups still queued in the server to drain
+    unsigned long warmups;
+    do {
+        warmups = __atomic_load_n(&warmupsSeen, __ATOMIC_RELAXED);
+        usleep(100000);
+    } while (warmups != __atomic_load_n(&warmupsSeen, __ATOMIC_RELAXED));
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    __atomic_store_n(&measuring, 1, __ATOMIC_RELEASE);
+    sleep(config.duration);
+    stopPublish = 1;
+    struct timespec pubEnd;
+    clock_gettime(CLOCK_MONOTONIC, &pubEnd);
+
+    // wait for deliveries still in flight, giving up once nothing has
+    // arrived for a second or after 30 seconds
+    unsigned long lastSeen = 0, expected = 0;
+    for (int t = 0; t < config.topics; t++) {
+        expected += __atomic_load_n(&topicSent[t], __ATOMIC_RELAXED)
+                * topicSubs[t];
+    }
+    for (int idle = 0, waited = 0; idle < 100 && waited < 3000;
+            idle++, waited++) {
+        usleep(10000);
+        unsigned long seen = 0;
+        for (int i = 0; i < config.threads; i++) {
+            seen += __atomic_load_n(&threads[i].received, __ATOMIC_RELAXED);
+        }
+        if (seen >= expected) {
+            break;
+        }
+        if (seen != lastSeen) {
+            idle = 0;
+            lastSeen = seen;
+        }
+    }
+    stopAll = 1;
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+    report(threads, elapsed_secs(&startTime, &pubEnd));
+    return 0;
+}
@@ -0,0 +1,662 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "psproto.h"
+#include "psclib.h"
+
+// Bytes read from the socket at a time
+#define PSC_READ_SIZE (64 * 1024)
+// Queued output written straight away rather than waiting for the loop
+#define PSC_FLUSH_BYTES (256 * 1024)
+// Most publishes psserver takes in one text pubbatch
+#define PSC_MAX_BATCH 10000
+// Events handled per psc_loop_run()
+#define PSC_MAX_EVENTS 64
+
+struct PsClient {
+    PsClientLoop *loop;
+    PsClient *prev, *next;      // loop's list of clients
+    int fd;
+    int binary;
+    int connecting;             // connect() has not finished yet
+    int dead;                   // closed, waiting to be freed
+    int err;                    // a send failed with this errno
+    int events;                 // epoll events registered
+    int helloLeft;              // binary hello bytes still to check
+    PsClientCallbacks callbacks;
+    void *arg;
+    char *out;                  // queued output
+    long outLen, outOff, outCap;
+    char *in;                   // received bytes not yet handled
+    long inLen, inCap;
+};
+
+struct PsClientLoop {
+    int epfd;
+    PsClient *clients;
+    PsClient *dead;             // closed during a run, freed after it
+    int running;
+};
+
+// **********************************************************************
+// Make room for need more bytes of output
+// **********************************************************************
+static void out_reserve(PsClient *client, long need) {
+    if (client->outOff > 0 && client->outOff == client->outLen) {
+        client->outOff = client->outLen = 0;
+    }
+    if (client->outLen + need <= client->outCap) {
+        return;
+    }
+    if (client->outOff > 0) { // slide what is left to the front
+        memmove(client->out, client->out + client->outOff,
+                client->outLen - client->outOff);
+        client->outLen -= client->outOff;
+        client->outOff = 0;
+    }
+    while (client->outLen + need > client->outCap) {
+        client->outCap = client->outCap ? client->outCap * 2 : 8192;
+    }
+    client->out = realloc(client->out, client->outCap);
+}
+
+// **********************************************************************
+// Append bytes to the output queue
+// **********************************************************************
+static void out_append(PsClient *client, char *data, long len) {
+    out_reserve(client, len);
+    memcpy(client->out + client->outLen, data, len);
+    client->outLen += len;
+}
+
+// **********************************************************************
+// Append one binary frame to the output queue
+// **********************************************************************
+static void out_frame(PsClient *client, int opcode, char *name,
+        char *topic, char *payload, uint32_t payloadLen) {
+    int nameLen = strlen(name), topicLen = strlen(topic);
+    out_reserve(client, PSPROTO_HEADER_LEN + nameLen + topicLen
+            + (long)payloadLen);
+    char *p = client->out + client->outLen;
+    psproto_encode((unsigned char*) p, opcode, nameLen, topicLen,
+            payloadLen);
+    p += PSPROTO_HEADER_LEN;
+    memcpy(p, name, nameLen);
+    memcpy(p + nameLen, topic, topicLen);
+    memcpy(p + nameLen + topicLen, payload, payloadLen);
+    client->outLen += PSPROTO_HEADER_LEN + nameLen + topicLen + payloadLen;
+}
+
+// **********************************************************************
+// Append a text command made of up to three parts separated by spaces
+// **********************************************************************
+static void out_line(PsClient *client, char *verb, char *arg, char *rest,
+        uint32_t restLen) {
+    int verbLen = strlen(verb), argLen = strlen(arg);
+    out_reserve(client, verbLen + argLen + (long)restLen + 3);
+    char *p = client->out + client->outLen;
+    memcpy(p, verb, verbLen);
+    p += verbLen;
+    if (argLen > 0) {
+        *p++ = ' ';
+        memcpy(p, arg, argLen);
+        p += argLen;
+    }
+    if (rest != NULL) {
+        *p++ = ' ';
+        memcpy(p, rest, restLen);
+        p += restLen;
+    }
+    *p++ = '\n';
+    client->outLen = p - client->out;
+}
+
+// **********************************************************************
+// Register the events the client needs: always input, and output while
+// connecting or while output is queued
+// **********************************************************************
+static void watch(PsClient *client) {
+    int events = EPOLLIN | EPOLLRDHUP;
+    if (client->connecting || client->outOff < client->outLen) {
+        events |= EPOLLOUT;
+    }
+    if (events != client->events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = client;
+        epoll_ctl(client->loop->epfd, EPOLL_CTL_MOD, client->fd, &ev);
+        client->events = events;
+    }
+}
+
+// **********************************************************************
+// Take a client out of its loop and close its socket. It is freed now,
+// or after the current psc_loop_run() if one is dispatching, since the
+// events it is working through may still point at the client.
+// **********************************************************************
+static void drop(PsClient *client) {
+    PsClientLoop *loop = client->loop;
+    if (client->dead) {
+        return;
+    }
+    client->dead = 1;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        loop->clients = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+    free(client->out);
+    free(client->in);
+    client->out = client->in = NULL;
+    if (loop->running) {
+        client->next = loop->dead;
+        loop->dead = client;
+    } else {
+        free(client);
+    }
+}
+
+// **********************************************************************
+// Report a failed or closed connection and drop it
+// **********************************************************************
+static void fail(PsClient *client, int err) {
+    if (client->dead) {
+        return;
+    }
+    if (client->callbacks.closed != NULL) {
+        client->callbacks.closed(client, err, client->arg);
+    }
+    drop(client);
+}
+
+// Create a loop
+PsClientLoop *psc_loop_new(void) {
+    PsClientLoop *loop = calloc(1, sizeof(PsClientLoop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+// Descriptor to watch for the loop
+int psc_loop_fd(PsClientLoop *loop) {
+    return loop->epfd;
+}
+
+// Close every connection and free the loop
+void psc_loop_free(PsClientLoop *loop) {
+    while (loop->clients != NULL) {
+        drop(loop->clients);
+    }
+    close(loop->epfd);
+    free(loop);
+}
+
+// Start connecting a client
+PsClient *psc_connect(PsClientLoop *loop, char *target, char *name,
+        int binary, PsClientCallbacks *callbacks, void *arg) {
+    struct sockaddr_un uAddr;
+    struct sockaddr_in sAddr;
+    struct sockaddr *addr;
+    socklen_t addrLen;
+    int fd, one = 1;
+    if (strchr(target, '/') != NULL) {
+        memset(&uAddr, 0, sizeof(uAddr));
+        uAddr.sun_family = AF_UNIX;
+        if (strlen(target) >= sizeof(uAddr.sun_path)) {
+            return NULL;
+        }
+        strcpy(uAddr.sun_path, target);
+        addr = (struct sockaddr *)&uAddr;
+        addrLen = sizeof(uAddr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    } else {
+        memset(&sAddr, 0, sizeof(sAddr));
+        sAddr.sin_family = AF_INET;
+        sAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        sAddr.sin_port = htons(atoi(target));
+        addr = (struct sockaddr *)&sAddr;
+        addrLen = sizeof(sAddr);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        // commands are coalesced here, so Nagle would only add delay
+        if (fd >= 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+    if (connect(fd, addr, addrLen) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+    PsClient *client = calloc(1, sizeof(PsClient));
+    client->loop = loop;
+    client->fd = fd;
+    client->binary = binary;
+    client->connecting = 1;
+    client->events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+    if (callbacks != NULL) {
+        client->callbacks = *callbacks;
+    }
+    client->arg = arg;
+    struct epoll_event ev;
+    ev.events = client->events;
+    ev.data.ptr = client;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        free(client);
+        return NULL;
+    }
+    client->next = loop->clients;
+    if (loop->clients != NULL) {
+        loop->clients->prev = client;
+    }
+    loop->clients = client;
+    if (binary) {
+        out_append(client, (char*) PSPROTO_HELLO, PSPROTO_HELLO_LEN);
+        client->helloLeft = PSPROTO_HELLO_LEN;
+        out_frame(client, PS_OP_NAME, name, "", "", 0);
+    } else {
+        out_line(client, "name", name, NULL, 0);
+    }
+    return client;
+}
+
+// Write queued output
+int psc_flush(PsClient *client) {
+    if (client->dead || client->err) {
+        return -1;
+    }
+    if (client->connecting) {
+        return 1;
+    }
+    while (client->outOff < client->outLen) {
+        ssize_t n = send(client->fd, client->out + client->outOff,
+                client->outLen - client->outOff, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0) {
+            // reported through closed() once the loop runs
+            client->err = errno;
+            return -1;
+        }
+        client->outOff += n;
+    }
+    if (client->outOff == client->outLen) {
+        client->outOff = client->outLen = 0;
+    }
+    watch(client);
+    return client->outLen > 0;
+}
+
+// **********************************************************************
+// Called after queueing output. Once plenty has built up it is written
+// at once rather than left for the loop, to keep the queue short.
+// **********************************************************************
+static int queued(PsClient *client) {
+    if (client->outLen - client->outOff >= PSC_FLUSH_BYTES
+            && !client->connecting) {
+        return psc_flush(client) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+// Queue a subscription
+int psc_sub(PsClient *client, char *topic) {
+    if (client->dead || client->err) {
+        return -1;
+    }
+    if (client->binary) {
+        out_frame(client, PS_OP_SUB, "", topic, "", 0);
+    } else {
+        out_line(client, "sub", topic, NULL, 0);
+    }
+    return queued(client);
+}
+
+// Queue an unsubscription
+int psc_unsub(PsClient *client, char *topic) {
+    if (client->dead || client->err) {
+        return -1;
+    }
+    if (client->binary) {
+        out_frame(client, PS_OP_UNSUB, "", topic, "", 0);
+    } else {
+        out_line(client, "unsub", topic, NULL, 0);
+    }
+    return queued(client);
+}
+
+// Queue a publish
+int psc_pub(PsClient *client, char *topic, char *payload,
+        uint32_t payloadLen) {
+    if (client->dead || client->err) {
+        return -1;
+    }
+    if (client->binary) {
+        out_frame(client, PS_OP_PUB, "", topic, payload, payloadLen);
+    } else if (memchr(payload, '\n', payloadLen) != NULL) {
+        return -1;
+    } else {
+        out_line(client, "pub", topic, payload, payloadLen);
+    }
+    return queued(client);
+}
+
+// **********************************************************************
+// Queue publishes as binary PUBBATCH frames, starting a new frame when
+// one would go over the largest payload the server takes
+// **********************************************************************
+static void batch_frames(PsClient *client, PsPub *pubs, int count) {
+    int first = 0;
+    while (first < count) {
+        uint32_t size = 0;
+        int last = first;
+        while (last < count) {
+            uint32_t rec = 6 + strlen(pubs[last].topic)
+                    + pubs[last].payloadLen;
+            if (last > first && size + rec > PSPROTO_MAX_PAYLOAD) {
+                break;
+            }
+            size += rec;
+            last++;
+        }
+        out_reserve(client, PSPROTO_HEADER_LEN + (long)size);
+        char *p = client->out + client->outLen;
+        psproto_encode((unsigned char*) p, PS_OP_PUBBATCH, 0, 0, size);
+        p += PSPROTO_HEADER_LEN;
+        for (int i = first; i < last; i++) {
+            uint16_t topicLen = strlen(pubs[i].topic);
+            uint16_t topicNet = htons(topicLen);
+            uint32_t msgNet = htonl(pubs[i].payloadLen);
+            memcpy(p, &topicNet, 2);
+            memcpy(p + 2, &msgNet, 4);
+            memcpy(p + 6, pubs[i].topic, topicLen);
+            memcpy(p + 6 + topicLen, pubs[i].payload, pubs[i].payloadLen);
+            p += 6 + topicLen + pubs[i].payloadLen;
+        }
+        client->outLen = p - client->out;
+        first = last;
+    }
+}
+
+// Queue a batch of publishes
+int psc_pub_batch(PsClient *client, PsPub *pubs, int count) {
+    char header[32];
+    if (client->dead || client->err) {
+        return -1;
+    }
+    if (client->binary) {
+        batch_frames(client, pubs, count);
+        return queued(client);
+    }
+    for (int i = 0; i < count; i++) {
+        if (memchr(pubs[i].payload, '\n', pubs[i].payloadLen) != NULL) {
+            return -1;
+        }
+    }
+    for (int first = 0; first < count; first += PSC_MAX_BATCH) {
+        int n = count - first < PSC_MAX_BATCH ? count - first
+                : PSC_MAX_BATCH;
+        int len = sprintf(header, "pubbatch %d\n", n);
+        out_append(client, header, len);
+        for (int i = first; i < first + n; i++) {
+            out_line(client, pubs[i].topic, "", pubs[i].payload,
+                    pubs[i].payloadLen);
+        }
+    }
+    return queued(client);
+}
+
+// Queue a ping
+int psc_ping(PsClient *client) {
+    if (client->dead || client->err) {
+        return -1;
+    }
+    if (client->binary) {
+        out_frame(client, PS_OP_PING, "", "", "", 0);
+    } else {
+        out_line(client, "ping", "", NULL, 0);
+    }
+    return queued(client);
+}
+
+// Bytes queued
+long psc_queued(PsClient *client) {
+    return client->outLen - client->outOff;
+}
+
+// Close a client
+void psc_close(PsClient *client) {
+    drop(client);
+}
+
+// **********************************************************************
+// Hand one text line (newline already replaced by a NUL) to the
+// callbacks. Messages look like sender:topic:payload.
+// **********************************************************************
+static void text_line(PsClient *client, char *line, long len) {
+    PsClientCallbacks *cb = &client->callbacks;
+    if (strcmp(line, ":ping") == 0) {
+        out_line(client, "pong", "", NULL, 0);
+    } else if (strcmp(line, ":pong") == 0) {
+        if (cb->pong != NULL) {
+            cb->pong(client, client->arg);
+        }
+    } else if (strcmp(line, ":invalid") == 0) {
+        if (cb->invalid != NULL) {
+            cb->invalid(client, client->arg);
+        }
+    } else if (line[0] != ':' && cb->message != NULL) {
+        char *colon1 = memchr(line, ':', len);
+        char *colon2 = colon1 == NULL ? NULL
+                : memchr(colon1 + 1, ':', len - (colon1 + 1 - line));
+        if (colon2 == NULL) {
+            return;
+        }
+        PsMsg msg = {line, colon1 - line, colon1 + 1, colon2 - colon1 - 1,
+                colon2 + 1, len - (colon2 + 1 - line)};
+        cb->message(client, &msg, client->arg);
+    }
+}
+
+// **********************************************************************
+// Hand one binary frame to the callbacks
+// **********************************************************************
+static void frame_in(PsClient *client, PsFrame *frame, char *body) {
+    PsClientCallbacks *cb = &client->callbacks;
+    switch (frame->opcode) {
+        case PS_OP_MSG:
+            if (cb->message != NULL) {
+                PsMsg msg = {body, frame->nameLen, body + frame->nameLen,
+                        frame->topicLen,
+                        body + frame->nameLen + frame->topicLen,
+                        frame->payloadLen};
+                cb->message(client, &msg, client->arg);
+            }
+            break;
+        case PS_OP_INVALID:
+            if (cb->invalid != NULL) {
+                cb->invalid(client, client->arg);
+            }
+            break;
+        case PS_OP_PING:
+            out_frame(client, PS_OP_PONG, "", "", "", 0);
+            break;
+        case PS_OP_PONG:
+            if (cb->pong != NULL) {
+                cb->pong(client, client->arg);
+            }
+            break;
+    }
+}
+
+// **********************************************************************
+// Handle every complete message in the receive buffer and keep the
+// partial one left at the end. Returns -1 if the server breaks the
+// protocol.
+// **********************************************************************
+static int handle_input(PsClient *client) {
+    char *p = client->in, *end = client->in + client->inLen;
+    if (client->helloLeft > 0) {
+        long n = end - p < client->helloLeft ? end - p : client->helloLeft;
+        long at = PSPROTO_HELLO_LEN - client->helloLeft;
+        if (memcmp(p, PSPROTO_HELLO + at, n) != 0) {
+            return -1;
+        }
+        client->helloLeft -= n;
+        p += n;
+    }
+    while (p < end && !client->dead) {
+        if (client->binary) {
+            PsFrame frame;
+            if (end - p < PSPROTO_HEADER_LEN) {
+                break;
+            }
+            psproto_decode((unsigned char*) p, &frame);
+            if (frame.payloadLen > PSPROTO_MAX_PAYLOAD) {
+                return -1;
+            }
+            long len = psproto_frame_len(&frame);
+            if (end - p < len) {
+                if (len > client->inCap) { // make room for all of it
+                    long off = p - client->in;
+                    client->inCap = len;
+                    client->in = realloc(client->in, client->inCap);
+                    p = client->in + off;
+                    end = client->in + client->inLen;
+                }
+                break;
+            }
+            frame_in(client, &frame, p + PSPROTO_HEADER_LEN);
+            p += len;
+        } else {
+            char *newline = memchr(p, '\n', end - p);
+            if (newline == NULL) {
+                break;
+            }
+            *newline = '\0';
+            text_line(client, p, newline - p);
+            p = newline + 1;
+        }
+    }
+    if (client->dead) {
+        return 0;
+    }
+    client->inLen = end - p;
+    memmove(client->in, p, client->inLen);
+    return 0;
+}
+
+// **********************************************************************
+// Read what the socket holds and handle it
+// **********************************************************************
+static void read_input(PsClient *client) {
+    while (!client->dead) {
+        if (client->inCap - client->inLen < PSC_READ_SIZE) {
+            client->inCap = client->inLen + PSC_READ_SIZE;
+            client->in = realloc(client->in, client->inCap);
+        }
+        long room = client->inCap - client->inLen;
+        ssize_t n = recv(client->fd, client->in + client->inLen, room, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            fail(client, n < 0 ? errno : 0);
+            return;
+        }
+        client->inLen += n;
+        if (handle_input(client) != 0) {
+            fail(client, EPROTO);
+            return;
+        }
+        if (n < room) { // the socket is very likely empty now
+            return;
+        }
+    }
+}
+
+// **********************************************************************
+// The socket of a client still connecting is writable: see whether
+// the connection was made
+// **********************************************************************
+static void finish_connect(PsClient *client) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        fail(client, err);
+        return;
+    }
+    client->connecting = 0;
+    if (client->callbacks.connected != NULL) {
+        client->callbacks.connected(client, client->arg);
+    }
+}
+
+// Run the loop once
+int psc_loop_run(PsClientLoop *loop, int timeoutMs) {
+    struct epoll_event events[PSC_MAX_EVENTS];
+    PsClient *client, *next;
+    loop->running = 1;
+    for (client = loop->clients; client != NULL; client = next) {
+        next = client->next;
+        if (client->err) {
+            fail(client, client->err);
+        } else if (client->outOff < client->outLen) {
+            psc_flush(client);
+        }
+    }
+    int count = epoll_wait(loop->epfd, events, PSC_MAX_EVENTS,
+            loop->dead != NULL ? 0 : timeoutMs);
+    for (int i = 0; i < count; i++) {
+        client = events[i].data.ptr;
+        if (client->dead) {
+            continue;
+        }
+        if (client->connecting && (events[i].events
+                & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            finish_connect(client);
+        }
+        if (!client->dead && !client->connecting
+                && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP
+                | EPOLLERR))) {
+            read_input(client);
+        }
+        if (!client->dead && !client->connecting) {
+            // pongs and anything queued by the callbacks go out now
+            psc_flush(client);
+        }
+    }
+    loop->running = 0;
+    while (loop->dead != NULL) {
+        client = loop->dead;
+        loop->dead = client->next;
+        free(client);
+    }
+    return count;
+}
@@ -0,0 +1,112 @@
+#ifndef PSCLIB_H
+#define PSCLIB_H
+
+#include <stdint.h>
+
+// Event-driven client library for psserver (libpsclient.so), for
+// programs that want to publish and subscribe without psclient's
+// threads and stdio streams. Connections are non-blocking and are
+// driven by an epoll loop: either call psc_loop_run() from your own
+// loop, or watch psc_loop_fd() (an epoll descriptor is itself pollable)
+// alongside your other descriptors and call psc_loop_run() with a
+// timeout of 0 when it is readable.
+//
+// Publishes and subscriptions are queued on the connection and written
+// together the next time the loop runs (or on psc_flush()), so many
+// publishes cost one system call. Messages are handed to the message
+// callback straight out of the receive buffer, without copying.
+//
+// A loop and its connections belong to one thread.
+
+typedef struct PsClient PsClient;
+typedef struct PsClientLoop PsClientLoop;
+
+// A delivered message. The fields point into the connection's receive
+// buffer and are only valid during the callback; copy anything kept.
+// They are not NUL terminated.
+typedef struct PsMsg {
+    char *sender;
+    int senderLen;
+    char *topic;
+    int topicLen;
+    char *payload;
+    uint32_t payloadLen;
+} PsMsg;
+
+// One publish for psc_pub_batch()
+typedef struct PsPub {
+    char *topic;
+    char *payload;
+    uint32_t payloadLen;
+} PsPub;
+
+// Called from psc_loop_run(). Any of them may be NULL. arg is the
+// pointer given to psc_connect().
+typedef struct PsClientCallbacks {
+    // The connection is established
+    void (*connected)(PsClient *client, void *arg);
+    // A message arrived on a subscribed topic
+    void (*message)(PsClient *client, PsMsg *msg, void *arg);
+    // The server refused a command
+    void (*invalid)(PsClient *client, void *arg);
+    // The server answered psc_ping()
+    void (*pong)(PsClient *client, void *arg);
+    // The connection failed or the server closed it (err is an errno
+    // value, 0 for an orderly close). The client is freed once this
+    // returns.
+    void (*closed)(PsClient *client, int err, void *arg);
+} PsClientCallbacks;
+
+// Create a loop. Returns NULL on failure.
+PsClientLoop *psc_loop_new(void);
+
+// Descriptor that is readable when psc_loop_run() has work to do
+int psc_loop_fd(PsClientLoop *loop);
+
+// Write out queued commands, wait up to timeoutMs (-1 for ever) for
+// events and dispatch them to the callbacks. Returns the number of
+// connections that had events, or -1 on error.
+int psc_loop_run(PsClientLoop *loop, int timeoutMs);
+
+// Close every connection (without calling closed()) and free the loop
+void psc_loop_free(PsClientLoop *loop);
+
+// Start connecting to psserver, on a local TCP port or on a Unix domain
+// socket if target is a path, and name the client. binary selects the
+// length-prefixed protocol, which carries any payload bytes; text mode
+// payloads may not hold newlines. Commands may be queued at once and
+// are sent when the connection is up. Returns NULL if the connection
+// cannot even be started.
+PsClient *psc_connect(PsClientLoop *loop, char *target, char *name,
+        int binary, PsClientCallbacks *callbacks, void *arg);
+
+// Queue a subscription or unsubscription. Returns 0, or -1 if the
+// client is closed.
+int psc_sub(PsClient *client, char *topic);
+int psc_unsub(PsClient *client, char *topic);
+
+// Queue a publish. Returns 0, or -1 if the client is closed or, in text
+// mode, the payload holds a newline.
+int psc_pub(PsClient *client, char *topic, char *payload,
+        uint32_t payloadLen);
+
+// Queue count publishes as one pubbatch, which the server delivers
+// together: each subscriber gets all of its messages in one write.
+// Returns 0, or -1 as for psc_pub(), in which case none are queued.
+int psc_pub_batch(PsClient *client, PsPub *pubs, int count);
+
+// Queue a ping; the pong() callback is called when it is answered
+int psc_ping(PsClient *client);
+
+// Write as much queued output as the socket takes now. Returns 0 if it
+// is all written, 1 if some is left (it goes out as the loop runs), or
+// -1 if the client is closed.
+int psc_flush(PsClient *client);
+
+// Bytes queued and not yet written
+long psc_queued(PsClient *client);
+
+// Close the connection and free the client without calling closed()
+void psc_close(PsClient *client);
+
+#endif
@@ -1,18 +1,38 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include "psproto.h"
+#include "psshm.h"
+#include "pshist.h"
 
-typedef struct GlbParms {
-    FILE *serverRead;
-    FILE *serverWrite;
-    int argc;
-    char **argv;
-} GlbParms;
+// Bytes read at a time from stdin or the server
+#define READ_SIZE (64 * 1024)
+// Most messages --bulk sends in one pubbatch, and bytes of stdin it
+// reads at a time
+#define BULK_BATCH 1000
+#define BULK_READ_SIZE (1024 * 1024)
+// Longest name and topic the server takes
+#define MAX_NAME_LEN 29
+#define MAX_TOPIC_LEN 29
+
+// Bytes read from stdin or the server and not yet handled
+typedef struct InBuf {
+    char *data;
+    int len;
+    int cap;
+} InBuf;
 
 //the server socket
 int serverSocket = 0;
@@ -24,130 +44,385 @@ int mySocket = 0;
 struct sockaddr_in myAddr;
 
 //read and write of the server and the clients
-FILE *serverRead, *serverWrite, *myRead;
+FILE *serverWrite, *myRead;
+
+// set by --binary: talk to the server with length-prefixed frames
+int binaryMode = 0;
+
+// set by --shm: take deliveries from a shared memory ring (Unix domain
+// socket connections only)
+int shmMode = 0;
+PsShmRing shmRing;
+
+// the binary hello has already been exchanged
+int helloDone = 0;
+
+// name given on the command line
+char *clientName = "";
+
+// set by --bulk: publish each "topic message" line of this file ("-"
+// for stdin), at --rate messages a second or as fast as the server
+// takes them
+char *bulkPath = NULL;
+long pubRate = 0;
+
+// set by --probe: publish timestamped probes to the one topic given,
+// --count of them (0 for no end), and report how long they take to
+// come back
+int probeMode = 0;
+long probeCount = 0;
+
+// pongs received, so --bulk can tell the server has caught up
+int pongsSeen = 0;
+
+// Latency and loss seen by --probe, over the current report interval
+// and over the whole run
+typedef struct ProbeStats {
+    PsHist oneWay;      // publish to delivery, nanoseconds
+    PsHist roundTrip;   // ping to pong, nanoseconds
+    long sent;
+    long received;
+    long lost;          // skipped over by a later probe
+    long reordered;     // arrived after a later probe
+    long invalid;       // refused by the server
+} ProbeStats;
+
+ProbeStats probeNow, probeAll;
+long probeNextSeq = 0;      // sequence number expected next
+uint64_t pingSentAt = 0;    // time of the ping awaiting its pong, or 0
+
+// Publishes collected by --bulk to send as one pubbatch. Room for the
+// pubbatch command or frame header is left at the front of data.
+typedef struct Bulk {
+    char *data;
+    int len;
+    int cap;
+    int count;
+    long sent;
+    long skipped;
+    struct timespec start;
+    InBuf inbound;
+} Bulk;
 
 // ****************************************************************
-// Read data in wait mode from server
+// Write data to server
 // ****************************************************************
-int read_from_socket(FILE *readStream, char *buffer) {
-    int err = 0;
-    char myBuffer[100];
-    do {
-        if (fgets(myBuffer, 99, readStream) == NULL) {
-            return 10;
-        }
-    } while (strlen(myBuffer) == 0);
-    strcpy(buffer, myBuffer);
-    buffer[strlen(myBuffer) - 1] = '\0';
-    return err;
+void write_to_socket(FILE *writeStream, char *msg) {
+    fprintf(writeStream, "%s\n", msg);
+    fflush(writeStream);
+    fflush(writeStream);
+}
+
+// ****************************************************************
+// Write one binary frame to server
+// ****************************************************************
+void write_frame(FILE *writeStream, int opcode, char *name, char *topic,
+        char *payload, int payloadLen) {
+    unsigned char header[PSPROTO_HEADER_LEN];
+    psproto_encode(header, opcode, strlen(name), strlen(topic), payloadLen);
+    fwrite(header, 1, PSPROTO_HEADER_LEN, writeStream);
+    fwrite(name, 1, strlen(name), writeStream);
+    fwrite(topic, 1, strlen(topic), writeStream);
+    fwrite(payload, 1, payloadLen, writeStream);
+    fflush(writeStream);
 }
 
 // ****************************************************************
-// Read data in no wait mode from server
+// Send a command line to server. In binary mode name, sub, unsub, pub
+// and ping are turned into their frames and anything else is carried in a
+// TEXT frame for the server to parse. The lines following a pubbatch
+// command always go as TEXT frames so they stay part of the batch.
 // ****************************************************************
-int read_no_wait_from_socket(FILE *readStream, char *buffer) {
-    char myBuffer[300];
-    if (fgets(myBuffer, 299, readStream) == NULL) {
-        return 10;
+void send_command(FILE *writeStream, char *line) {
+    static int batchLeft = 0;
+    if (!binaryMode) {
+        write_to_socket(writeStream, line);
+        return;
     }
-    if (strlen(myBuffer) > 0) {
-        strcpy(buffer, myBuffer);
-        buffer[strlen(myBuffer) - 1] = '\0';
-        return 1;
+    char verb[16], arg[256];
+    int used = 0;
+    if (batchLeft > 0) {
+        batchLeft--;
+    } else if (strcmp(line, "ping") == 0) {
+        // answered with a PONG frame rather than a text line
+        write_frame(writeStream, PS_OP_PING, "", "", "", 0);
+        return;
+    } else if (sscanf(line, " %15s %255s %n", verb, arg, &used) >= 2
+            && used > 0) {
+        char *rest = line + used;
+        if (strcmp(verb, "pubbatch") == 0 && strlen(rest) == 0) {
+            batchLeft = atoi(arg);
+        }
+        if (strcmp(verb, "name") == 0 && strlen(rest) == 0) {
+            write_frame(writeStream, PS_OP_NAME, arg, "", "", 0);
+            return;
+        }
+        if (strcmp(verb, "sub") == 0 && strlen(rest) == 0) {
+            write_frame(writeStream, PS_OP_SUB, "", arg, "", 0);
+            return;
+        }
+        if (strcmp(verb, "unsub") == 0 && strlen(rest) == 0) {
+            write_frame(writeStream, PS_OP_UNSUB, "", arg, "", 0);
+            return;
+        }
+        if (strcmp(verb, "pub") == 0 && strlen(rest) > 0) {
+            write_frame(writeStream, PS_OP_PUB, "", arg, rest, strlen(rest));
+            return;
+        }
     }
-    return 0;
+    write_frame(writeStream, PS_OP_TEXT, "", "", line, strlen(line));
 }
 
+void process_message(char *message);
+void probe_received(char *sender, int senderLen, char *payload,
+        int payloadLen);
+void probe_record(PsHist *hist, uint64_t ns);
+uint64_t now_ns(void);
+
 // ****************************************************************
-// Write data to server
+// Print one frame from server the way a text message would look
 // ****************************************************************
-void write_to_socket(FILE *writeStream, char *msg) {
-    fprintf(writeStream, "%s\n", msg);
-    fflush(writeStream);
-    fflush(writeStream);
+void print_frame(PsFrame *frame, char *body) {
+    if (frame->opcode == PS_OP_MSG && probeMode) {
+        probe_received(body, frame->nameLen,
+                body + frame->nameLen + frame->topicLen, frame->payloadLen);
+    } else if (frame->opcode == PS_OP_MSG) {
+        fprintf(stdout, "%.*s:%.*s:", frame->nameLen, body, frame->topicLen,
+                body + frame->nameLen);
+        fwrite(body + frame->nameLen + frame->topicLen, 1,
+                frame->payloadLen, stdout);
+        fprintf(stdout, "\n");
+    } else if (frame->opcode == PS_OP_INVALID) {
+        process_message(":invalid");
+    } else if (frame->opcode == PS_OP_PING) {
+        write_frame(serverWrite, PS_OP_PONG, "", "", "", 0);
+    } else if (frame->opcode == PS_OP_PONG) {
+        process_message(":pong");
+    }
 }
 
 // ****************************************************************
-// Read data in no wait mode from server. Ignore invalid messages and 
-// 0 length messages.
+// Print messages for client. The server's heartbeat is answered
+// instead of printed.
 // ****************************************************************
-void get_msg_from_server(FILE *serverStream) {
-    char *message = (char*)malloc(sizeof(char) * 1000);
-    int err = read_from_socket(serverStream, message);
-    if (err != 0) {
+void process_message(char *message){
+    if (strcmp(message, ":ping") == 0) {
+        write_to_socket(serverWrite, "pong");
+        return;
+    }
+    if (strcmp(message, ":pong") == 0) {
+        pongsSeen++;
+        if (probeMode && pingSentAt != 0) {
+            probe_record(&probeNow.roundTrip, now_ns() - pingSentAt);
+            pingSentAt = 0;
+        }
+        if (bulkPath != NULL || probeMode) {
+            return;
+        }
+    }
+    if (probeMode && strcmp(message, ":invalid") == 0) {
+        probeNow.invalid++;
+        probeAll.invalid++;
+        return;
+    }
+    char *colon1 = strchr(message, ':');
+    char *colon2 = colon1 == NULL ? NULL : strchr(colon1 + 1, ':');
+    if (probeMode && colon2 != NULL && colon1 != message) {
+        probe_received(message, colon1 - message, colon2 + 1,
+                strlen(colon2 + 1));
         return;
     }
+    fprintf(stdout, "%s\n", message);
 }
 
 // ****************************************************************
-// Print messages for client
+// Make room in an input buffer for a read of at least READ_SIZE bytes,
+// or for need bytes in all
 // ****************************************************************
-void process_message(char *message){
-    fprintf(stdout, "%s\n", message);
-    fflush(stdout);
+void in_reserve(InBuf *in, int need) {
+    if (need < in->len + READ_SIZE) {
+        need = in->len + READ_SIZE;
+    }
+    if (need > in->cap) {
+        in->cap = need;
+        in->data = realloc(in->data, in->cap);
+    }
 }
 
 // ****************************************************************
-// Process all inbound messages
+// Handle every complete message from server in the buffer, keeping a
+// partial one for the next read. Output is flushed once at the end
+// rather than per message. Returns -1 if the server does not speak
+// binary mode when asked to.
 // ****************************************************************
-void *process_inward_messages(void *args) {
-    char msg[300];
-    GlbParms *parm = (GlbParms*)args;
-    while (1) {
-        int retCd = read_no_wait_from_socket(parm->serverRead, msg);
-        if (strlen(msg) > 0) {
-            //printf("process_inward_messages: retCd=%d\n",retCd);
+int process_inbound(InBuf *in) {
+    char *p = in->data, *end = in->data + in->len;
+    size_t need = 0;
+    if (binaryMode && !helloDone) {
+        if (end - p < PSPROTO_HELLO_LEN) {
+            return 0;
         }
-        if (retCd == 1) {
-            process_message(msg);
-        } else if (retCd > 1) {
-            //fprintf(stderr, "psclient: server connection terminated\n");
-            //fflush(stderr);
-            //exit(4);
-            //break;
+        if (memcmp(p, PSPROTO_HELLO, PSPROTO_HELLO_LEN) != 0) {
+            return -1;
         }
-        usleep(100);
+        helloDone = 1;
+        p += PSPROTO_HELLO_LEN;
     }
-    return NULL;
+    while (p < end) {
+        if (binaryMode) {
+            PsFrame frame;
+            if (end - p < PSPROTO_HEADER_LEN) {
+                break;
+            }
+            psproto_decode((unsigned char*) p, &frame);
+            size_t len = psproto_frame_len(&frame);
+            if (end - p < len) {
+                need = len; // room for all of it once moved to the front
+                break;
+            }
+            print_frame(&frame, p + PSPROTO_HEADER_LEN);
+            p += len;
+        } else {
+            char *newline = memchr(p, '\n', end - p);
+            if (newline == NULL) {
+                break;
+            }
+            *newline = '\0';
+            process_message(p);
+            p = newline + 1;
+        }
+    }
+    in->len = end - p;
+    memmove(in->data, p, in->len);
+    in_reserve(in, need);
+    fflush(stdout);
+    return 0;
 }
 
 // ****************************************************************
-// Process interactive chat with server. repeatedly get input and 
-// send to client. start another thread to process inbound messages 
-// from server.
+// Read whatever the server has sent, over the socket or the shared
+// memory ring, and handle it. Returns -1 once the server has gone.
 // ****************************************************************
-void process_chat(FILE *inServerRead, FILE *inServerWrite,
-        int inArgc, char **inArgv){
-    //char myBuffer[100], message[256];
+int read_server(InBuf *in) {
+    if (shmMode) {
+        int got, ack;
+        do {
+            in_reserve(in, 0);
+            got = psshm_read(&shmRing, in->data + in->len,
+                    in->cap - in->len, &ack);
+            if (ack) {
+                psshm_send_ack(serverSocket, binaryMode);
+            }
+            in->len += got;
+            process_inbound(in);
+        } while (got > 0);
+        // nothing else should arrive on the socket but its closing
+        char drop[256];
+        int len = recv(serverSocket, drop, sizeof(drop), MSG_DONTWAIT);
+        return len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)
+                ? -1 : 0;
+    }
+    in_reserve(in, 0);
+    int len = read(serverSocket, in->data + in->len, in->cap - in->len);
+    if (len < 0 && errno == EINTR) {
+        return 0;
+    }
+    if (len <= 0) {
+        return -1;
+    }
+    in->len += len;
+    if (process_inbound(in) != 0) {
+        fprintf(stderr, "psclient: server does not support binary mode\n");
+        fflush(stderr);
+        exit(4);
+    }
+    return 0;
+}
+
+// ****************************************************************
+// Send every complete line typed so far to server. At end of input
+// any last line without a newline is sent too.
+// ****************************************************************
+void process_input(InBuf *in, int atEof) {
+    char *p = in->data, *end = in->data + in->len;
+    char *newline;
+    while ((newline = memchr(p, '\n', end - p)) != NULL) {
+        *newline = '\0';
+        send_command(serverWrite, p);
+        p = newline + 1;
+    }
+    in->len = end - p;
+    memmove(in->data, p, in->len);
+    if (atEof && in->len > 0) {
+        in->data[in->len] = '\0';
+        send_command(serverWrite, in->data);
+        in->len = 0;
+    }
+}
+
+// ****************************************************************
+// Process interactive chat with server. One loop waits on both stdin
+// and the server (or its shared memory ring), so nothing is read until
+// there is something to read, and each read takes as many lines or
+// messages as have arrived. Returns at end of input; exits if the
+// server goes away.
+// ****************************************************************
+void process_chat(int inArgc, char **inArgv){
     char myBuffer[100];
-    char *retStr;
-    pthread_t myID;
-    GlbParms *parms;
-    parms = (GlbParms*) malloc(sizeof(GlbParms));
-    parms->serverRead = serverRead;
-    parms->serverWrite = serverWrite;
-    parms->argc = inArgc;
-    parms->argv = inArgv;
-    pthread_create(&myID, NULL, &process_inward_messages, (void*)parms);
-    sprintf(myBuffer, "name %s", inArgv[2]);
-    write_to_socket(serverWrite, myBuffer);
+    InBuf input = {NULL, 0, 0}, inbound = {NULL, 0, 0};
+    if (binaryMode && !helloDone) {
+        fwrite(PSPROTO_HELLO, 1, PSPROTO_HELLO_LEN, serverWrite);
+    }
+    snprintf(myBuffer, sizeof(myBuffer), "name %s", inArgv[2]);
+    send_command(serverWrite, myBuffer);
     for (int i = 3; i < inArgc; i++) {
-        sprintf(myBuffer, "sub %s", inArgv[i]);
-        write_to_socket(serverWrite, myBuffer);
+        snprintf(myBuffer, sizeof(myBuffer), "sub %s", inArgv[i]);
+        send_command(serverWrite, myBuffer);
+    }
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+            {serverSocket, POLLIN, 0}, {-1, POLLIN, 0}};
+    if (shmMode) {
+        fds[2].fd = shmRing.eventfd;
     }
     while (1) {
-        char msg[1024];
-        retStr = fgets(msg, 1023, stdin);
-        if (retStr == NULL) {
+        if (shmMode && psshm_prepare_wait(&shmRing)) {
+            // arrived while getting ready: poll() is skipped, so what it
+            // said last time about stdin and the socket no longer holds
+            fds[0].revents = fds[1].revents = 0;
+            fds[2].revents = POLLIN;
+        } else if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             break;
         }
-        retStr = strchr(msg, '\n');
-        if (retStr != NULL) {
-            *retStr = '\0';
+        if (shmMode) {
+            psshm_end_wait(&shmRing);
+        }
+        if ((fds[1].revents || fds[2].revents) && read_server(&inbound)) {
+            fprintf(stderr, "psclient: server connection terminated\n");
+            fflush(stderr);
+            exit(4);
+        }
+        fds[2].revents = 0;
+        if (fds[0].revents) {
+            // one byte spare for the NUL after a last unfinished line
+            in_reserve(&input, input.len + READ_SIZE + 1);
+            int len = read(STDIN_FILENO, input.data + input.len, READ_SIZE);
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            if (len > 0) {
+                input.len += len;
+            }
+            process_input(&input, len <= 0);
+            if (len <= 0) {
+                break;
+            }
         }
-        write_to_socket(serverWrite, msg);
     }
-
+    free(input.data);
+    free(inbound.data);
 }
 
 // ****************************************************************
@@ -188,28 +463,421 @@ int is_numeric(char *str){
     return 0;
 }
 
+// ****************************************************************
+// Write all of len bytes to server
+// ****************************************************************
+void send_all(char *data, int len) {
+    int fd = fileno(serverWrite);
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "psclient: server connection terminated\n");
+            fflush(stderr);
+            exit(4);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// ****************************************************************
+// Handle anything the server has sent without waiting for more, or
+// wait up to timeoutMs for it
+// ****************************************************************
+void poll_server(InBuf *inbound, int timeoutMs) {
+    struct pollfd fds[2] = {{serverSocket, POLLIN, 0}, {-1, POLLIN, 0}};
+    if (shmMode) {
+        fds[1].fd = shmRing.eventfd;
+        if (psshm_prepare_wait(&shmRing)) {
+            timeoutMs = 0;
+        }
+    }
+    int ready = poll(fds, 2, timeoutMs);
+    if (shmMode) {
+        psshm_end_wait(&shmRing);
+    }
+    if ((ready > 0 || shmMode) && read_server(inbound) != 0) {
+        fprintf(stderr, "psclient: server connection terminated\n");
+        fflush(stderr);
+        exit(4);
+    }
+}
+
+// ****************************************************************
+// Send the publishes collected so far as one pubbatch. With --rate it
+// first waits until the first of them is due.
+// ****************************************************************
+void bulk_flush(Bulk *bulk) {
+    char header[16];
+    int len;
+    if (bulk->count == 0) {
+        return;
+    }
+    if (pubRate > 0) {
+        struct timespec due = bulk->start;
+        long long ns = due.tv_nsec + bulk->sent * 1000000000LL / pubRate;
+        due.tv_sec += ns / 1000000000LL;
+        due.tv_nsec = ns % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+                == EINTR) {
+        }
+    }
+    if (binaryMode) {
+        len = PSPROTO_HEADER_LEN;
+        psproto_encode((unsigned char*) header, PS_OP_PUBBATCH, 0, 0,
+                bulk->len - sizeof(header));
+    } else {
+        len = sprintf(header, "pubbatch %d\n", bulk->count);
+    }
+    // the header goes just before the records
+    memcpy(bulk->data + sizeof(header) - len, header, len);
+    send_all(bulk->data + sizeof(header) - len,
+            bulk->len - sizeof(header) + len);
+    bulk->sent += bulk->count;
+    bulk->count = 0;
+    bulk->len = sizeof(header);
+    // answer pings and show any invalid responses as we go
+    poll_server(&bulk->inbound, 0);
+}
+
+// ****************************************************************
+// Add one "topic message" line to the pubbatch being collected. Lines
+// without a valid topic and a message are counted and left out.
+// ****************************************************************
+void bulk_line(Bulk *bulk, char *line, int len) {
+    char topic[MAX_TOPIC_LEN + 1];
+    char *space = memchr(line, ' ', len);
+    int topicLen = space == NULL ? 0 : space - line;
+    int msgLen = len - topicLen - 1;
+    if (topicLen < 1 || topicLen > MAX_TOPIC_LEN || msgLen < 1
+            || msgLen > PSPROTO_MAX_PAYLOAD / 2) {
+        bulk->skipped++;
+        return;
+    }
+    memcpy(topic, line, topicLen);
+    topic[topicLen] = '\0';
+    if (valid_name(topic) || topic[0] == '$') {
+        bulk->skipped++;
+        return;
+    }
+    if (bulk->len + len + 7 > bulk->cap) {
+        bulk->cap = (bulk->len + len + 7) * 2;
+        bulk->data = realloc(bulk->data, bulk->cap);
+    }
+    char *p = bulk->data + bulk->len;
+    if (binaryMode) {
+        uint16_t topicNet = htons(topicLen);
+        uint32_t msgNet = htonl(msgLen);
+        memcpy(p, &topicNet, 2);
+        memcpy(p + 2, &msgNet, 4);
+        memcpy(p + 6, topic, topicLen);
+        memcpy(p + 6 + topicLen, space + 1, msgLen);
+        bulk->len += 6 + topicLen + msgLen;
+    } else { // already in the form pubbatch lines take
+        memcpy(p, line, len);
+        p[len] = '\n';
+        bulk->len += len + 1;
+    }
+    bulk->count++;
+    int most = pubRate > 0 && pubRate / 100 < BULK_BATCH
+            ? pubRate / 100 + 1 : BULK_BATCH;
+    if (bulk->count >= most || bulk->len >= PSPROTO_MAX_PAYLOAD / 2) {
+        bulk_flush(bulk);
+    }
+}
+
+// ****************************************************************
+// Add every complete line in data to the pubbatch, and at end of input
+// a last line without a newline too. Returns the bytes used.
+// ****************************************************************
+long bulk_lines(Bulk *bulk, char *data, long len, int atEof) {
+    char *p = data, *end = data + len, *newline;
+    while ((newline = memchr(p, '\n', end - p)) != NULL) {
+        bulk_line(bulk, p, newline - p);
+        p = newline + 1;
+    }
+    if (atEof && p < end) {
+        bulk_line(bulk, p, end - p);
+        p = end;
+    }
+    return p - data;
+}
+
+// ****************************************************************
+// Publish a whole file or stdin as a run of pubbatches, then wait for
+// the server to answer a ping so every publish is known to have been
+// handled, and report the rate achieved. A file is mapped rather than
+// read; stdin is read a large block at a time.
+// ****************************************************************
+void bulk_publish(int inArgc, char **inArgv) {
+    char myBuffer[100];
+    Bulk bulk;
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.len = 16;
+    bulk.cap = 1024 * 1024;
+    bulk.data = malloc(bulk.cap);
+    if (binaryMode && !helloDone) {
+        fwrite(PSPROTO_HELLO, 1, PSPROTO_HELLO_LEN, serverWrite);
+    }
+    snprintf(myBuffer, sizeof(myBuffer), "name %s", inArgv[2]);
+    send_command(serverWrite, myBuffer);
+    for (int i = 3; i < inArgc; i++) {
+        snprintf(myBuffer, sizeof(myBuffer), "sub %s", inArgv[i]);
+        send_command(serverWrite, myBuffer);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &bulk.start);
+    if (strcmp(bulkPath, "-") != 0) {
+        struct stat st;
+        int fd = open(bulkPath, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "psclient: unable to read %s\n", bulkPath);
+            fflush(stderr);
+            exit(5);
+        }
+        if (st.st_size > 0) {
+            char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                fprintf(stderr, "psclient: unable to read %s\n", bulkPath);
+                fflush(stderr);
+                exit(5);
+            }
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            bulk_lines(&bulk, map, st.st_size, 1);
+            munmap(map, st.st_size);
+        }
+        close(fd);
+    } else {
+        char *buf = malloc(BULK_READ_SIZE);
+        long have = 0;
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, buf + have, BULK_READ_SIZE - have);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            have += n > 0 ? n : 0;
+            long used = bulk_lines(&bulk, buf, have, n <= 0);
+            if (used == 0 && have == BULK_READ_SIZE) {
+                used = have; // a line longer than the buffer
+                bulk.skipped++;
+            }
+            have -= used;
+            memmove(buf, buf + used, have);
+        } while (n > 0);
+        free(buf);
+    }
+    bulk_flush(&bulk);
+    send_command(serverWrite, "ping");
+    while (pongsSeen == 0) {
+        poll_server(&bulk.inbound, -1);
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - bulk.start.tv_sec)
+            + (end.tv_nsec - bulk.start.tv_nsec) / 1e9;
+    fprintf(stderr, "psclient: published %ld msgs in %.3fs (%.0f msgs/s),"
+            " %ld lines skipped\n", bulk.sent, secs,
+            secs > 0 ? bulk.sent / secs : 0, bulk.skipped);
+    fflush(stderr);
+    free(bulk.data);
+    free(bulk.inbound.data);
+}
+
+// ****************************************************************
+// Nanoseconds on the monotonic clock
+// ****************************************************************
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ****************************************************************
+// Record one latency in the current interval and the whole run
+// ****************************************************************
+void probe_record(PsHist *hist, uint64_t ns) {
+    pshist_record(hist, ns);
+    pshist_record(hist == &probeNow.oneWay ? &probeAll.oneWay
+            : &probeAll.roundTrip, ns);
+}
+
+// ****************************************************************
+// Check a message delivered in --probe mode. Probes are "probe seq
+// time" from this client; a gap in the sequence counts the missing
+// probes as lost, and one turning up late after all counts as
+// reordered. Anything else on the topic is ignored.
+// ****************************************************************
+void probe_received(char *sender, int senderLen, char *payload,
+        int payloadLen) {
+    char text[64];
+    long seq;
+    unsigned long long sentAt;
+    uint64_t now = now_ns();
+    if (payloadLen >= sizeof(text) || senderLen != strlen(clientName)
+            || memcmp(sender, clientName, senderLen) != 0) {
+        return;
+    }
+    memcpy(text, payload, payloadLen);
+    text[payloadLen] = '\0';
+    if (sscanf(text, "probe %ld %llu", &seq, &sentAt) != 2) {
+        return;
+    }
+    probe_record(&probeNow.oneWay, now - sentAt);
+    probeNow.received++;
+    probeAll.received++;
+    if (seq >= probeNextSeq) {
+        probeNow.lost += seq - probeNextSeq;
+        probeAll.lost += seq - probeNextSeq;
+        probeNextSeq = seq + 1;
+    } else {
+        probeNow.reordered++;
+        probeAll.reordered++;
+    }
+}
+
+// ****************************************************************
+// Print one line of --probe results
+// ****************************************************************
+void probe_report(char *label, ProbeStats *stats) {
+    fprintf(stdout, "probe %s: sent %ld recv %ld lost %ld reordered %ld"
+            " invalid %ld | one-way usec p50 %.1f p99 %.1f p999 %.1f"
+            " max %.1f | rtt usec p50 %.1f p99 %.1f max %.1f\n", label,
+            stats->sent, stats->received, stats->lost, stats->reordered,
+            stats->invalid,
+            pshist_percentile(&stats->oneWay, 50) / 1e3,
+            pshist_percentile(&stats->oneWay, 99) / 1e3,
+            pshist_percentile(&stats->oneWay, 99.9) / 1e3,
+            stats->oneWay.max / 1e3,
+            pshist_percentile(&stats->roundTrip, 50) / 1e3,
+            pshist_percentile(&stats->roundTrip, 99) / 1e3,
+            stats->roundTrip.max / 1e3);
+    fflush(stdout);
+}
+
+// ****************************************************************
+// Run as a latency probe: subscribe to the topic, publish probes to it
+// at --rate a second (100 by default), each carrying its sequence
+// number and send time, and ping the server alongside for the round
+// trip. Results are printed every second and, once --count probes
+// have been sent and the last has had a second to arrive, for the
+// whole run.
+// ****************************************************************
+void probe_run(int inArgc, char **inArgv) {
+    char myBuffer[100];
+    InBuf inbound = {NULL, 0, 0};
+    long rate = pubRate > 0 ? pubRate : 100;
+    memset(&probeNow, 0, sizeof(probeNow));
+    memset(&probeAll, 0, sizeof(probeAll));
+    pshist_init(&probeNow.oneWay);
+    pshist_init(&probeNow.roundTrip);
+    pshist_init(&probeAll.oneWay);
+    pshist_init(&probeAll.roundTrip);
+    if (binaryMode && !helloDone) {
+        fwrite(PSPROTO_HELLO, 1, PSPROTO_HELLO_LEN, serverWrite);
+    }
+    snprintf(myBuffer, sizeof(myBuffer), "name %s", inArgv[2]);
+    send_command(serverWrite, myBuffer);
+    snprintf(myBuffer, sizeof(myBuffer), "sub %s", inArgv[3]);
+    send_command(serverWrite, myBuffer);
+    uint64_t start = now_ns(), nextReport = start + 1000000000ULL;
+    uint64_t finishBy = 0;
+    long seq = 0;
+    while (finishBy == 0 || (now_ns() < finishBy
+            && probeAll.received < seq)) {
+        uint64_t now = now_ns();
+        uint64_t due = start + seq * 1000000000ULL / rate;
+        if (finishBy == 0 && now >= due) {
+            snprintf(myBuffer, sizeof(myBuffer), "pub %s probe %ld %llu",
+                    inArgv[3], seq, (unsigned long long)now_ns());
+            send_command(serverWrite, myBuffer);
+            if (pingSentAt == 0) {
+                pingSentAt = now_ns();
+                send_command(serverWrite, "ping");
+            }
+            probeNow.sent++;
+            probeAll.sent++;
+            if (++seq == probeCount) {
+                finishBy = now_ns() + 1000000000ULL;
+            }
+            continue;
+        }
+        if (now >= nextReport) {
+            probe_report("1s", &probeNow);
+            memset(&probeNow, 0, sizeof(probeNow));
+            pshist_init(&probeNow.oneWay);
+            pshist_init(&probeNow.roundTrip);
+            nextReport += 1000000000ULL;
+        }
+        uint64_t wake = finishBy != 0 ? finishBy : due;
+        wake = wake < nextReport ? wake : nextReport;
+        poll_server(&inbound, wake > now ? (wake - now) / 1000000 + 1 : 0);
+    }
+    // anything not back by now is lost, late arrivals included
+    probeAll.lost = probeAll.sent - probeAll.received;
+    probe_report("total", &probeAll);
+    free(inbound.data);
+}
+
+// ****************************************************************
+// Handle options given before the port number. Returns the number of
+// arguments used.
+// ****************************************************************
+int parse_options(int argc, char **argv) {
+    int used = 0;
+    while (used + 1 < argc && strncmp(argv[used + 1], "--", 2) == 0) {
+        if (strcmp(argv[used + 1], "--binary") == 0) {
+            binaryMode = 1;
+        } else if (strcmp(argv[used + 1], "--shm") == 0) {
+            shmMode = 1;
+        } else if (strcmp(argv[used + 1], "--bulk") == 0
+                && used + 2 < argc) {
+            bulkPath = argv[++used + 1];
+        } else if (strcmp(argv[used + 1], "--rate") == 0
+                && used + 2 < argc) {
+            pubRate = atol(argv[++used + 1]);
+        } else if (strcmp(argv[used + 1], "--probe") == 0) {
+            probeMode = 1;
+        } else if (strcmp(argv[used + 1], "--count") == 0
+                && used + 2 < argc) {
+            probeCount = atol(argv[++used + 1]);
+        } else {
+            break;
+        }
+        used++;
+    }
+    return used;
+}
+
 // ****************************************************************
 // Validate all arguments passed to program
 // ****************************************************************
 int check_parms(int argc, char **argv){
-    if (argc < 3) {
-        fprintf(stderr, "Usage: psclient portnum name [topic] ...\n");
+    if (argc < 3 || (probeMode && (argc != 4 || bulkPath != NULL))) {
+        fprintf(stderr, "Usage: psclient [--binary] [--shm] [--bulk file|-"
+                " | --probe [--count n]] [--rate msgs/s] portnum|socketpath"
+                " name [topic] ...\n");
         fflush(stderr);
         return 1;
     }
-    if (valid_name(argv[2])) {
+    if (valid_name(argv[2]) || strlen(argv[2]) > MAX_NAME_LEN) {
         fprintf(stderr, "psclient: invalid name\n");
         fflush(stderr);
         return 2;
     }
     for (int i = 3; i < argc; i++) {
-        if (valid_name(argv[i])) {
+        if (valid_name(argv[i]) || strlen(argv[i]) > MAX_TOPIC_LEN) {
             fprintf(stderr, "psclient: invalid topic\n");
             fflush(stderr);
             return 2;
         }
     }
 
+    if (strchr(argv[1], '/') != NULL) {
+        return 0; // Unix domain socket path
+    }
     if (is_numeric(argv[1])) {
         fprintf(stderr, "psclient: unable to connect to port %s\n",argv[1]);
         fflush(stderr);
@@ -224,33 +892,68 @@ int check_parms(int argc, char **argv){
     return 0;
 }
 
+// ****************************************************************
+// Connect to the server on a local TCP port, or on a Unix domain
+// socket if target is a path. Returns -1 on failure.
+// ****************************************************************
+int connect_server(char *target) {
+    if (strchr(target, '/') != NULL) {
+        struct sockaddr_un uAddr;
+        memset(&uAddr, 0, sizeof(uAddr));
+        uAddr.sun_family = AF_UNIX;
+        if (strlen(target) >= sizeof(uAddr.sun_path)) {
+            return -1;
+        }
+        strcpy(uAddr.sun_path, target);
+        serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        return connect(serverSocket, (struct sockaddr *)&uAddr,
+                sizeof(uAddr));
+    }
+    struct sockaddr_in sAddr;
+    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    sAddr.sin_port = htons(atoi(target));
+    return connect(serverSocket, (struct sockaddr *)&sAddr, sizeof(sAddr));
+}
+
 // ****************************************************************
 // Main function. Initiates socket connections and calls function 
 // to process chat
 // ****************************************************************
 int main(int argc, char **argv){
+    int used = parse_options(argc, argv);
+    argv[used] = argv[0];
+    argc -= used;
+    argv += used;
     int retCd = check_parms(argc, argv);
     if (retCd != 0) {
         return retCd;
     }
-    int mainPort = atoi(argv[1]);
-
-    struct sockaddr_in sAddr;
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    sAddr.sin_family = AF_INET;
-    sAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    sAddr.sin_port = htons(mainPort);
-    int err = connect(serverSocket, (struct sockaddr *)&sAddr, sizeof(sAddr));
+    int err = connect_server(argv[1]);
     if (err == -1) {
-        fprintf(stderr, "psclient: unable to connect to port %d\n",mainPort);
+        fprintf(stderr, "psclient: unable to connect to port %s\n",argv[1]);
         fflush(stderr);
         return 3;
     }
     int socketWrite = dup(serverSocket);
-    serverRead = fdopen(serverSocket, "r");
+    if (shmMode) {
+        helloDone = binaryMode;
+        if (psshm_request(serverSocket, binaryMode, &shmRing) != 0) {
+            fprintf(stderr, "psclient: shared memory ring unavailable\n");
+            fflush(stderr);
+            shmMode = 0;
+        }
+    }
     serverWrite = fdopen(socketWrite, "w");
-    process_chat(serverRead, serverWrite, argc, argv);
-    fclose(serverRead);
+    clientName = argv[2];
+    if (bulkPath != NULL) {
+        bulk_publish(argc, argv);
+    } else if (probeMode) {
+        probe_run(argc, argv);
+    } else {
+        process_chat(argc, argv);
+    }
     fclose(serverWrite);
     close(serverSocket);
     close(socketWrite);
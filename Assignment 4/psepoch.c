@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "psepoch.h"
+
+// Retired objects a thread collects before it looks for ones to free
+#define RETIRE_BATCH 64
+
+// An object waiting to be freed, and the epoch it was retired in
+typedef struct Retired {
+    void *ptr;
+    void (*freeFn)(void *);
+    uint64_t epoch;
+    struct Retired *next;
+} Retired;
+
+// Per-thread state. active is the epoch the thread entered its current
+// read section in, or 0 outside one. Each slot has its own cache line so
+// readers never write to a line another thread writes. retired is what
+// the thread has retired and not yet freed; lock guards it against
+// psepoch_reclaim() and is otherwise only taken by the owner.
+typedef struct EpochSlot {
+    uint64_t active;
+    int depth;
+    struct EpochSlot *next;
+    pthread_mutex_t lock;
+    Retired *retired;
+    int retiredCount;
+} __attribute__((aligned(64))) EpochSlot;
+
+static uint64_t globalEpoch = 1;
+static EpochSlot *slots;
+static Retired *orphans;        // left by threads that have exited
+static pthread_mutex_t epochLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t epochOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t slotKey;
+static __thread EpochSlot *mySlot;
+
+// **********************************************************************
+// Thread exit: forget the thread's slot. Whatever it retired and could
+// not free yet is left for psepoch_reclaim().
+// **********************************************************************
+static void remove_slot(void *arg) {
+    EpochSlot *slot = arg, **prev;
+    pthread_mutex_lock(&epochLock);
+    for (prev = &slots; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == slot) {
+            *prev = slot->next;
+            break;
+        }
+    }
+    while (slot->retired != NULL) {
+        Retired *item = slot->retired;
+        slot->retired = item->next;
+        item->next = orphans;
+        orphans = item;
+    }
+    pthread_mutex_unlock(&epochLock);
+    pthread_mutex_destroy(&slot->lock);
+    free(slot);
+}
+
+static void init_slots(void) {
+    pthread_key_create(&slotKey, remove_slot);
+}
+
+// **********************************************************************
+// The calling thread's slot, created on first use
+// **********************************************************************
+static EpochSlot *my_slot(void) {
+    if (mySlot != NULL) {
+        return mySlot;
+    }
+    pthread_once(&epochOnce, init_slots);
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(EpochSlot)) != 0) {
+        abort();
+    }
+    EpochSlot *slot = mem;
+    slot->active = 0;
+    slot->depth = 0;
+    pthread_mutex_init(&slot->lock, NULL);
+    slot->retired = NULL;
+    slot->retiredCount = 0;
+    pthread_mutex_lock(&epochLock);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&epochLock);
+    pthread_setspecific(slotKey, slot);
+    mySlot = slot;
+    return slot;
+}
+
+// **********************************************************************
+// Oldest epoch any reader is still in, or the current epoch if that is
+// older: whatever is retired after the scan, into a list another thread
+// is about to sweep, may already be held by a reader the scan missed.
+// Called with epochLock held.
+// **********************************************************************
+static uint64_t oldest_active(void) {
+    uint64_t oldest = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (EpochSlot *slot = slots; slot != NULL; slot = slot->next) {
+        uint64_t active = __atomic_load_n(&slot->active, __ATOMIC_ACQUIRE);
+        if (active != 0 && active < oldest) {
+            oldest = active;
+        }
+    }
+    return oldest;
+}
+
+// **********************************************************************
+// Move everything on list retired before oldest onto ready. Readers that
+// entered in epoch e may hold anything retired in e or later, so only
+// what was retired before the oldest reader's epoch can go. Returns how
+// many were moved.
+// **********************************************************************
+static int take_ready(Retired **list, uint64_t oldest, Retired **ready) {
+    int moved = 0;
+    Retired **prev = list;
+    while (*prev != NULL) {
+        Retired *cur = *prev;
+        if (cur->epoch < oldest) {
+            *prev = cur->next;
+            cur->next = *ready;
+            *ready = cur;
+            moved++;
+        } else {
+            prev = &cur->next;
+        }
+    }
+    return moved;
+}
+
+// **********************************************************************
+// Free everything on a list from take_ready()
+// **********************************************************************
+static void free_ready(Retired *ready) {
+    while (ready != NULL) {
+        Retired *next = ready->next;
+        ready->freeFn(ready->ptr);
+        free(ready);
+        ready = next;
+    }
+}
+
+void psepoch_enter(void) {
+    EpochSlot *slot = my_slot();
+    if (slot->depth++ > 0) {
+        return;
+    }
+    __atomic_store_n(&slot->active,
+            __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    // pairs with the fence in psepoch_retire(): either the writer sees
+    // this thread as active or this thread sees the replacement
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void psepoch_exit(void) {
+    EpochSlot *slot = mySlot;
+    if (--slot->depth == 0) {
+        __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void psepoch_retire(void *ptr, void (*freeFn)(void *)) {
+    EpochSlot *slot = my_slot();
+    Retired *item = malloc(sizeof(Retired)), *ready = NULL;
+    item->ptr = ptr;
+    item->freeFn = freeFn;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    item->epoch = __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&slot->lock);
+    item->next = slot->retired;
+    slot->retired = item;
+    int full = ++slot->retiredCount >= RETIRE_BATCH;
+    pthread_mutex_unlock(&slot->lock);
+    if (!full) {
+        return;
+    }
+    // one scan of the readers for every RETIRE_BATCH retired
+    pthread_mutex_lock(&epochLock);
+    uint64_t oldest = oldest_active();
+    pthread_mutex_unlock(&epochLock);
+    pthread_mutex_lock(&slot->lock);
+    slot->retiredCount -= take_ready(&slot->retired, oldest, &ready);
+    pthread_mutex_unlock(&slot->lock);
+    free_ready(ready);
+}
+
+void psepoch_reclaim(void) {
+    Retired *ready = NULL;
+    pthread_once(&epochOnce, init_slots);
+    pthread_mutex_lock(&epochLock);
+    uint64_t oldest = oldest_active();
+    take_ready(&orphans, oldest, &ready);
+    for (EpochSlot *slot = slots; slot != NULL; slot = slot->next) {
+        pthread_mutex_lock(&slot->lock);
+        slot->retiredCount -= take_ready(&slot->retired, oldest, &ready);
+        pthread_mutex_unlock(&slot->lock);
+    }
+    pthread_mutex_unlock(&epochLock);
+    free_ready(ready);
+}
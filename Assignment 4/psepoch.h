@@ -0,0 +1,30 @@
+#ifndef PSEPOCH_H
+#define PSEPOCH_H
+
+// Epoch based reclamation for data that is read without locks. Writers
+// build a new copy, publish it with an atomic store and retire the old
+// one; readers bracket their use of anything they loaded with
+// psepoch_enter() and psepoch_exit(). A retired object is freed only
+// once every thread that was reading when it was retired has left its
+// read section, so a reader never sees memory being freed under it and
+// never has to take a lock or write to a shared cache line.
+
+// Start a read section on the calling thread. Sections may nest.
+void psepoch_enter(void);
+
+// End the read section started by the matching psepoch_enter()
+void psepoch_exit(void);
+
+// Free ptr with freeFn once no reader can still be using it. Must be
+// called after ptr has been replaced. Never waits for readers: ptr goes
+// on the calling thread's list, and every so many retires the thread
+// frees what on it is no longer in use. May be called from inside a
+// read section.
+void psepoch_retire(void *ptr, void (*freeFn)(void *));
+
+// Free whatever any thread has retired that no reader can still be
+// using, so nothing is held on to once retires stop. Meant to be called
+// regularly (psserver calls it from its tick). Never waits for readers.
+void psepoch_reclaim(void);
+
+#endif
@@ -0,0 +1,82 @@
+#include <string.h>
+#include "pshist.h"
+
+// **********************************************************************
+// Bucket holding value
+// **********************************************************************
+static int bucket_of(uint64_t value) {
+    if (value < 64) {
+        return value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (value >> (exp - PSHIST_SUB_BITS)) & 31;
+    return 64 + (exp - 6) * 32 + sub;
+}
+
+// **********************************************************************
+// Highest value that falls into bucket
+// **********************************************************************
+static uint64_t bucket_top(int bucket) {
+    if (bucket < 64) {
+        return bucket;
+    }
+    int exp = 6 + (bucket - 64) / 32;
+    uint64_t sub = (bucket - 64) % 32;
+    uint64_t low = (32 + sub) << (exp - PSHIST_SUB_BITS);
+    return low + ((uint64_t)1 << (exp - PSHIST_SUB_BITS)) - 1;
+}
+
+void pshist_init(PsHist *hist) {
+    memset(hist, 0, sizeof(PsHist));
+    hist->min = UINT64_MAX;
+}
+
+void pshist_record(PsHist *hist, uint64_t value) {
+    hist->counts[bucket_of(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void pshist_merge(PsHist *into, const PsHist *from) {
+    for (int i = 0; i < PSHIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+uint64_t pshist_percentile(const PsHist *hist, double pct) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    // rank of the value wanted, counting from 1
+    uint64_t rank = (uint64_t)(pct / 100.0 * hist->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < PSHIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top > hist->max ? hist->max : top;
+        }
+    }
+    return hist->max;
+}
+
+double pshist_mean(const PsHist *hist) {
+    return hist->total ? (double)hist->sum / hist->total : 0;
+}
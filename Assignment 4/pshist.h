@@ -0,0 +1,37 @@
+#ifndef PSHIST_H
+#define PSHIST_H
+
+#include <stdint.h>
+
+// Log-linear latency histogram in the style of HdrHistogram. Values
+// below 64 get a bucket each; above that every power of two is split
+// into 32 buckets, so any recorded value is reported to within about 3%
+// while covering the whole 64 bit range in a fixed 15KB table.
+#define PSHIST_SUB_BITS 5
+#define PSHIST_BUCKETS (64 + (64 - PSHIST_SUB_BITS - 1) * 32)
+
+typedef struct PsHist {
+    uint64_t counts[PSHIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} PsHist;
+
+// Empty a histogram
+void pshist_init(PsHist *hist);
+
+// Count one occurrence of value
+void pshist_record(PsHist *hist, uint64_t value);
+
+// Add every count in from to into
+void pshist_merge(PsHist *into, const PsHist *from);
+
+// Value at or below which pct percent (0 to 100) of recorded values
+// fall, reported as the highest value in its bucket. 0 if empty.
+uint64_t pshist_percentile(const PsHist *hist, double pct);
+
+// Mean of the recorded values, 0 if empty
+double pshist_mean(const PsHist *hist);
+
+#endif
@@ -0,0 +1,1670 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "psio.h"
+#include "psuring.h"
+
+#define MAX_CONNS (1 << 20)
+#define THREAD_RECV_SIZE 4096
+#define THREAD_DRAIN_MS 10           // longest wait before a new laggard
+                                     // is watched for room
+#define EPOLL_EVENTS 256
+#define EPOLL_RECV_SIZE 65536
+#define URING_ENTRIES 1024
+#define URING_RECV_BUFS 512          // power of two for the buffer ring
+#define URING_RECV_BUF_SIZE 16384
+#define URING_SEND_BUFS 128
+#define URING_SEND_BUF_SIZE 65536
+#define URING_BGID 1
+#define URING_CQE_BATCH 64           // completions handled per flush
+
+// user_data tags for io_uring completions
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_TICK 4
+#define OP_CORK 5
+#define OP_CANCEL 6
+#define OP_RESUME 7
+#define OP_MASK 7
+
+// where a connection stands with the cork list
+#define CORK_NONE 0                  // not on it
+#define CORK_HELD 1                  // on it, output held until corkAt
+#define CORK_STALE 2                 // on it, but already sent early
+
+// A send that io_uring is working on. Kept apart from the connection so
+// it can be released even if the connection is gone when it completes.
+typedef struct SendOp {
+    int fd;
+    unsigned gen;
+    char *buf;
+    int len;
+    int off;
+    int fixedIdx;   // registered buffer index or -1 for a heap buffer
+} SendOp;
+
+// Per-fd connection state owned by the I/O layer
+typedef struct IoConn {
+    pthread_mutex_t lock;   // serialises senders in the thread backend
+    void *ctx;
+    int open;
+    unsigned gen;           // bumped on every open so stale ops are seen
+    char *out;              // bytes queued but not yet handed to the kernel
+    int outLen;
+    int outOff;
+    int outCap;
+    int writing;            // EPOLLOUT armed or io_uring send in flight
+    int flushQueued;        // on the io_uring flush list
+    int wantDrain;          // psio_try_send() refused it bytes
+    int dropped;            // cut off for going over its memory limit
+    long charge;            // bytes the protocol code holds for it
+    SendOp *inflight;
+    int policy;             // PSIO_LATENCY or PSIO_THROUGHPUT
+    int corked;             // CORK_NONE, CORK_HELD or CORK_STALE
+    long corkAt;            // deadline for held output in microseconds
+    long pausedUntil;       // no reads until then (microseconds), 0 = none
+    int recvStopped;        // io_uring: paused and no recv armed
+    char *in;               // io_uring: input that arrived while paused
+    int inLen;
+    int inOff;
+    int inCap;
+} IoConn;
+
+static PsIoBackend activeBackend;
+static PsIoCallbacks *cbs;
+static IoConn *conns;
+static int maxConns;
+static PsIoStats ioStats;
+static PsIoLimits limits;
+static int *listenFds;
+static int listenCount;
+static int highFd;              // highest fd ever opened
+static int tickMs;
+static void (*tickFn)(void);
+static PsIoSendPolicy sendPolicy = {PSIO_LATENCY, 16384, 500};
+
+// connections holding corked output, shared by every backend. corkNext
+// is the earliest deadline among them, 0 if none is known.
+static pthread_mutex_t corkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t corkCond;
+static int *corkList;
+static int corkCount;
+static long corkNext;
+
+// connections psio_pause() stopped reading from, with epoll and uring.
+// Only touched on the I/O thread. pauseNext is the earliest time one of
+// them is due to read again, 0 if none is known.
+static int *pauseList;
+static int pauseCount;
+static long pauseNext;
+
+// thread backend: connections waiting for room, watched by one thread
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drainCond = PTHREAD_COND_INITIALIZER;
+static int drainWaiting;
+
+// epoll backend state
+static int epollFd = -1;
+
+// io_uring backend state
+static PsUring ring;
+static struct __kernel_timespec tickTs;
+static PsUringBufRing recvRing;
+static char *recvBufs;
+static char *sendBufs;
+static int *freeSendBufs;
+static int freeSendCount;
+static int *flushList;
+static int flushCount;
+static struct __kernel_timespec corkTs;
+static int corkArmed;
+static struct __kernel_timespec resumeTs;
+static int resumeArmed;
+
+// **********************************************************************
+// Bump one of the I/O counters. Relaxed atomics are enough as they are
+// only read for reporting.
+// **********************************************************************
+static void count(unsigned long *counter, unsigned long amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+// Parse a backend name
+int psio_parse_backend(const char *name) {
+    if (strcmp(name, "thread") == 0) {
+        return PSIO_THREAD;
+    }
+    if (strcmp(name, "epoll") == 0) {
+        return PSIO_EPOLL;
+    }
+    if (strcmp(name, "uring") == 0) {
+        return PSIO_URING;
+    }
+    return -1;
+}
+
+// Printable name of a backend
+const char *psio_backend_name(PsIoBackend backend) {
+    switch (backend) {
+        case PSIO_EPOLL:
+            return "epoll";
+        case PSIO_URING:
+            return "uring";
+        default:
+            return "thread";
+    }
+}
+
+// Parse a send policy name
+int psio_parse_policy(const char *name) {
+    if (strcmp(name, "latency") == 0) {
+        return PSIO_LATENCY;
+    }
+    if (strcmp(name, "throughput") == 0) {
+        return PSIO_THROUGHPUT;
+    }
+    return -1;
+}
+
+// Copy the current counters into stats
+void psio_get_stats(PsIoStats *stats) {
+    stats->syscalls = __atomic_load_n(&ioStats.syscalls, __ATOMIC_RELAXED)
+            + ring.enterCalls;
+    stats->sends = __atomic_load_n(&ioStats.sends, __ATOMIC_RELAXED);
+    stats->bytesIn = __atomic_load_n(&ioStats.bytesIn, __ATOMIC_RELAXED);
+    stats->bytesOut = __atomic_load_n(&ioStats.bytesOut, __ATOMIC_RELAXED);
+    stats->open = __atomic_load_n(&ioStats.open, __ATOMIC_RELAXED);
+    stats->queued = __atomic_load_n(&ioStats.queued, __ATOMIC_RELAXED);
+    stats->charged = __atomic_load_n(&ioStats.charged, __ATOMIC_RELAXED);
+    stats->refused = __atomic_load_n(&ioStats.refused, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&ioStats.dropped, __ATOMIC_RELAXED);
+    stats->corked = __atomic_load_n(&ioStats.corked, __ATOMIC_RELAXED);
+    stats->paused = __atomic_load_n(&ioStats.paused, __ATOMIC_RELAXED);
+}
+
+// **********************************************************************
+// Bytes held for every connection: queued output plus charges
+// **********************************************************************
+static unsigned long held_total(void) {
+    return __atomic_load_n(&ioStats.queued, __ATOMIC_RELAXED)
+            + __atomic_load_n(&ioStats.charged, __ATOMIC_RELAXED);
+}
+
+// **********************************************************************
+// Bytes queued for one connection and not yet written, including any
+// send io_uring is working on
+// **********************************************************************
+static long conn_queued(IoConn *conn) {
+    long queued = conn->outLen - conn->outOff;
+    if (conn->inflight != NULL) {
+        queued += conn->inflight->len - conn->inflight->off;
+    }
+    return queued;
+}
+
+// **********************************************************************
+// Allocate the connection table, one slot per possible fd
+// **********************************************************************
+static void init_conns(void) {
+    struct rlimit limit;
+    maxConns = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+            && limit.rlim_cur != RLIM_INFINITY) {
+        maxConns = limit.rlim_cur;
+    }
+    if (maxConns > MAX_CONNS) {
+        maxConns = MAX_CONNS;
+    }
+    conns = calloc(maxConns, sizeof(IoConn));
+    for (int i = 0; i < maxConns; i++) {
+        pthread_mutex_init(&conns[i].lock, NULL);
+    }
+    corkList = malloc(sizeof(int) * maxConns);
+    pauseList = malloc(sizeof(int) * maxConns);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&corkCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// **********************************************************************
+// Append bytes to a connection's outbound queue
+// **********************************************************************
+static void queue_out(IoConn *conn, char *data, int len) {
+    if (conn->outOff > 0 && conn->outOff == conn->outLen) {
+        conn->outOff = 0;
+        conn->outLen = 0;
+    }
+    if (conn->outLen + len > conn->outCap) {
+        int newCap = conn->outCap ? conn->outCap * 2 : 4096;
+        while (newCap < conn->outLen + len) {
+            newCap *= 2;
+        }
+        conn->out = realloc(conn->out, newCap);
+        conn->outCap = newCap;
+    }
+    memcpy(conn->out + conn->outLen, data, len);
+    conn->outLen += len;
+    count(&ioStats.queued, len);
+}
+
+// **********************************************************************
+// Start tracking a new connection. One that was accepted is refused if
+// the server already has as many connections or as much memory held as
+// it is allowed. Returns -1 if the fd does not fit in the table or was
+// refused, in which case it has been closed.
+// **********************************************************************
+static int open_conn(int fd, int accepted) {
+    if (fd >= maxConns) {
+        close(fd);
+        return -1;
+    }
+    if (accepted && ((limits.maxOpen > 0 && __atomic_load_n(&ioStats.open,
+            __ATOMIC_RELAXED) >= limits.maxOpen) || (limits.totalBytes > 0
+            && held_total() > limits.totalBytes))) {
+        close(fd);
+        count(&ioStats.refused, 1);
+        return -1;
+    }
+    IoConn *conn = &conns[fd];
+    if (fd > highFd) {
+        __atomic_store_n(&highFd, fd, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&conn->lock);
+    conn->open = 1;
+    conn->gen++;
+    conn->outLen = 0;
+    conn->outOff = 0;
+    conn->writing = 0;
+    conn->dropped = 0;
+    conn->inflight = NULL;
+    conn->policy = sendPolicy.policy;
+    conn->pausedUntil = 0;
+    conn->recvStopped = 0;
+    pthread_mutex_unlock(&conn->lock);
+    // small messages go out at once rather than wait for an ACK; this
+    // fails harmlessly on a Unix domain socket
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    count(&ioStats.syscalls, 1);
+    count(&ioStats.open, 1);
+    conn->ctx = cbs->opened(fd);
+    return 0;
+}
+
+// **********************************************************************
+// Monotonic clock in microseconds, for cork deadlines
+// **********************************************************************
+static long now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// **********************************************************************
+// Hold a connection's queued output back until its cork deadline, which
+// the first send held sets so later ones cannot push it out. The thread
+// backend calls this with the connection's lock held.
+// **********************************************************************
+static void cork_conn(int fd) {
+    IoConn *conn = &conns[fd];
+    count(&ioStats.corked, 1);
+    pthread_mutex_lock(&corkLock);
+    if (conn->corked != CORK_HELD) {
+        conn->corkAt = now_us() + sendPolicy.corkUs;
+        if (corkNext == 0) {
+            corkNext = conn->corkAt;
+            pthread_cond_signal(&corkCond);
+        }
+        if (conn->corked == CORK_NONE) {
+            corkList[corkCount++] = fd;
+        }
+        conn->corked = CORK_HELD;
+    }
+    pthread_mutex_unlock(&corkLock);
+}
+
+// **********************************************************************
+// A corked connection's output is going out early. It is left on the
+// cork list until the next look at it.
+// **********************************************************************
+static void uncork_conn(IoConn *conn) {
+    if (__atomic_load_n(&conn->corked, __ATOMIC_RELAXED) != CORK_HELD) {
+        return;
+    }
+    pthread_mutex_lock(&corkLock);
+    if (conn->corked == CORK_HELD) {
+        conn->corked = CORK_STALE;
+    }
+    pthread_mutex_unlock(&corkLock);
+}
+
+// **********************************************************************
+// Take the connections whose cork deadline has passed off the cork list
+// into due. Returns the microseconds until the next deadline, or -1 if
+// nothing is corked.
+// **********************************************************************
+static long take_due_corks(int *due, int *dueCount) {
+    long now = now_us(), wait = -1;
+    *dueCount = 0;
+    pthread_mutex_lock(&corkLock);
+    if (corkCount > 0 && now < corkNext) {
+        wait = corkNext - now;
+        pthread_mutex_unlock(&corkLock);
+        return wait;
+    }
+    int kept = 0;
+    corkNext = 0;
+    for (int i = 0; i < corkCount; i++) {
+        IoConn *conn = &conns[corkList[i]];
+        if (conn->corked == CORK_HELD && conn->corkAt > now) {
+            if (corkNext == 0 || conn->corkAt < corkNext) {
+                corkNext = conn->corkAt;
+            }
+            corkList[kept++] = corkList[i];
+            continue;
+        }
+        if (conn->corked == CORK_HELD) {
+            due[(*dueCount)++] = corkList[i];
+        }
+        conn->corked = CORK_NONE;
+    }
+    corkCount = kept;
+    if (corkNext > 0) {
+        wait = corkNext - now;
+    }
+    pthread_mutex_unlock(&corkLock);
+    return wait;
+}
+
+// **********************************************************************
+// Take the connections whose pause is over off the pause list into due.
+// Returns the microseconds until the next is due, or -1 if none is
+// paused.
+// **********************************************************************
+static long take_due_pauses(int *due, int *dueCount) {
+    long now = now_us();
+    *dueCount = 0;
+    if (pauseCount == 0 || now < pauseNext) {
+        return pauseCount > 0 ? pauseNext - now : -1;
+    }
+    int kept = 0;
+    pauseNext = 0;
+    for (int i = 0; i < pauseCount; i++) {
+        IoConn *conn = &conns[pauseList[i]];
+        if (conn->pausedUntil > now) {
+            if (pauseNext == 0 || conn->pausedUntil < pauseNext) {
+                pauseNext = conn->pausedUntil;
+            }
+            pauseList[kept++] = pauseList[i];
+            continue;
+        }
+        conn->pausedUntil = 0;
+        due[(*dueCount)++] = pauseList[i];
+    }
+    pauseCount = kept;
+    return pauseCount > 0 ? pauseNext - now : -1;
+}
+
+// **********************************************************************
+// Take a connection that is closing off the pause list
+// **********************************************************************
+static void unpause_conn(int fd) {
+    if (conns[fd].pausedUntil == 0 || activeBackend == PSIO_THREAD) {
+        return;
+    }
+    conns[fd].pausedUntil = 0;
+    for (int i = 0; i < pauseCount; i++) {
+        if (pauseList[i] == fd) {
+            pauseList[i] = pauseList[--pauseCount];
+            break;
+        }
+    }
+}
+
+// **********************************************************************
+// Tell the protocol code a connection has gone, then release and close it
+// **********************************************************************
+static void close_conn(int fd) {
+    IoConn *conn = &conns[fd];
+    cbs->closed(conn->ctx);
+    pthread_mutex_lock(&conn->lock);
+    conn->open = 0;
+    conn->ctx = NULL;
+    conn->gen++;
+    // whatever it still held is released with it
+    count(&ioStats.queued, -conn_queued(conn));
+    count(&ioStats.charged, -__atomic_exchange_n(&conn->charge, 0,
+            __ATOMIC_RELAXED));
+    count(&ioStats.open, -1);
+    free(conn->out);
+    conn->out = NULL;
+    conn->outLen = 0;
+    conn->outOff = 0;
+    conn->outCap = 0;
+    conn->inflight = NULL; // released by its completion
+    count(&ioStats.charged, -(conn->inLen - conn->inOff));
+    free(conn->in);
+    conn->in = NULL;
+    conn->inLen = 0;
+    conn->inOff = 0;
+    conn->inCap = 0;
+    uncork_conn(conn);
+    pthread_mutex_unlock(&conn->lock);
+    unpause_conn(fd);
+    close(fd);
+    count(&ioStats.syscalls, 1);
+}
+
+// **********************************************************************
+// A send failed. Shut the socket down so the read side sees the end of
+// the connection and cleans it up through the normal path.
+// **********************************************************************
+static void fail_conn(int fd) {
+    shutdown(fd, SHUT_RDWR);
+    count(&ioStats.syscalls, 1);
+}
+
+// **********************************************************************
+// Thread backend: blocking reader run once per connection
+// **********************************************************************
+static void *thread_reader(void *arg) {
+    int fd = (int)(long)arg;
+    char buf[THREAD_RECV_SIZE];
+    int len;
+    while ((len = recv(fd, buf, THREAD_RECV_SIZE, 0)) > 0) {
+        count(&ioStats.syscalls, 1);
+        count(&ioStats.bytesIn, len);
+        cbs->received(conns[fd].ctx, buf, len);
+        long until = conns[fd].pausedUntil;
+        if (until > 0) {
+            // nothing more is read until the pause is over
+            struct timespec at = {until / 1000000, until % 1000000 * 1000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at,
+                    NULL) == EINTR) {
+            }
+            conns[fd].pausedUntil = 0;
+        }
+    }
+    count(&ioStats.syscalls, 1);
+    close_conn(fd);
+    return NULL;
+}
+
+// **********************************************************************
+// Thread backend: accept connections and start a reader thread for each
+// **********************************************************************
+static void *thread_acceptor(void *arg) {
+    int listenFd = (int)(long)arg;
+    pthread_t tid;
+    while (1) {
+        int fd = accept(listenFd, NULL, NULL);
+        count(&ioStats.syscalls, 1);
+        if (fd < 0 || open_conn(fd, 1) != 0) {
+            continue;
+        }
+        pthread_create(&tid, NULL, thread_reader, (void *)(long)fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+// **********************************************************************
+// Thread backend: call the tick function every tickMs
+// **********************************************************************
+static void *thread_ticker(void *arg) {
+    struct timespec delay = {tickMs / 1000, (tickMs % 1000) * 1000000L};
+    while (1) {
+        nanosleep(&delay, NULL);
+        tickFn();
+    }
+    return NULL;
+}
+
+// **********************************************************************
+// Thread backend: note that a connection has to be watched for room
+// **********************************************************************
+static void thread_want_drain(IoConn *conn) {
+    pthread_mutex_lock(&drainLock);
+    if (!conn->wantDrain) {
+        conn->wantDrain = 1;
+        drainWaiting++;
+        pthread_cond_signal(&drainCond);
+    }
+    pthread_mutex_unlock(&drainLock);
+}
+
+// **********************************************************************
+// Thread backend: wait for connections that were backed up to have
+// room in their socket buffers again and report each one drained. The
+// set watched is refreshed every THREAD_DRAIN_MS so new laggards are
+// picked up without waking the thread.
+// **********************************************************************
+static void *thread_drainer(void *arg) {
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * maxConns);
+    while (1) {
+        int n = 0;
+        pthread_mutex_lock(&drainLock);
+        while (drainWaiting == 0) {
+            pthread_cond_wait(&drainCond, &drainLock);
+        }
+        int top = __atomic_load_n(&highFd, __ATOMIC_RELAXED);
+        for (int fd = 0; fd <= top && fd < maxConns; fd++) {
+            if (conns[fd].wantDrain) {
+                fds[n].fd = fd;
+                fds[n++].events = POLLOUT;
+            }
+        }
+        pthread_mutex_unlock(&drainLock);
+        poll(fds, n, THREAD_DRAIN_MS);
+        count(&ioStats.syscalls, 1);
+        for (int i = 0; i < n; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            IoConn *conn = &conns[fds[i].fd];
+            pthread_mutex_lock(&drainLock);
+            int was = conn->wantDrain;
+            conn->wantDrain = 0;
+            drainWaiting -= was;
+            pthread_mutex_unlock(&drainLock);
+            if (was) {
+                cbs->drained(fds[i].fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+// **********************************************************************
+// Thread backend: write corked output once its deadline passes. The
+// socket is not waited on: whatever it does not take, or a connection
+// busy with another sender, is corked again and retried later.
+// **********************************************************************
+static void *thread_corker(void *arg) {
+    int *due = malloc(sizeof(int) * maxConns), dueCount;
+    while (1) {
+        take_due_corks(due, &dueCount);
+        for (int i = 0; i < dueCount; i++) {
+            IoConn *conn = &conns[due[i]];
+            if (pthread_mutex_trylock(&conn->lock) != 0) {
+                cork_conn(due[i]);
+                continue;
+            }
+            if (conn->open && !conn->dropped && conn->outOff < conn->outLen) {
+                int sent = send(due[i], conn->out + conn->outOff,
+                        conn->outLen - conn->outOff,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+                count(&ioStats.syscalls, 1);
+                if (sent > 0) {
+                    count(&ioStats.bytesOut, sent);
+                    count(&ioStats.queued, -sent);
+                    conn->outOff += sent;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    count(&ioStats.queued, -(conn->outLen - conn->outOff));
+                    conn->outOff = conn->outLen;
+                    fail_conn(due[i]);
+                }
+                if (conn->outOff < conn->outLen) {
+                    cork_conn(due[i]);
+                }
+            }
+            pthread_mutex_unlock(&conn->lock);
+        }
+        pthread_mutex_lock(&corkLock);
+        if (corkCount == 0) {
+            pthread_cond_wait(&corkCond, &corkLock);
+        } else if (corkNext > 0) {
+            struct timespec at = {corkNext / 1000000,
+                    corkNext % 1000000 * 1000};
+            pthread_cond_timedwait(&corkCond, &corkLock, &at);
+        }
+        pthread_mutex_unlock(&corkLock);
+    }
+    return NULL;
+}
+
+// **********************************************************************
+// Thread backend: one accepting thread per listening socket
+// **********************************************************************
+static void run_threads(void) {
+    pthread_t tid;
+    if (tickFn != NULL) {
+        pthread_create(&tid, NULL, thread_ticker, NULL);
+        pthread_detach(tid);
+    }
+    if (cbs->drained != NULL) {
+        pthread_create(&tid, NULL, thread_drainer, NULL);
+        pthread_detach(tid);
+    }
+    pthread_create(&tid, NULL, thread_corker, NULL);
+    pthread_detach(tid);
+    for (int i = 1; i < listenCount; i++) {
+        pthread_create(&tid, NULL, thread_acceptor,
+                (void *)(long)listenFds[i]);
+        pthread_detach(tid);
+    }
+    thread_acceptor((void *)(long)listenFds[0]);
+}
+
+// **********************************************************************
+// Return 1 if fd is one of the listening sockets
+// **********************************************************************
+static int is_listener(int fd) {
+    for (int i = 0; i < listenCount; i++) {
+        if (listenFds[i] == fd) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Step an array of pieces past n bytes that have been written
+// **********************************************************************
+static void skip_iov(struct iovec **iov, int *iovCount, size_t n) {
+    while (*iovCount > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovCount)--;
+    }
+    if (*iovCount > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+// **********************************************************************
+// Thread backend: send every piece now, blocking if the socket is full
+// **********************************************************************
+static int thread_sendv(int fd, struct iovec *iov, int iovCount) {
+    while (iovCount > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovCount;
+        int sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        count(&ioStats.syscalls, 1);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        count(&ioStats.bytesOut, sent);
+        skip_iov(&iov, &iovCount, sent);
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Thread backend: send everything now, blocking if the socket is full
+// **********************************************************************
+static int thread_send(IoConn *conn, int fd, char *data, int len) {
+    struct iovec iov = {data, len};
+    return thread_sendv(fd, &iov, 1);
+}
+
+// **********************************************************************
+// Thread backend: hold the pieces back if the connection is corking and
+// they keep it under corkBytes, else write whatever is held and then
+// them. Called with the connection's lock held.
+// **********************************************************************
+static int thread_send_held(IoConn *conn, int fd, struct iovec *iov,
+        int iovCount, long len) {
+    long held = conn->outLen - conn->outOff;
+    if (conn->policy == PSIO_THROUGHPUT
+            && held + len < sendPolicy.corkBytes) {
+        for (int i = 0; i < iovCount; i++) {
+            queue_out(conn, iov[i].iov_base, iov[i].iov_len);
+        }
+        cork_conn(fd);
+        return 0;
+    }
+    uncork_conn(conn);
+    if (held == 0) {
+        return thread_sendv(fd, iov, iovCount);
+    }
+    struct iovec all[PSIO_MAX_IOV + 1];
+    all[0].iov_base = conn->out + conn->outOff;
+    all[0].iov_len = held;
+    memcpy(all + 1, iov, sizeof(struct iovec) * iovCount);
+    count(&ioStats.queued, -held);
+    conn->outOff = conn->outLen;
+    return thread_sendv(fd, all, iovCount + 1);
+}
+
+// **********************************************************************
+// epoll backend: change the events a connection is waiting for
+// **********************************************************************
+static void epoll_watch(int fd, int op, unsigned events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epollFd, op, fd, &ev);
+    count(&ioStats.syscalls, 1);
+}
+
+// **********************************************************************
+// epoll backend: events a connection waits for: input unless it is
+// paused, and room to write while anything is queued
+// **********************************************************************
+static unsigned epoll_events(IoConn *conn) {
+    return (conn->pausedUntil ? 0 : EPOLLIN | EPOLLRDHUP)
+            | (conn->writing ? EPOLLOUT : 0);
+}
+
+// **********************************************************************
+// epoll backend: wait for room in the socket while anything is queued
+// **********************************************************************
+static void epoll_set_writing(int fd, int pending) {
+    IoConn *conn = &conns[fd];
+    if (pending != conn->writing) {
+        conn->writing = pending;
+        epoll_watch(fd, EPOLL_CTL_MOD, epoll_events(conn));
+    }
+}
+
+// **********************************************************************
+// epoll backend: write as much of the queue as the socket takes. Waits
+// for EPOLLOUT while anything is left.
+// **********************************************************************
+static void epoll_flush(int fd) {
+    IoConn *conn = &conns[fd];
+    while (conn->outOff < conn->outLen) {
+        int sent = send(fd, conn->out + conn->outOff,
+                conn->outLen - conn->outOff, MSG_NOSIGNAL | MSG_DONTWAIT);
+        count(&ioStats.syscalls, 1);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (sent <= 0) {
+            count(&ioStats.queued, -(conn->outLen - conn->outOff));
+            conn->outOff = conn->outLen;
+            fail_conn(fd);
+            break;
+        }
+        count(&ioStats.bytesOut, sent);
+        count(&ioStats.queued, -sent);
+        conn->outOff += sent;
+    }
+    epoll_set_writing(fd, conn->outOff < conn->outLen);
+}
+
+// **********************************************************************
+// epoll backend: read until the socket is drained or closed
+// **********************************************************************
+static void epoll_read(int fd, char *buf) {
+    while (1) {
+        int len = recv(fd, buf, EPOLL_RECV_SIZE, MSG_DONTWAIT);
+        count(&ioStats.syscalls, 1);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (len <= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+            count(&ioStats.syscalls, 1);
+            close_conn(fd);
+            return;
+        }
+        count(&ioStats.bytesIn, len);
+        cbs->received(conns[fd].ctx, buf, len);
+        if (len < EPOLL_RECV_SIZE || conns[fd].pausedUntil) {
+            return; // a short read means the socket buffer is empty
+        }
+    }
+}
+
+// **********************************************************************
+// Monotonic clock in milliseconds, for scheduling the tick
+// **********************************************************************
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// **********************************************************************
+// epoll backend: one thread waits on every socket. Returns -1 if epoll
+// cannot be used.
+// **********************************************************************
+static int run_epoll(void) {
+    epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < listenCount; i++) {
+        fcntl(listenFds[i], F_SETFL,
+                fcntl(listenFds[i], F_GETFL) | O_NONBLOCK);
+        epoll_watch(listenFds[i], EPOLL_CTL_ADD, EPOLLIN);
+    }
+    activeBackend = PSIO_EPOLL;
+
+    struct epoll_event events[EPOLL_EVENTS];
+    char *buf = malloc(EPOLL_RECV_SIZE);
+    int *due = malloc(sizeof(int) * maxConns), dueCount;
+    int precise = 1;    // epoll_pwait2() takes a timeout finer than 1ms
+    long nextTick = now_ms() + tickMs;
+    while (1) {
+        long timeout = take_due_corks(due, &dueCount);
+        for (int i = 0; i < dueCount; i++) {
+            if (conns[due[i]].open) {
+                epoll_flush(due[i]);
+            }
+        }
+        long resume = take_due_pauses(due, &dueCount);
+        for (int i = 0; i < dueCount; i++) {
+            epoll_watch(due[i], EPOLL_CTL_MOD, epoll_events(&conns[due[i]]));
+        }
+        if (resume >= 0 && (timeout < 0 || resume < timeout)) {
+            timeout = resume;
+        }
+        if (tickFn != NULL) {
+            long now = now_ms();
+            if (now >= nextTick) {
+                tickFn();
+                nextTick = now + tickMs;
+            }
+            if (timeout < 0 || (nextTick - now) * 1000 < timeout) {
+                timeout = (nextTick - now) * 1000;
+            }
+        }
+        int n = -1;
+        if (precise) {
+            struct timespec ts = {timeout / 1000000, timeout % 1000000 * 1000};
+            n = epoll_pwait2(epollFd, events, EPOLL_EVENTS,
+                    timeout < 0 ? NULL : &ts, NULL);
+            precise = n >= 0 || errno != ENOSYS;
+        }
+        if (!precise) {
+            n = epoll_wait(epollFd, events, EPOLL_EVENTS,
+                    timeout < 0 ? -1 : (timeout + 999) / 1000);
+        }
+        count(&ioStats.syscalls, 1);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (is_listener(fd)) {
+                int newFd;
+                while ((newFd = accept4(fd, NULL, NULL,
+                        SOCK_NONBLOCK)) >= 0) {
+                    count(&ioStats.syscalls, 1);
+                    if (open_conn(newFd, 1) == 0) {
+                        epoll_watch(newFd, EPOLL_CTL_ADD,
+                                EPOLLIN | EPOLLRDHUP);
+                    }
+                }
+                count(&ioStats.syscalls, 1);
+                continue;
+            }
+            if (!conns[fd].open) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                epoll_flush(fd);
+                IoConn *conn = &conns[fd];
+                if (conn->wantDrain && conn->outOff == conn->outLen) {
+                    conn->wantDrain = 0;
+                    cbs->drained(fd);
+                }
+            }
+            // a paused connection is only read once it has failed
+            if ((events[i].events & (EPOLLHUP | EPOLLERR))
+                    || (!conns[fd].pausedUntil && (events[i].events
+                    & (EPOLLIN | EPOLLRDHUP)))) {
+                epoll_read(fd, buf);
+            }
+        }
+    }
+    return 0;
+}
+
+// **********************************************************************
+// io_uring backend: build user_data for accept and recv operations
+// **********************************************************************
+static uint64_t conn_tag(int fd, int op) {
+    return ((uint64_t)conns[fd].gen << 32 | (uint64_t)fd << 3) | op;
+}
+
+// **********************************************************************
+// io_uring backend: arm a multishot accept on the listening socket
+// **********************************************************************
+static void uring_arm_accept(int listenFd) {
+    struct io_uring_sqe *sqe = psuring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uint64_t)listenFd << 3 | OP_ACCEPT;
+}
+
+// **********************************************************************
+// io_uring backend: arm a timeout that completes after tickMs
+// **********************************************************************
+static void uring_arm_tick(void) {
+    struct io_uring_sqe *sqe = psuring_get_sqe(&ring);
+    tickTs.tv_sec = tickMs / 1000;
+    tickTs.tv_nsec = (tickMs % 1000) * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&tickTs;
+    sqe->len = 1;
+    sqe->user_data = OP_TICK;
+}
+
+// **********************************************************************
+// io_uring backend: arm a timeout that completes when the earliest cork
+// deadline, us microseconds away, is due
+// **********************************************************************
+static void uring_arm_cork(long us) {
+    struct io_uring_sqe *sqe = psuring_get_sqe(&ring);
+    corkTs.tv_sec = us / 1000000;
+    corkTs.tv_nsec = us % 1000000 * 1000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&corkTs;
+    sqe->len = 1;
+    sqe->user_data = OP_CORK;
+    corkArmed = 1;
+}
+
+// **********************************************************************
+// io_uring backend: arm a timeout that completes when the earliest
+// paused connection, us microseconds away, may read again
+// **********************************************************************
+static void uring_arm_resume(long us) {
+    struct io_uring_sqe *sqe = psuring_get_sqe(&ring);
+    resumeTs.tv_sec = us / 1000000;
+    resumeTs.tv_nsec = us % 1000000 * 1000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&resumeTs;
+    sqe->len = 1;
+    sqe->user_data = OP_RESUME;
+    resumeArmed = 1;
+}
+
+// **********************************************************************
+// io_uring backend: cancel a connection's multishot recv so it stops
+// reading while paused
+// **********************************************************************
+static void uring_cancel_recv(int fd) {
+    struct io_uring_sqe *sqe = psuring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = conn_tag(fd, OP_RECV);
+    sqe->user_data = OP_CANCEL;
+}
+
+// **********************************************************************
+// io_uring backend: arm a multishot recv that picks its buffers from the
+// provided-buffer ring
+// **********************************************************************
+static void uring_arm_recv(int fd) {
+    struct io_uring_sqe *sqe = psuring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = conn_tag(fd, OP_RECV);
+}
+
+// **********************************************************************
+// io_uring backend: submit the unsent part of a send operation. Fixed
+// buffers go out with WRITE_FIXED so the kernel skips pinning pages.
+// **********************************************************************
+static void uring_submit_send(SendOp *op) {
+    struct io_uring_sqe *sqe = psuring_get_sqe(&ring);
+    if (op->fixedIdx >= 0) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = op->fixedIdx;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->fd = op->fd;
+    sqe->addr = (unsigned long)(op->buf + op->off);
+    sqe->len = op->len - op->off;
+    sqe->user_data = (uint64_t)(uintptr_t)op | OP_SEND;
+}
+
+// **********************************************************************
+// io_uring backend: start sending whatever is queued for a connection.
+// Everything queued since the last send goes out as one operation.
+// **********************************************************************
+static void uring_flush(int fd) {
+    IoConn *conn = &conns[fd];
+    conn->flushQueued = 0;
+    if (!conn->open || conn->writing || conn->outOff == conn->outLen) {
+        return;
+    }
+    SendOp *op = malloc(sizeof(SendOp));
+    op->fd = fd;
+    op->gen = conn->gen;
+    op->off = 0;
+    int pending = conn->outLen - conn->outOff;
+    if (freeSendCount > 0) {
+        op->fixedIdx = freeSendBufs[--freeSendCount];
+        op->buf = sendBufs + (size_t)op->fixedIdx * URING_SEND_BUF_SIZE;
+        op->len = pending < URING_SEND_BUF_SIZE ? pending
+                : URING_SEND_BUF_SIZE;
+        memcpy(op->buf, conn->out + conn->outOff, op->len);
+        conn->outOff += op->len;
+    } else {
+        // no registered buffer free: hand over the queue itself
+        op->fixedIdx = -1;
+        op->buf = conn->out;
+        op->off = conn->outOff;
+        op->len = conn->outLen;
+        conn->out = NULL;
+        conn->outLen = 0;
+        conn->outOff = 0;
+        conn->outCap = 0;
+    }
+    conn->writing = 1;
+    conn->inflight = op;
+    uring_submit_send(op);
+}
+
+// **********************************************************************
+// io_uring backend: a send completed. Resubmit a short write, otherwise
+// release the buffer and move on to anything queued meanwhile.
+// **********************************************************************
+static void uring_send_done(SendOp *op, int res) {
+    IoConn *conn = &conns[op->fd];
+    int current = conn->open && conn->gen == op->gen;
+    if (res > 0) {
+        count(&ioStats.bytesOut, res);
+        op->off += res;
+        if (current) { // else it was let go of when the connection closed
+            count(&ioStats.queued, -res);
+        }
+        if (current && op->off < op->len) {
+            uring_submit_send(op);
+            return;
+        }
+    } else if (current) {
+        count(&ioStats.queued, -(op->len - op->off));
+        fail_conn(op->fd);
+    }
+    int fd = op->fd;
+    if (op->fixedIdx >= 0) {
+        freeSendBufs[freeSendCount++] = op->fixedIdx;
+    } else {
+        free(op->buf);
+    }
+    free(op);
+    if (current) {
+        conn->writing = 0;
+        conn->inflight = NULL;
+        uring_flush(fd);
+        if (conn->wantDrain && !conn->writing) {
+            conn->wantDrain = 0;
+            cbs->drained(fd);
+        }
+    }
+}
+
+// **********************************************************************
+// io_uring backend: set up the ring, receive buffer ring and registered
+// send buffers. Returns -1 if the kernel lacks anything we need.
+// **********************************************************************
+static int uring_setup(void) {
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV,
+            IORING_OP_SEND, IORING_OP_WRITE_FIXED, IORING_OP_TIMEOUT,
+            IORING_OP_ASYNC_CANCEL};
+    if (psuring_init(&ring, URING_ENTRIES) != 0) {
+        return -1;
+    }
+    if (psuring_probe(&ring, ops, sizeof(ops) / sizeof(ops[0])) != 0) {
+        psuring_exit(&ring);
+        return -1;
+    }
+    recvBufs = malloc((size_t)URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+    if (psuring_setup_buf_ring(&ring, &recvRing, URING_RECV_BUFS,
+            URING_BGID, recvBufs, URING_RECV_BUF_SIZE) != 0) {
+        free(recvBufs);
+        psuring_exit(&ring);
+        return -1;
+    }
+    sendBufs = mmap(NULL, (size_t)URING_SEND_BUFS * URING_SEND_BUF_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct iovec iovs[URING_SEND_BUFS];
+    for (int i = 0; i < URING_SEND_BUFS; i++) {
+        iovs[i].iov_base = sendBufs + (size_t)i * URING_SEND_BUF_SIZE;
+        iovs[i].iov_len = URING_SEND_BUF_SIZE;
+    }
+    freeSendBufs = malloc(sizeof(int) * URING_SEND_BUFS);
+    freeSendCount = 0;
+    if (sendBufs != MAP_FAILED
+            && psuring_register_buffers(&ring, iovs, URING_SEND_BUFS) == 0) {
+        for (int i = URING_SEND_BUFS - 1; i >= 0; i--) {
+            freeSendBufs[freeSendCount++] = i;
+        }
+    } // else every send uses a heap buffer, e.g. if RLIMIT_MEMLOCK is low
+    flushList = malloc(sizeof(int) * maxConns);
+    flushCount = 0;
+    corkArmed = 0;
+    resumeArmed = 0;
+    return 0;
+}
+
+// **********************************************************************
+// io_uring backend: keep bytes a paused connection received before its
+// recv was cancelled until the pause is over. They count against its
+// memory like its output does.
+// **********************************************************************
+static void uring_hold_input(IoConn *conn, char *data, int len) {
+    if (conn->inOff > 0 && conn->inOff == conn->inLen) {
+        conn->inOff = 0;
+        conn->inLen = 0;
+    }
+    if (conn->inLen + len > conn->inCap) {
+        int newCap = conn->inCap ? conn->inCap * 2 : URING_RECV_BUF_SIZE;
+        while (newCap < conn->inLen + len) {
+            newCap *= 2;
+        }
+        conn->in = realloc(conn->in, newCap);
+        conn->inCap = newCap;
+    }
+    memcpy(conn->in + conn->inLen, data, len);
+    conn->inLen += len;
+    __atomic_add_fetch(&conn->charge, len, __ATOMIC_RELAXED);
+    count(&ioStats.charged, len);
+}
+
+// **********************************************************************
+// io_uring backend: a connection's pause is over. Hand it what it held
+// a buffer's worth at a time, stopping if that pauses it again, then
+// start reading once nothing is left.
+// **********************************************************************
+static void uring_resume(int fd) {
+    IoConn *conn = &conns[fd];
+    while (conn->open && !conn->pausedUntil && conn->inOff < conn->inLen) {
+        int len = conn->inLen - conn->inOff;
+        len = len < URING_RECV_BUF_SIZE ? len : URING_RECV_BUF_SIZE;
+        __atomic_sub_fetch(&conn->charge, len, __ATOMIC_RELAXED);
+        count(&ioStats.charged, -len);
+        conn->inOff += len;
+        cbs->received(conn->ctx, conn->in + conn->inOff - len, len);
+    }
+    if (conn->open && !conn->pausedUntil && conn->recvStopped) {
+        conn->recvStopped = 0;
+        uring_arm_recv(fd);
+    } // else the cancel has not completed yet and will arm it again
+}
+
+// **********************************************************************
+// io_uring backend: handle a receive completion
+// **********************************************************************
+static void uring_recv_done(struct io_uring_cqe *cqe) {
+    int fd = (cqe->user_data >> 3) & 0x1fffffff;
+    unsigned gen = cqe->user_data >> 32;
+    IoConn *conn = &conns[fd];
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *data = recvRing.base + (size_t)bid * URING_RECV_BUF_SIZE;
+        if (cqe->res > 0 && conn->open && conn->gen == gen) {
+            count(&ioStats.bytesIn, cqe->res);
+            if (conn->pausedUntil || conn->inOff < conn->inLen) {
+                uring_hold_input(conn, data, cqe->res);
+            } else {
+                cbs->received(conn->ctx, data, cqe->res);
+            }
+        }
+        psuring_buf_ring_recycle(&recvRing, bid);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+    if (!conn->open || conn->gen != gen) {
+        return;
+    }
+    if (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+        if (conn->pausedUntil || conn->inOff < conn->inLen) {
+            conn->recvStopped = 1;  // armed again when the pause ends
+        } else {
+            uring_arm_recv(fd); // multishot ended early, keep reading
+        }
+    } else {
+        close_conn(fd);
+    }
+}
+
+// **********************************************************************
+// io_uring backend: one thread, one io_uring_enter() per loop that both
+// submits everything queued while handling the last batch and waits for
+// the next completions. Returns -1 if io_uring cannot be used.
+// **********************************************************************
+static int run_uring(void) {
+    if (uring_setup() != 0) {
+        return -1;
+    }
+    activeBackend = PSIO_URING;
+    for (int i = 0; i < listenCount; i++) {
+        uring_arm_accept(listenFds[i]);
+    }
+    if (tickFn != NULL) {
+        uring_arm_tick();
+    }
+    int *due = malloc(sizeof(int) * maxConns), dueCount;
+    while (1) {
+        int ret = psuring_submit_and_wait(&ring, 1);
+        if (ret < 0 && ret != -EBUSY && ret != -EAGAIN) {
+            fprintf(stderr, "psserver: io_uring_enter failed: %s\n",
+                    strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+        // completions keep coming while a busy sender is handled, so
+        // stop now and then to send what they queued
+        struct io_uring_cqe *cqe;
+        int handled = 0;
+        while (handled++ < URING_CQE_BATCH
+                && (cqe = psuring_peek_cqe(&ring)) != NULL) {
+            switch (cqe->user_data & OP_MASK) {
+                case OP_ACCEPT:
+                    if (cqe->res >= 0 && open_conn(cqe->res, 1) == 0) {
+                        uring_arm_recv(cqe->res);
+                    }
+                    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                        uring_arm_accept(cqe->user_data >> 3);
+                    }
+                    break;
+                case OP_RECV:
+                    uring_recv_done(cqe);
+                    break;
+                case OP_SEND:
+                    uring_send_done((SendOp *)(uintptr_t)(cqe->user_data
+                            & ~(uint64_t)OP_MASK), cqe->res);
+                    break;
+                case OP_TICK:
+                    tickFn();
+                    uring_arm_tick();
+                    break;
+                case OP_CORK:
+                    corkArmed = 0;
+                    break;
+                case OP_RESUME:
+                    resumeArmed = 0;
+                    break;
+
+            }
+            psuring_cqe_seen(&ring);
+        }
+        if (corkCount > 0) {
+            long wait = take_due_corks(due, &dueCount);
+            for (int i = 0; i < dueCount; i++) {
+                uring_flush(due[i]);
+            }
+            if (wait >= 0 && !corkArmed) {
+                uring_arm_cork(wait);
+            }
+        }
+        if (pauseCount > 0) {
+            long wait = take_due_pauses(due, &dueCount);
+            for (int i = 0; i < dueCount; i++) {
+                uring_resume(due[i]);
+            }
+            if (wait >= 0 && !resumeArmed) {
+                uring_arm_resume(wait);
+            }
+        }
+        for (int i = 0; i < flushCount; i++) {
+            uring_flush(flushList[i]);
+        }
+        flushCount = 0;
+    }
+    return 0;
+}
+
+// Serve connections accepted on any of the listening sockets forever
+void psio_run(PsIoBackend backend, int *fds, int count,
+        PsIoCallbacks *callbacks) {
+    cbs = callbacks;
+    listenFds = fds;
+    listenCount = count;
+    init_conns();
+    if (backend == PSIO_URING && run_uring() == 0) {
+        return;
+    }
+    if (backend != PSIO_THREAD && run_epoll() == 0) {
+        return;
+    }
+    activeBackend = PSIO_THREAD;
+    run_threads();
+}
+
+// Set the function called every ms milliseconds
+void psio_set_tick(int ms, void (*fn)(void)) {
+    tickMs = ms > 0 ? ms : 1;
+    tickFn = fn;
+}
+
+// Bytes queued but not yet written
+unsigned long psio_queued(void) {
+    return __atomic_load_n(&ioStats.queued, __ATOMIC_RELAXED);
+}
+
+// Set the default send policy and cork limits
+void psio_set_send_policy(PsIoSendPolicy *policy) {
+    sendPolicy = *policy;
+}
+
+// Change the send policy of one connection
+void psio_set_policy(int fd, PsIoPolicy policy) {
+    if (fd >= 0 && fd < maxConns) {
+        conns[fd].policy = policy;
+    }
+}
+
+// Set the connection and memory limits
+void psio_set_limits(PsIoLimits *newLimits) {
+    limits = *newLimits;
+}
+
+// Charge bytes held by the protocol code to a connection
+int psio_charge(int fd, long delta) {
+    if (fd < 0 || fd >= maxConns) {
+        return 0;
+    }
+    IoConn *conn = &conns[fd];
+    long held = __atomic_add_fetch(&conn->charge, delta, __ATOMIC_RELAXED);
+    count(&ioStats.charged, delta);
+    if (limits.connBytes > 0 && held + conn_queued(conn) > limits.connBytes) {
+        return 1;
+    }
+    if (limits.totalBytes > 0 && held_total() > limits.totalBytes) {
+        return 2;
+    }
+    return 0;
+}
+
+// Cut off a connection that is over its memory limit
+void psio_drop(int fd) {
+    if (fd < 0 || fd >= maxConns || conns[fd].dropped) {
+        return;
+    }
+    conns[fd].dropped = 1;
+    count(&ioStats.dropped, 1);
+    fail_conn(fd);
+}
+
+// Stop reading from a connection for a while
+void psio_pause(int fd, long us) {
+    if (fd < 0 || fd >= maxConns || us <= 0) {
+        return;
+    }
+    IoConn *conn = &conns[fd];
+    long until = now_us() + us;
+    if (until <= conn->pausedUntil) {
+        return;
+    }
+    int paused = conn->pausedUntil != 0;
+    conn->pausedUntil = until;
+    if (!paused) {
+        count(&ioStats.paused, 1);
+    }
+    if (activeBackend == PSIO_THREAD || paused) {
+        return; // the reader waits once received() returns
+    }
+    pauseList[pauseCount++] = fd;
+    if (pauseNext == 0 || until < pauseNext) {
+        pauseNext = until;
+    }
+    if (activeBackend == PSIO_EPOLL) {
+        epoll_watch(fd, EPOLL_CTL_MOD, epoll_events(conn));
+    } else {
+        uring_cancel_recv(fd);
+    }
+}
+
+// Backend chosen by psio_run()
+PsIoBackend psio_backend(void) {
+    return activeBackend;
+}
+
+// Serve a socket this process connected itself
+int psio_connect(int fd) {
+    if (open_conn(fd, 0) != 0) {
+        return -1;
+    }
+    pthread_t tid;
+    switch (activeBackend) {
+        case PSIO_EPOLL:
+            epoll_watch(fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP);
+            break;
+        case PSIO_URING:
+            uring_arm_recv(fd);
+            break;
+        default:
+            // the reader blocks, and sends wait for the connect to finish
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            pthread_create(&tid, NULL, thread_reader, (void *)(long)fd);
+            pthread_detach(tid);
+    }
+    return 0;
+}
+
+// Queue len bytes to be sent to fd
+int psio_send(int fd, char *data, int len) {
+    struct iovec iov = {data, len};
+    return psio_sendv(fd, &iov, 1);
+}
+
+// Queue the bytes of several pieces to be sent to fd as one run
+int psio_sendv(int fd, struct iovec *pieces, int iovCount) {
+    if (fd < 0 || fd >= maxConns || iovCount > PSIO_MAX_IOV) {
+        return -1;
+    }
+    IoConn *conn = &conns[fd];
+    struct iovec local[PSIO_MAX_IOV], *iov = local;
+    long len = 0;
+    for (int i = 0; i < iovCount; i++) {
+        local[i] = pieces[i];
+        len += pieces[i].iov_len;
+    }
+    count(&ioStats.sends, 1);
+    if (len == 0) {
+        return 0;
+    }
+    if (activeBackend == PSIO_THREAD) {
+        pthread_mutex_lock(&conn->lock);
+        int err = conn->open && !conn->dropped
+                ? thread_send_held(conn, fd, iov, iovCount, len) : -1;
+        pthread_mutex_unlock(&conn->lock);
+        return err;
+    }
+    if (!conn->open || conn->dropped) {
+        return -1;
+    }
+    // a client that cannot keep up may not pin more than its limit, nor
+    // more than an even share once the server as a whole is over
+    long queued = conn_queued(conn);
+    long open = __atomic_load_n(&ioStats.open, __ATOMIC_RELAXED);
+    if ((limits.connBytes > 0 && queued + len > limits.connBytes)
+            || (limits.totalBytes > 0 && queued > 0
+            && held_total() + len > limits.totalBytes
+            && queued >= limits.totalBytes / (open > 0 ? open : 1))) {
+        psio_drop(fd);
+        return -1;
+    }
+    // a corking connection with nothing in flight holds its output back
+    // until enough has built up; one that is writing coalesces anyway
+    int hold = conn->policy == PSIO_THROUGHPUT && !conn->writing;
+    if (activeBackend == PSIO_EPOLL && !hold && !conn->writing
+            && conn->outOff == conn->outLen) {
+        // nothing waiting, so the socket is written straight from the
+        // caller's buffers and only what it does not take is queued
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovCount;
+        int sent;
+        do {
+            sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            count(&ioStats.syscalls, 1);
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            fail_conn(fd);
+            return 0;
+        }
+        if (sent > 0) {
+            count(&ioStats.bytesOut, sent);
+            skip_iov(&iov, &iovCount, sent);
+        }
+    }
+    for (int i = 0; i < iovCount; i++) {
+        queue_out(conn, iov[i].iov_base, iov[i].iov_len);
+    }
+    if (hold && conn->outLen - conn->outOff < sendPolicy.corkBytes) {
+        cork_conn(fd);
+        return 0;
+    }
+    uncork_conn(conn);
+    if (activeBackend == PSIO_EPOLL && hold) {
+        epoll_flush(fd);
+    } else if (activeBackend == PSIO_EPOLL) {
+        epoll_set_writing(fd, conn->outOff < conn->outLen);
+    } else if (!conn->writing && !conn->flushQueued) {
+        conn->flushQueued = 1;
+        flushList[flushCount++] = fd;
+    }
+    return 0;
+}
+
+// Queue bytes for fd unless it is backed up
+int psio_try_send(int fd, char *data, int len) {
+    if (fd < 0 || fd >= maxConns) {
+        return -1;
+    }
+    IoConn *conn = &conns[fd];
+    if (activeBackend != PSIO_THREAD) {
+        if (!conn->open) {
+            return -1;
+        }
+        // corked output is held on purpose, not backed up
+        if (conn->writing || (conn->outOff < conn->outLen
+                && conn->corked != CORK_HELD)) {
+            conn->wantDrain = 1;
+            return 1;
+        }
+        return psio_send(fd, data, len);
+    }
+    count(&ioStats.sends, 1);
+    if (pthread_mutex_trylock(&conn->lock) != 0) {
+        // another thread is part way through a send to it
+        thread_want_drain(conn);
+        return 1;
+    }
+    int err = -1;
+    long held = conn->outLen - conn->outOff;
+    struct iovec iov[2] = {{conn->out + conn->outOff, held}, {data, len}};
+    struct iovec *rest = held > 0 ? iov : iov + 1;
+    int restCount = held > 0 ? 2 : 1;
+    if (conn->open && conn->policy == PSIO_THROUGHPUT
+            && held + len < sendPolicy.corkBytes) {
+        err = thread_send_held(conn, fd, iov + 1, 1, len);
+    } else if (conn->open) {
+        // anything corked goes first to keep the bytes in order
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = rest;
+        msg.msg_iovlen = restCount;
+        int sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        count(&ioStats.syscalls, 1);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            err = 1;
+        } else if (sent > 0) {
+            count(&ioStats.bytesOut, sent);
+            count(&ioStats.queued, -held);
+            conn->outOff = conn->outLen;
+            uncork_conn(conn);
+            skip_iov(&rest, &restCount, sent);
+            err = thread_sendv(fd, rest, restCount);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    if (err == 1) {
+        thread_want_drain(conn);
+    }
+    return err;
+}
+
+// **********************************************************************
+// sendmsg() len bytes with descriptors attached
+// **********************************************************************
+static int send_with_fds(int fd, char *data, int len, int *fds, int nfds) {
+    struct iovec iov = {data, len};
+    char control[CMSG_SPACE(8 * sizeof(int))];
+    struct msghdr hdr;
+    if (nfds > 8) {
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memset(control, 0, sizeof(control));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    int sent = sendmsg(fd, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+    count(&ioStats.syscalls, 1);
+    if (sent != len) {
+        return -1;
+    }
+    count(&ioStats.bytesOut, sent);
+    return 0;
+}
+
+// Send bytes with descriptors attached
+int psio_send_fds(int fd, char *data, int len, int *fds, int nfds) {
+    if (fd < 0 || fd >= maxConns) {
+        return -1;
+    }
+    IoConn *conn = &conns[fd];
+    int err = -1;
+    count(&ioStats.sends, 1);
+    pthread_mutex_lock(&conn->lock);
+    if (conn->open && !conn->writing) {
+        // nothing is in flight, so whatever is queued can go out first
+        err = 0;
+        if (conn->outOff < conn->outLen) {
+            err = thread_send(conn, fd, conn->out + conn->outOff,
+                    conn->outLen - conn->outOff);
+            count(&ioStats.queued, -(conn->outLen - conn->outOff));
+            conn->outOff = conn->outLen;
+        }
+        if (err == 0) {
+            err = send_with_fds(fd, data, len, fds, nfds);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return err;
+}
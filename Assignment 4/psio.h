@@ -0,0 +1,197 @@
+#ifndef PSIO_H
+#define PSIO_H
+
+#include <sys/uio.h>
+
+// I/O backends for psserver. The protocol code only sees callbacks for
+// new connections, received bytes and closed connections, and sends
+// through psio_send(), so the same server can run with:
+//   PSIO_THREAD - one blocking reader thread per connection
+//   PSIO_EPOLL  - a single thread driving non-blocking sockets
+//   PSIO_URING  - a single thread driving io_uring with batched
+//                 submissions, registered send buffers, multishot accept
+//                 and multishot recv into a provided-buffer ring
+typedef enum PsIoBackend {
+    PSIO_THREAD,
+    PSIO_EPOLL,
+    PSIO_URING
+} PsIoBackend;
+
+typedef struct PsIoCallbacks {
+    // A connection was accepted. The returned pointer is handed back
+    // to received() and closed() for this connection.
+    void *(*opened)(int fd);
+    // Bytes arrived on a connection. data is only valid during the call.
+    void (*received)(void *conn, char *data, int len);
+    // The peer closed the connection or it failed. The fd is closed by
+    // the I/O layer once this returns.
+    void (*closed)(void *conn);
+    // A connection psio_try_send() found backed up has caught up. Called
+    // on the I/O thread with epoll and uring, and on a thread of its own
+    // with the thread backend. The connection may have closed (and the
+    // fd been reused) since, so it is given the fd and not the
+    // connection. May be NULL if psio_try_send() is never used.
+    void (*drained)(int fd);
+} PsIoCallbacks;
+
+// Counters kept by the I/O layer, read by psio_get_stats()
+typedef struct PsIoStats {
+    unsigned long syscalls;     // socket, epoll and io_uring_enter calls
+    unsigned long sends;        // psio_send() calls
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long open;         // connections open now
+    unsigned long queued;       // bytes waiting to be written
+    unsigned long charged;      // bytes charged with psio_charge()
+    unsigned long refused;      // connections closed as soon as accepted
+    unsigned long dropped;      // connections cut off by psio_drop()
+    unsigned long corked;       // times output was held back to coalesce
+    unsigned long paused;       // times reading was paused by psio_pause()
+} PsIoStats;
+
+// Limits the I/O layer enforces, 0 meaning none. A connection holds its
+// queued output plus whatever the protocol code charges to it with
+// psio_charge() (partial input, subscriptions and the like).
+//   maxOpen    - accepted connections beyond this many are closed
+//   connBytes  - most one connection may hold. A send that would take
+//                its queued output alone over drops the connection, and
+//                psio_charge() reports when queue and charges are over.
+//   totalBytes - most all connections together may hold; over it new
+//                connections are refused and a send to a connection
+//                queueing more than an even share of it drops it
+// With the thread backend sends block rather than queue, so only the
+// charges count.
+typedef struct PsIoLimits {
+    int maxOpen;
+    long connBytes;
+    long totalBytes;
+} PsIoLimits;
+
+// How a connection's output is handed to the kernel. Every TCP
+// connection has TCP_NODELAY set, so Nagle's algorithm never holds a
+// message back waiting for the peer's (possibly delayed) ACK; any
+// coalescing is done here instead, with a deadline.
+//   PSIO_LATENCY    - each send is written (or queued behind what is
+//                     already waiting) at once
+//   PSIO_THROUGHPUT - sends are corked: held in the queue until corkBytes
+//                     have built up or corkUs microseconds have passed
+//                     since the first of them, then written together
+typedef enum PsIoPolicy {
+    PSIO_LATENCY,
+    PSIO_THROUGHPUT
+} PsIoPolicy;
+
+typedef struct PsIoSendPolicy {
+    PsIoPolicy policy;          // for new connections
+    int corkBytes;
+    int corkUs;
+} PsIoSendPolicy;
+
+// Parse a backend name ("thread", "epoll" or "uring"). Returns -1 if the
+// name is not known.
+int psio_parse_backend(const char *name);
+
+// Printable name of a backend
+const char *psio_backend_name(PsIoBackend backend);
+
+// Parse a send policy name ("latency" or "throughput"). Returns -1 if
+// the name is not known.
+int psio_parse_policy(const char *name);
+
+// Serve connections accepted on any of the count listening sockets in
+// fds (TCP or Unix domain) forever. If the requested backend is not
+// supported by the kernel the next simpler one is used (uring falls back
+// to epoll, epoll to thread).
+void psio_run(PsIoBackend backend, int *fds, int count,
+        PsIoCallbacks *callbacks);
+
+// Backend actually in use once psio_run() has started
+PsIoBackend psio_backend(void);
+
+// Serve fd, a socket this process connected itself (it may still be
+// connecting), like an accepted connection: opened() is called for it
+// before this returns. Call it from the tick. Returns -1 if fd cannot
+// be served, in which case it has been closed.
+int psio_connect(int fd);
+
+// Queue len bytes to be sent to fd. Bytes passed in separate calls are
+// never interleaved. With the thread backend it may be called from any
+// thread and returns once the bytes are written; with epoll and uring
+// it must be called from the thread inside psio_run() and the bytes may
+// be sent later. Returns 0 on success or -1 if the connection is closed
+// or has been dropped (see PsIoLimits).
+int psio_send(int fd, char *data, int len);
+
+// Most pieces psio_sendv() takes in one call
+#define PSIO_MAX_IOV 8
+
+// psio_send() for bytes gathered from up to PSIO_MAX_IOV pieces, sent as
+// one run without first copying them together. With epoll, when nothing
+// is waiting for the connection, the socket is written straight from
+// the pieces and only what it does not take is copied into the queue.
+// The pieces themselves are left as they were.
+int psio_sendv(int fd, struct iovec *iov, int count);
+
+// Queue len bytes for fd only if the connection is keeping up: with
+// epoll and uring, if nothing sent to it earlier is still waiting, and
+// with the thread backend, if no other thread is sending to it and the
+// socket takes at least some of the bytes without blocking (the rest are
+// then written before returning). Never waits for another sender.
+// Returns 0 if the bytes were queued, -1 if the connection is closed,
+// or 1 if it is backed up: nothing was queued and drained() will be
+// called once it has room again. Called from the same threads as
+// psio_send().
+int psio_try_send(int fd, char *data, int len);
+
+// Send len bytes to fd with the nfds descriptors in fds attached as
+// SCM_RIGHTS (fd must be a Unix domain socket). Anything already queued
+// for fd is written first so the bytes stay in order. Meant for short
+// control replies: returns -1 if the connection is closed or the bytes
+// cannot be written straight away.
+int psio_send_fds(int fd, char *data, int len, int *fds, int nfds);
+
+// Copy the current counters into stats
+void psio_get_stats(PsIoStats *stats);
+
+// Call fn every ms milliseconds once psio_run() has started: on the I/O
+// thread with epoll and uring, so fn may call psio_send(), and on a
+// timer thread of its own with the thread backend. Set before
+// psio_run().
+void psio_set_tick(int ms, void (*fn)(void));
+
+// Bytes handed to psio_send() but not yet written to their sockets,
+// over every connection
+unsigned long psio_queued(void);
+
+// Set the limits to enforce. Call before psio_run().
+void psio_set_limits(PsIoLimits *limits);
+
+// Set the send policy new connections start with and the cork size and
+// deadline throughput mode uses. Call before psio_run().
+void psio_set_send_policy(PsIoSendPolicy *policy);
+
+// Change the send policy of one connection. Output already corked goes
+// out no later than its deadline. Called from the same threads as
+// psio_send().
+void psio_set_policy(int fd, PsIoPolicy policy);
+
+// Add delta bytes (negative to give them back) to what fd is charged
+// for. Returns 0, or 1 if fd is now over connBytes, or 2 if only the
+// total is over totalBytes. The charge is kept either way; a connection
+// that closes gives back whatever it still holds. Callable from any
+// thread.
+int psio_charge(int fd, long delta);
+
+// Cut off a connection that has gone over a memory limit. It closes
+// through the normal path and nothing more is sent to it.
+void psio_drop(int fd);
+
+// Stop reading from fd for us microseconds, so a client sending too
+// fast is held back by TCP flow control rather than by the server
+// buffering what it sends. Bytes already received are still handed to
+// received(), but no more are read until the time is up. Pausing a
+// connection that is already paused only ever makes the wait longer.
+// Call it from received() for that connection.
+void psio_pause(int fd, long us);
+
+#endif
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pslog.h"
+
+#define LOG_MAGIC 0x50534c47 // "PSLG"
+#define LOG_ALIGN 8
+#define LOG_BUFFER_LIMIT (4 * 1024 * 1024)
+
+// On-disk header in front of every record. The sender, topic and
+// message bytes follow it and the record is padded to LOG_ALIGN bytes.
+// checksum covers everything after itself, including the padding.
+typedef struct LogRecordHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t seq;
+    uint16_t sentByLen;
+    uint16_t topicLen;
+    uint32_t msgLen;
+} LogRecordHeader;
+
+// One segment file. Only the last segment is ever written to.
+typedef struct LogSegment {
+    uint64_t firstSeq;
+    char *path;
+} LogSegment;
+
+// Growable byte buffer used for the pending and in-flight batches
+typedef struct LogBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} LogBuffer;
+
+struct PsLog {
+    char *dir;
+    long segmentSize;
+    int fsyncBatch;
+    int fsyncMs;
+    int waitDurable;
+
+    // protects everything below as well as the pending buffer
+    pthread_mutex_t lock;
+    pthread_cond_t wakeWriter;  // records pending or closing
+    pthread_cond_t progress;    // writtenSeq/syncedSeq moved or room freed
+    LogBuffer pending;
+    uint64_t pendingFirstSeq;
+    uint64_t nextSeq;
+    uint64_t writtenSeq;        // last seq handed to write()
+    uint64_t syncedSeq;         // last seq known to be on stable storage
+    int durableWaiters;
+    int closing;
+    int failed;
+
+    // segment list, only changed by the writer thread under segLock
+    pthread_mutex_t segLock;
+    LogSegment *segments;
+    int segCount;
+    int segFd;
+    long segBytes;
+
+    pthread_t writer;
+};
+
+// **********************************************************************
+// FNV-1a hash used as a cheap checksum to detect torn or corrupt records
+// **********************************************************************
+static uint32_t log_checksum(const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// **********************************************************************
+// Total size of a record including header and padding
+// **********************************************************************
+static size_t record_size(size_t bodyLen) {
+    size_t len = sizeof(LogRecordHeader) + bodyLen;
+    return (len + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+}
+
+// **********************************************************************
+// Current CLOCK_MONOTONIC time in milliseconds
+// **********************************************************************
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// **********************************************************************
+// Make sure buf can hold extra more bytes. Returns 0 on success.
+// **********************************************************************
+static int buffer_reserve(LogBuffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return 0;
+    }
+    size_t newCap = buf->cap ? buf->cap * 2 : 64 * 1024;
+    while (newCap < buf->len + extra) {
+        newCap *= 2;
+    }
+    char *data = realloc(buf->data, newCap);
+    if (data == NULL) {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = newCap;
+    return 0;
+}
+
+// **********************************************************************
+// Walk the records in a mapped segment, calling visit (if not NULL) for
+// every valid record with seq >= fromSeq. Stops at the first record that
+// is truncated or fails its checksum. Returns the number of valid bytes
+// and stores the last valid sequence number in lastSeq.
+// **********************************************************************
+static size_t walk_segment(char *map, size_t size, uint64_t fromSeq,
+        PsLogVisitor visit, void *arg, uint64_t *lastSeq, long *visited) {
+    size_t off = 0;
+    while (off + sizeof(LogRecordHeader) <= size) {
+        LogRecordHeader *hdr = (LogRecordHeader *)(map + off);
+        if (hdr->magic != LOG_MAGIC) {
+            break;
+        }
+        size_t bodyLen = (size_t)hdr->sentByLen + hdr->topicLen
+                + hdr->msgLen;
+        size_t len = record_size(bodyLen);
+        if (off + len > size) {
+            break;
+        }
+        size_t sumOff = offsetof(LogRecordHeader, seq);
+        if (log_checksum(map + off + sumOff, len - sumOff)
+                != hdr->checksum) {
+            break;
+        }
+        if (visit != NULL && hdr->seq >= fromSeq) {
+            char *body = map + off + sizeof(LogRecordHeader);
+            visit(arg, hdr->seq, body, hdr->sentByLen,
+                    body + hdr->sentByLen, hdr->topicLen,
+                    body + hdr->sentByLen + hdr->topicLen, hdr->msgLen);
+            (*visited)++;
+        }
+        *lastSeq = hdr->seq;
+        off += len;
+    }
+    return off;
+}
+
+// **********************************************************************
+// Order segments by their first sequence number
+// **********************************************************************
+static int compare_segments(const void *a, const void *b) {
+    const LogSegment *segA = a, *segB = b;
+    if (segA->firstSeq < segB->firstSeq) {
+        return -1;
+    }
+    return segA->firstSeq > segB->firstSeq;
+}
+
+// **********************************************************************
+// Build the file name of the segment starting at firstSeq
+// **********************************************************************
+static char *segment_path(PsLog *log, uint64_t firstSeq) {
+    char *path = malloc(strlen(log->dir) + 32);
+    sprintf(path, "%s/%020llu.seg", log->dir, (unsigned long long)firstSeq);
+    return path;
+}
+
+// **********************************************************************
+// Find existing segments, validate them through mmap and reopen the last
+// one for appending. Returns 0 on success.
+// **********************************************************************
+static int recover_segments(PsLog *log) {
+    DIR *dir = opendir(log->dir);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long firstSeq;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%llu.%4s", &firstSeq, suffix) != 2
+                || strcmp(suffix, "seg") != 0) {
+            continue;
+        }
+        log->segments = realloc(log->segments,
+                sizeof(LogSegment) * (log->segCount + 1));
+        log->segments[log->segCount].firstSeq = firstSeq;
+        log->segments[log->segCount].path = segment_path(log, firstSeq);
+        log->segCount++;
+    }
+    closedir(dir);
+    qsort(log->segments, log->segCount, sizeof(LogSegment),
+            compare_segments);
+
+    log->nextSeq = 1;
+    log->segFd = -1;
+    for (int i = 0; i < log->segCount; i++) {
+        int last = (i == log->segCount - 1);
+        int fd = open(log->segments[i].path, last ? O_RDWR : O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        uint64_t lastSeq = log->segments[i].firstSeq - 1;
+        size_t valid = 0;
+        if (st.st_size > 0) {
+            char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            long visited = 0;
+            valid = walk_segment(map, st.st_size, 0, NULL, NULL, &lastSeq,
+                    &visited);
+            munmap(map, st.st_size);
+        }
+        if (lastSeq + 1 > log->nextSeq) {
+            log->nextSeq = lastSeq + 1;
+        }
+        if (!last) {
+            close(fd);
+            continue;
+        }
+        if (valid < (size_t)st.st_size && ftruncate(fd, valid) != 0) {
+            close(fd);
+            return -1;
+        }
+        lseek(fd, valid, SEEK_SET);
+        log->segFd = fd;
+        log->segBytes = valid;
+    }
+    log->writtenSeq = log->nextSeq - 1;
+    log->syncedSeq = log->nextSeq - 1;
+    return 0;
+}
+
+// **********************************************************************
+// Start a new segment whose first record is firstSeq. Called by the
+// writer thread only. Returns 0 on success.
+// **********************************************************************
+static int start_segment(PsLog *log, uint64_t firstSeq) {
+    if (log->segFd >= 0) {
+        fdatasync(log->segFd);
+        close(log->segFd);
+    }
+    char *path = segment_path(log, firstSeq);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        free(path);
+        log->segFd = -1;
+        return -1;
+    }
+    pthread_mutex_lock(&log->segLock);
+    log->segments = realloc(log->segments,
+            sizeof(LogSegment) * (log->segCount + 1));
+    log->segments[log->segCount].firstSeq = firstSeq;
+    log->segments[log->segCount].path = path;
+    log->segCount++;
+    pthread_mutex_unlock(&log->segLock);
+    log->segFd = fd;
+    log->segBytes = 0;
+    return 0;
+}
+
+// **********************************************************************
+// Write the whole buffer, retrying after short writes. Returns 0 on
+// success.
+// **********************************************************************
+static int write_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t done = write(fd, data, len);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += done;
+        len -= done;
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Writer thread. Takes the whole pending batch at once, writes it with a
+// single write() and syncs once per fsyncBatch records, once fsyncMs has
+// passed, or straight away if a publisher is waiting for durability.
+// This is what turns many concurrent publishes into one group commit.
+// **********************************************************************
+static void *log_writer(void *arg) {
+    PsLog *log = (PsLog *)arg;
+    LogBuffer batch = {NULL, 0, 0};
+    long long lastSync = now_ms();
+    int unsynced = 0;
+    uint64_t unsyncedSeq = 0;
+
+    pthread_mutex_lock(&log->lock);
+    while (1) {
+        while (log->pending.len == 0 && !log->closing) {
+            if (unsynced == 0) {
+                pthread_cond_wait(&log->wakeWriter, &log->lock);
+                continue;
+            }
+            long long waitMs = lastSync + log->fsyncMs - now_ms();
+            if (waitMs <= 0) {
+                break;
+            }
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += waitMs / 1000;
+            ts.tv_nsec += (waitMs % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&log->wakeWriter, &log->lock, &ts);
+        }
+        if (log->pending.len == 0 && log->closing && unsynced == 0) {
+            break;
+        }
+
+        // swap buffers so publishers can keep appending while we write
+        LogBuffer swap = log->pending;
+        log->pending = batch;
+        log->pending.len = 0;
+        batch = swap;
+        uint64_t firstSeq = log->pendingFirstSeq;
+        uint64_t lastSeq = log->nextSeq - 1;
+        int waiters = log->durableWaiters;
+        pthread_cond_broadcast(&log->progress);
+        pthread_mutex_unlock(&log->lock);
+
+        int err = 0;
+        if (batch.len > 0) {
+            if (log->segFd < 0 || (log->segBytes > 0
+                    && log->segBytes + (long)batch.len > log->segmentSize)) {
+                err = start_segment(log, firstSeq);
+            }
+            if (err == 0) {
+                err = write_all(log->segFd, batch.data, batch.len);
+                log->segBytes += batch.len;
+            }
+            unsynced += (int)(lastSeq - firstSeq + 1);
+            unsyncedSeq = lastSeq;
+        }
+        int synced = 0;
+        if (err == 0 && unsynced > 0 && (waiters > 0 || log->closing
+                || (log->fsyncBatch > 0 && unsynced >= log->fsyncBatch)
+                || now_ms() - lastSync >= log->fsyncMs)) {
+            if (log->fsyncBatch > 0 || waiters > 0 || log->closing) {
+                err = fdatasync(log->segFd);
+            }
+            synced = 1;
+            unsynced = 0;
+            lastSync = now_ms();
+        }
+
+        pthread_mutex_lock(&log->lock);
+        if (err != 0) {
+            log->failed = 1;
+        }
+        if (batch.len > 0) {
+            log->writtenSeq = lastSeq;
+        }
+        if (synced) {
+            log->syncedSeq = unsyncedSeq;
+        }
+        batch.len = 0;
+        pthread_cond_broadcast(&log->progress);
+        if (log->failed) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    free(batch.data);
+    return NULL;
+}
+
+// Open (creating if needed) the log stored in dir and recover its state
+PsLog *pslog_open(const char *dir, long segmentSize, int fsyncBatch,
+        int fsyncMs, int waitDurable) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    PsLog *log = calloc(1, sizeof(PsLog));
+    log->dir = strdup(dir);
+    log->segmentSize = segmentSize;
+    log->fsyncBatch = fsyncBatch;
+    log->fsyncMs = fsyncMs > 0 ? fsyncMs : 1;
+    log->waitDurable = waitDurable;
+    if (recover_segments(log) != 0) {
+        for (int i = 0; i < log->segCount; i++) {
+            free(log->segments[i].path);
+        }
+        free(log->segments);
+        free(log->dir);
+        free(log);
+        return NULL;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_mutex_init(&log->segLock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->wakeWriter, &attr);
+    pthread_cond_init(&log->progress, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_create(&log->writer, NULL, log_writer, log);
+    return log;
+}
+
+// Append a published message to the log and return its sequence number
+uint64_t pslog_append(PsLog *log, char *sentBy, char *topic, char *msg,
+        int msgLen) {
+    size_t sentByLen = strlen(sentBy);
+    size_t topicLen = strlen(topic);
+    if (sentByLen > UINT16_MAX || topicLen > UINT16_MAX) {
+        return 0;
+    }
+    size_t bodyLen = sentByLen + topicLen + msgLen;
+    size_t len = record_size(bodyLen);
+
+    pthread_mutex_lock(&log->lock);
+    // bound memory if the disk cannot keep up
+    while (log->pending.len > 0 && log->pending.len + len > LOG_BUFFER_LIMIT
+            && !log->failed) {
+        pthread_cond_wait(&log->progress, &log->lock);
+    }
+    if (log->failed || buffer_reserve(&log->pending, len) != 0) {
+        pthread_mutex_unlock(&log->lock);
+        return 0;
+    }
+    uint64_t seq = log->nextSeq++;
+    if (log->pending.len == 0) {
+        log->pendingFirstSeq = seq;
+    }
+    char *rec = log->pending.data + log->pending.len;
+    LogRecordHeader *hdr = (LogRecordHeader *)rec;
+    hdr->magic = LOG_MAGIC;
+    hdr->seq = seq;
+    hdr->sentByLen = sentByLen;
+    hdr->topicLen = topicLen;
+    hdr->msgLen = msgLen;
+    char *body = rec + sizeof(LogRecordHeader);
+    memcpy(body, sentBy, sentByLen);
+    memcpy(body + sentByLen, topic, topicLen);
+    memcpy(body + sentByLen + topicLen, msg, msgLen);
+    memset(body + bodyLen, 0, len - sizeof(LogRecordHeader) - bodyLen);
+    size_t sumOff = offsetof(LogRecordHeader, seq);
+    hdr->checksum = log_checksum(rec + sumOff, len - sumOff);
+    log->pending.len += len;
+    pthread_cond_signal(&log->wakeWriter);
+
+    if (log->waitDurable) {
+        log->durableWaiters++;
+        while (log->syncedSeq < seq && !log->failed) {
+            pthread_cond_wait(&log->progress, &log->lock);
+        }
+        log->durableWaiters--;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return seq;
+}
+
+// Visit every record with sequence number >= fromSeq written to disk
+long pslog_replay(PsLog *log, uint64_t fromSeq, PsLogVisitor visit,
+        void *arg) {
+    long visited = 0;
+    pthread_mutex_lock(&log->lock);
+    uint64_t writtenSeq = log->writtenSeq;
+    pthread_mutex_unlock(&log->lock);
+
+    pthread_mutex_lock(&log->segLock);
+    int segCount = log->segCount;
+    LogSegment *segments = malloc(sizeof(LogSegment) * (segCount + 1));
+    for (int i = 0; i < segCount; i++) {
+        segments[i].firstSeq = log->segments[i].firstSeq;
+        segments[i].path = strdup(log->segments[i].path);
+    }
+    pthread_mutex_unlock(&log->segLock);
+
+    for (int i = 0; i < segCount && visited >= 0; i++) {
+        if (i + 1 < segCount && segments[i + 1].firstSeq <= fromSeq) {
+            continue; // whole segment is before fromSeq
+        }
+        if (segments[i].firstSeq > writtenSeq) {
+            break;
+        }
+        int fd = open(segments[i].path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            visited = -1;
+        } else if (st.st_size > 0) {
+            char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                visited = -1;
+            } else {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                uint64_t lastSeq = 0;
+                walk_segment(map, st.st_size, fromSeq, visit, arg, &lastSeq,
+                        &visited);
+                munmap(map, st.st_size);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    for (int i = 0; i < segCount; i++) {
+        free(segments[i].path);
+    }
+    free(segments);
+    return visited;
+}
+
+// Flush and sync all pending records, stop the writer and free the log
+void pslog_close(PsLog *log) {
+    if (log == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&log->lock);
+    log->closing = 1;
+    pthread_cond_signal(&log->wakeWriter);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->writer, NULL);
+    if (log->segFd >= 0) {
+        close(log->segFd);
+    }
+    for (int i = 0; i < log->segCount; i++) {
+        free(log->segments[i].path);
+    }
+    free(log->segments);
+    free(log->pending.data);
+    free(log->dir);
+    pthread_mutex_destroy(&log->lock);
+    pthread_mutex_destroy(&log->segLock);
+    pthread_cond_destroy(&log->wakeWriter);
+    pthread_cond_destroy(&log->progress);
+    free(log);
+}
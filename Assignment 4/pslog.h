@@ -0,0 +1,45 @@
+#ifndef PSLOG_H
+#define PSLOG_H
+
+#include <stdint.h>
+
+// Durable append-only log of published messages. Records are appended
+// to segment files named <dir>/<firstseq>.seg by a background writer
+// thread that batches many publishes into each write() and fsync().
+// Existing segments are read back through mmap() for recovery and replay.
+typedef struct PsLog PsLog;
+
+// Called once per record found by pslog_replay(). Strings are not nul
+// terminated and point into mapped segment memory that is only valid
+// for the duration of the call.
+typedef void (*PsLogVisitor)(void *arg, uint64_t seq,
+        char *sentBy, int sentByLen, char *topic, int topicLen,
+        char *msg, int msgLen);
+
+// Open (creating if needed) the log stored in dir and recover its
+// state from existing segments. A torn record at the tail of the last
+// segment is truncated away. segmentSize is the size at which a new
+// segment is started, fsyncBatch the number of records written between
+// fsyncs (0 leaves syncing to the OS) and fsyncMs the longest time
+// written records may stay unsynced. If waitDurable is set,
+// pslog_append() does not return until its record has been fsynced.
+// Returns NULL if the directory or a segment cannot be used.
+PsLog *pslog_open(const char *dir, long segmentSize, int fsyncBatch,
+        int fsyncMs, int waitDurable);
+
+// Append a published message of msgLen bytes to the log. Returns the
+// sequence number given to the record or 0 if the log has failed.
+uint64_t pslog_append(PsLog *log, char *sentBy, char *topic, char *msg,
+        int msgLen);
+
+// Visit every record with sequence number >= fromSeq that has been
+// written to disk, in sequence order. Returns the number of records
+// visited or -1 if a segment could not be mapped.
+long pslog_replay(PsLog *log, uint64_t fromSeq, PsLogVisitor visit,
+        void *arg);
+
+// Flush and sync all pending records, stop the writer thread and free
+// the log. Does nothing if log is NULL.
+void pslog_close(PsLog *log);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef PSPROTO_H
+#define PSPROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Binary framing shared by psserver and psclient.
+//
+// A client selects binary mode by making PSPROTO_HELLO the first bytes
+// it sends; the server answers with the same four bytes. Text commands
+// always start with a letter so both kinds of client share one port.
+// After the hello every message in either direction is a frame: an
+// 8 byte header followed by name, topic and payload bytes. Only the
+// header is examined, so payloads may hold newlines, colons or any
+// other byte.
+#define PSPROTO_MAGIC 0xB5
+#define PSPROTO_VERSION 1
+#define PSPROTO_HELLO_LEN 4
+#define PSPROTO_HEADER_LEN 8
+#define PSPROTO_MAX_PAYLOAD (16 * 1024 * 1024)
+
+// Frame opcodes. NAME carries the client name in the name field; SUB,
+// UNSUB and PUB carry the topic and, for PUB, the payload. The server
+// delivers messages as MSG frames holding sender, topic and payload.
+// TEXT carries any other text command in its payload. SUB may list
+// several topics separated by spaces. PUBBATCH carries many publishes in
+// its payload, each a 2 byte topic length and 4 byte message length
+// followed by the topic and message bytes.
+//
+// PEER opens a link between two servers instead of a client session;
+// its name field holds the sender's server id and each end sends one.
+// Over a link SUB and UNSUB say whether the sending server has local
+// subscribers to a topic, and MSG carries a publish to be delivered to
+// the receiving server's own subscribers.
+//
+// TOPICID asks the server for the id of the topic in its topic field,
+// and is answered with a TOPICID frame holding the topic again and the
+// id as a 4 byte payload. PUBID then publishes by id: its payload is the
+// 4 byte id followed by the message, and the name and topic fields are
+// empty. Subscribers still get MSG frames with the topic name. Ids are
+// only good on the server that gave them and for as long as it runs.
+//
+// PING asks the other end to show it is still there and is answered
+// with PONG; neither carries any fields. The text forms are "ping",
+// answered with ":pong", and the server's ":ping", answered with "pong".
+#define PS_OP_NAME 1
+#define PS_OP_SUB 2
+#define PS_OP_UNSUB 3
+#define PS_OP_PUB 4
+#define PS_OP_MSG 5
+#define PS_OP_INVALID 6
+#define PS_OP_TEXT 7
+#define PS_OP_PUBBATCH 8
+#define PS_OP_PEER 9
+#define PS_OP_PING 10
+#define PS_OP_PONG 11
+#define PS_OP_TOPICID 12
+#define PS_OP_PUBID 13
+
+static const unsigned char PSPROTO_HELLO[PSPROTO_HELLO_LEN] = {
+        PSPROTO_MAGIC, 'P', 'S', PSPROTO_VERSION};
+
+// Decoded frame header
+typedef struct PsFrame {
+    int opcode;
+    int nameLen;
+    int topicLen;
+    uint32_t payloadLen;
+} PsFrame;
+
+// Write the header for a frame into out (PSPROTO_HEADER_LEN bytes)
+static inline void psproto_encode(unsigned char *out, int opcode,
+        int nameLen, int topicLen, uint32_t payloadLen) {
+    uint16_t topicNet = htons(topicLen);
+    uint32_t payloadNet = htonl(payloadLen);
+    out[0] = opcode;
+    out[1] = nameLen;
+    memcpy(out + 2, &topicNet, 2);
+    memcpy(out + 4, &payloadNet, 4);
+}
+
+// Read a frame header from in (PSPROTO_HEADER_LEN bytes)
+static inline void psproto_decode(const unsigned char *in, PsFrame *frame) {
+    uint16_t topicNet;
+    uint32_t payloadNet;
+    memcpy(&topicNet, in + 2, 2);
+    memcpy(&payloadNet, in + 4, 4);
+    frame->opcode = in[0];
+    frame->nameLen = in[1];
+    frame->topicLen = ntohs(topicNet);
+    frame->payloadLen = ntohl(payloadNet);
+}
+
+// Size of the whole frame described by a header
+static inline size_t psproto_frame_len(PsFrame *frame) {
+    return PSPROTO_HEADER_LEN + frame->nameLen + frame->topicLen
+            + (size_t)frame->payloadLen;
+}
+
+#endif
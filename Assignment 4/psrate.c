@@ -0,0 +1,43 @@
+#include "psrate.h"
+
+// Set up a rate limit
+void psrate_init(PsRate *rate, long perSec, long burst) {
+    rate->interval = 0;
+    rate->depth = 0;
+    if (perSec <= 0) {
+        return;
+    }
+    rate->interval = 1000000000ULL / perSec;
+    if (rate->interval == 0) {
+        rate->interval = 1;
+    }
+    rate->depth = rate->interval * (burst < 1 ? 1 : burst);
+}
+
+// 1 if the limit is on
+int psrate_enabled(PsRate *rate) {
+    return rate->interval != 0;
+}
+
+// Take n tokens from a bucket
+uint64_t psrate_take(PsRate *rate, uint64_t *bucket, int n, uint64_t now,
+        int borrow) {
+    uint64_t full = __atomic_load_n(bucket, __ATOMIC_RELAXED), next;
+    while (1) {
+        // a bucket full before now is simply full
+        next = (full > now ? full : now) + rate->interval * n;
+        if (!borrow && next - now > rate->depth) {
+            return next - now - rate->depth;
+        }
+        if (__atomic_compare_exchange_n(bucket, &full, next, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    return next - now > rate->depth ? next - now - rate->depth : 0;
+}
+
+// Put back tokens
+void psrate_give(PsRate *rate, uint64_t *bucket, int n) {
+    __atomic_fetch_sub(bucket, rate->interval * n, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,43 @@
+#ifndef PSRATE_H
+#define PSRATE_H
+
+#include <stdint.h>
+
+// Token buckets for psserver's publish rate limits. A bucket fills at
+// perSec tokens a second up to burst tokens, and each publish takes one.
+// Rather than a token count and a refill time, a bucket is kept as one
+// 64 bit word: the time in nanoseconds at which it will be full again.
+// Taking n tokens moves that time n intervals later, so a bucket shared
+// between threads (a topic's) is updated with one compare-and-swap and
+// no lock, and nothing has to refill buckets in the background.
+//
+// A take may borrow: the tokens are taken even if the bucket does not
+// hold them, and the caller is told how long the bucket stays in debt,
+// which is how long the client should be kept waiting.
+
+// Settings shared by every bucket of one kind. interval 0 = no limit.
+typedef struct PsRate {
+    uint64_t interval;  // nanoseconds per token
+    uint64_t depth;     // nanoseconds of tokens a full bucket holds
+} PsRate;
+
+// Set up a limit of perSec tokens a second with room for burst of them
+// at once. A perSec of 0 or less turns the limit off; a burst below 1
+// is taken as 1.
+void psrate_init(PsRate *rate, long perSec, long burst);
+
+// 1 if the limit is on
+int psrate_enabled(PsRate *rate);
+
+// Take n tokens from bucket at time now (nanoseconds). Without borrow,
+// nothing is taken if the bucket lacks them and the nanoseconds until
+// it would have them are returned. With borrow they are always taken
+// and the nanoseconds until the bucket is out of debt are returned. 0
+// means the tokens were there.
+uint64_t psrate_take(PsRate *rate, uint64_t *bucket, int n, uint64_t now,
+        int borrow);
+
+// Put back n tokens taken by psrate_take()
+void psrate_give(PsRate *rate, uint64_t *bucket, int n);
+
+#endif
@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "pshist.h"
+#include "pstrace.h"
+
+// Replays a trace psserver recorded with PSSERVER_TRACE against a
+// server on loopback. Every recorded connection is opened again and sent
+// exactly the bytes its client sent, one record at a time in trace
+// order, so each run drives the server the same way. Records go out at
+// the pace they were recorded (scaled by --speed) or, with --fast, as
+// fast as the server takes them. --fast waits for the server to accept
+// new connections before going on, and keeps every connection open to
+// the end, as its subscribers would otherwise close long before the
+// messages they got in the original run reached them. A second thread
+// reads and throws away the replies; a run lasts until they stop.
+// Meanwhile a probe publisher of our own sends timestamped messages to a
+// probe subscriber --probe times a second, so delivery latency under the
+// replayed load is measured the same way whatever the trace holds.
+//
+// --save writes the results to a file. --baseline compares the run with
+// such a file and exits with status 2 if replay throughput fell, or
+// probe p99 latency rose, by more than --tolerance percent.
+
+// Width of the send timestamp in each probe message
+#define STAMP_LEN 16
+// How long replies must stop arriving for the server to count as done
+#define QUIET_MS 200
+// Longest to wait for that after the last record is sent
+#define QUIET_LIMIT_MS 10000
+
+typedef struct ReplayConfig {
+    int port;
+    int fast;
+    double speed;       // pace multiplier when not --fast
+    int probeRate;      // probe messages per second, 0 for none
+    double tolerance;   // percent change --baseline lets through
+    char *save;
+    char *baseline;
+    char *path;         // trace file
+} ReplayConfig;
+
+// Results of a run, as saved and compared. Bigger is better for the
+// first two and worse for the rest.
+typedef struct ReplayResult {
+    double recordsPerSec;
+    double bytesPerSec;
+    double probeP50;
+    double probeP99;
+    double probeP999;
+} ReplayResult;
+
+ReplayConfig config = {0, 0, 1.0, 200, 10.0, NULL, NULL, NULL};
+
+// socket for each recorded connection number, -1 when not open
+int *connFds;
+uint32_t connCount;
+
+// reply reader
+int drainEpfd;
+unsigned long bytesIn;
+uint64_t lastReply;
+
+// probe
+PsHist probeHist;
+volatile int stopProbe = 0;
+
+// **********************************************************************
+// Nanoseconds on the monotonic clock
+// **********************************************************************
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// **********************************************************************
+// Sleep until the monotonic clock reads at nanoseconds
+// **********************************************************************
+void sleep_until(uint64_t at) {
+    struct timespec ts = {at / 1000000000ULL, at % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+            == EINTR) {
+    }
+}
+
+// **********************************************************************
+// Send every byte, blocking as needed. Returns -1 on error.
+// **********************************************************************
+int send_all(int fd, char *data, int len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Connect to the server. Returns the socket or -1.
+// **********************************************************************
+int connect_server(void) {
+    struct sockaddr_in sAddr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    sAddr.sin_port = htons(config.port);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sAddr,
+            sizeof(sAddr)) == -1) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// **********************************************************************
+// Reply reader thread: read whatever the server sends to the replayed
+// connections and throw it away, noting when the last of it came
+// **********************************************************************
+void *drain_thread(void *arg) {
+    struct epoll_event events[256];
+    char buf[65536];
+    while (1) {
+        int n = epoll_wait(drainEpfd, events, 256, -1);
+        for (int i = 0; i < n; i++) {
+            ssize_t got = recv(events[i].data.fd, buf, sizeof(buf),
+                    MSG_DONTWAIT);
+            if (got > 0) {
+                __atomic_add_fetch(&bytesIn, got, __ATOMIC_RELAXED);
+                __atomic_store_n(&lastReply, now_ns(), __ATOMIC_RELAXED);
+            } else if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+                epoll_ctl(drainEpfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+// **********************************************************************
+// Pull probe deliveries (name:topic:stamp lines) out of buf and record
+// their latency. Returns the bytes used.
+// **********************************************************************
+int parse_probes(char *buf, int len) {
+    int pos = 0;
+    char *end;
+    while ((end = memchr(buf + pos, '\n', len - pos)) != NULL) {
+        char *colon = memchr(buf + pos, ':', end - buf - pos);
+        if (colon != NULL) {
+            colon = memchr(colon + 1, ':', end - colon - 1);
+        }
+        if (colon != NULL && end - colon - 1 == STAMP_LEN) {
+            char stamp[STAMP_LEN + 1];
+            memcpy(stamp, colon + 1, STAMP_LEN);
+            stamp[STAMP_LEN] = '\0';
+            uint64_t sentAt = strtoull(stamp, NULL, 16), now = now_ns();
+            pshist_record(&probeHist, now > sentAt ? now - sentAt : 0);
+        }
+        pos = end - buf + 1;
+    }
+    return pos;
+}
+
+// **********************************************************************
+// Probe thread: publish a timestamp probeRate times a second and time
+// its delivery to our own subscriber. Waits for the subscription to be
+// in place (the server answers a ping after it) before starting.
+// **********************************************************************
+void *probe_thread(void *arg) {
+    int *fds = arg, sub = fds[0], pub = fds[1];
+    char buf[8192], cmd[128];
+    int len = 0;
+    uint64_t gap = 1000000000ULL / config.probeRate, next = now_ns();
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= next && !stopProbe) {
+            int cmdLen = sprintf(cmd, "pub rp%d %016llx\n", (int)getpid(),
+                    (unsigned long long)now);
+            send_all(pub, cmd, cmdLen);
+            next += gap;
+            continue;
+        }
+        struct pollfd pfd = {sub, POLLIN, 0};
+        int wait = stopProbe ? QUIET_MS : (int)((next - now) / 1000000);
+        if (poll(&pfd, 1, wait) == 0 && stopProbe) {
+            break;
+        }
+        if (pfd.revents == 0) {
+            continue;
+        }
+        ssize_t got = recv(sub, buf + len, sizeof(buf) - len, 0);
+        if (got <= 0) {
+            break;
+        }
+        len += got;
+        int used = parse_probes(buf, len);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+        if (len == sizeof(buf)) {
+            len = 0; // not a probe line
+        }
+    }
+    return NULL;
+}
+
+// **********************************************************************
+// Open the probe's subscriber and publisher. Returns 0 once the
+// subscription is in place.
+// **********************************************************************
+int open_probe(int *fds) {
+    char cmd[128], buf[256];
+    int len = 0;
+    fds[0] = connect_server();
+    fds[1] = connect_server();
+    if (fds[0] < 0 || fds[1] < 0) {
+        return -1;
+    }
+    int cmdLen = sprintf(cmd, "name rp%ds\nsub rp%d\nping\n", (int)getpid(),
+            (int)getpid());
+    send_all(fds[0], cmd, cmdLen);
+    cmdLen = sprintf(cmd, "name rp%dp\n", (int)getpid());
+    send_all(fds[1], cmd, cmdLen);
+    while (len < sizeof(buf) - 1) {
+        ssize_t got = recv(fds[0], buf + len, sizeof(buf) - 1 - len, 0);
+        if (got <= 0) {
+            return -1;
+        }
+        len += got;
+        buf[len] = '\0';
+        if (strstr(buf, ":pong\n") != NULL) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// **********************************************************************
+// Wait until the server has accepted every connection opened so far, by
+// opening one more and waiting for it to answer a ping. The listen queue
+// is first in, first out, so in --fast runs a new client cannot have its
+// first commands overtaken by an older client still waiting there.
+// **********************************************************************
+void wait_accepted(void) {
+    char buf[256];
+    int len = 0, fd = connect_server();
+    struct timeval tv = {1, 0};
+    if (fd < 0) {
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    send_all(fd, "ping\n", 5);
+    while (len < sizeof(buf) - 1) {
+        ssize_t got = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (got <= 0) {
+            break;
+        }
+        len += got;
+        buf[len] = '\0';
+        if (strstr(buf, ":pong\n") != NULL) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+// **********************************************************************
+// Load results saved by --save. Returns -1 if the file cannot be read.
+// **********************************************************************
+int load_result(char *path, ReplayResult *result) {
+    FILE *file = fopen(path, "r");
+    char key[64];
+    double value;
+    if (file == NULL) {
+        return -1;
+    }
+    memset(result, 0, sizeof(ReplayResult));
+    while (fscanf(file, "%63s %lf", key, &value) == 2) {
+        if (strcmp(key, "records_per_sec") == 0) {
+            result->recordsPerSec = value;
+        } else if (strcmp(key, "bytes_per_sec") == 0) {
+            result->bytesPerSec = value;
+        } else if (strcmp(key, "probe_p50_usec") == 0) {
+            result->probeP50 = value;
+        } else if (strcmp(key, "probe_p99_usec") == 0) {
+            result->probeP99 = value;
+        } else if (strcmp(key, "probe_p999_usec") == 0) {
+            result->probeP999 = value;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// **********************************************************************
+// Save results for a later --baseline. Returns -1 on failure.
+// **********************************************************************
+int save_result(char *path, ReplayResult *result) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "records_per_sec %.1f\nbytes_per_sec %.1f\n"
+            "probe_p50_usec %.1f\nprobe_p99_usec %.1f\n"
+            "probe_p999_usec %.1f\n", result->recordsPerSec,
+            result->bytesPerSec, result->probeP50, result->probeP99,
+            result->probeP999);
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+// **********************************************************************
+// Print one line of the baseline comparison. Returns 1 if the change is
+// a regression beyond the tolerance.
+// **********************************************************************
+int compare_line(char *label, double was, double now, int higherBetter) {
+    double change = was > 0 ? (now - was) * 100 / was : 0;
+    int worse = higherBetter ? change < -config.tolerance
+            : change > config.tolerance;
+    printf("%-16s %12.1f -> %12.1f  %+6.1f%%%s\n", label, was, now, change,
+            worse ? "  REGRESSION" : "");
+    return worse;
+}
+
+// **********************************************************************
+// Compare a run with the baseline. Returns 1 if anything regressed.
+// **********************************************************************
+int compare_result(ReplayResult *was, ReplayResult *now) {
+    int worse = 0;
+    printf("against baseline %s (tolerance %.1f%%)\n", config.baseline,
+            config.tolerance);
+    worse |= compare_line("records/s", was->recordsPerSec,
+            now->recordsPerSec, 1);
+    worse |= compare_line("bytes/s", was->bytesPerSec, now->bytesPerSec, 1);
+    compare_line("probe p50 usec", was->probeP50, now->probeP50, 0);
+    if (config.probeRate > 0) {
+        worse |= compare_line("probe p99 usec", was->probeP99,
+                now->probeP99, 0);
+    }
+    compare_line("probe p999 usec", was->probeP999, now->probeP999, 0);
+    return worse;
+}
+
+// **********************************************************************
+// Parse leading --option value pairs into config. Returns the number of
+// arguments used or -1 if an option is not known.
+// **********************************************************************
+int parse_options(int argc, char **argv) {
+    int used = 0;
+    while (used + 1 < argc && strncmp(argv[used + 1], "--", 2) == 0) {
+        char *opt = argv[used + 1];
+        if (strcmp(opt, "--fast") == 0) {
+            config.fast = 1;
+            used++;
+            continue;
+        }
+        if (used + 2 >= argc) {
+            return -1;
+        }
+        char *value = argv[used + 2];
+        if (strcmp(opt, "--speed") == 0) {
+            config.speed = atof(value);
+        } else if (strcmp(opt, "--probe") == 0) {
+            config.probeRate = atoi(value);
+        } else if (strcmp(opt, "--tolerance") == 0) {
+            config.tolerance = atof(value);
+        } else if (strcmp(opt, "--save") == 0) {
+            config.save = value;
+        } else if (strcmp(opt, "--baseline") == 0) {
+            config.baseline = value;
+        } else {
+            return -1;
+        }
+        used += 2;
+    }
+    return used;
+}
+
+// **********************************************************************
+// Count the connections, records and bytes in the trace
+// **********************************************************************
+void scan_trace(PsTraceReader *reader, unsigned long *records,
+        unsigned long *bytes, uint64_t *lengthUs) {
+    PsTraceRecord record;
+    *records = 0;
+    *bytes = 0;
+    *lengthUs = 0;
+    connCount = 0;
+    while (pstrace_next(reader, &record)) {
+        (*records)++;
+        *bytes += record.len;
+        *lengthUs = record.timeUs;
+        if (record.conn > connCount) {
+            connCount = record.conn;
+        }
+    }
+    pstrace_rewind(reader);
+}
+
+int main(int argc, char **argv) {
+    PsTraceReader reader;
+    int used = parse_options(argc, argv);
+    if (used < 0 || argc - used != 3 || atoi(argv[used + 2]) <= 0
+            || config.speed <= 0 || config.probeRate < 0
+            || config.tolerance < 0) {
+        fprintf(stderr, "Usage: psreplay [--fast] [--speed x] [--probe"
+                " msgs/s] [--save file] [--baseline file] [--tolerance"
+                " pct] tracefile portnum\n");
+        return 1;
+    }
+    config.path = argv[used + 1];
+    config.port = atoi(argv[used + 2]);
+    if (pstrace_read_open(&reader, config.path) != 0) {
+        fprintf(stderr, "psreplay: %s is not a psserver trace\n",
+                config.path);
+        return 1;
+    }
+    unsigned long records, bytes;
+    uint64_t lengthUs;
+    scan_trace(&reader, &records, &bytes, &lengthUs);
+    connFds = malloc(sizeof(int) * (connCount + 1));
+    for (uint32_t i = 0; i <= connCount; i++) {
+        connFds[i] = -1;
+    }
+
+    pthread_t drainTid, probeTid;
+    int probeFds[2];
+    drainEpfd = epoll_create1(0);
+    pthread_create(&drainTid, NULL, drain_thread, NULL);
+    pshist_init(&probeHist);
+    if (config.probeRate > 0) {
+        if (open_probe(probeFds) != 0) {
+            fprintf(stderr, "psreplay: unable to set up the probe on port"
+                    " %d\n", config.port);
+            return 1;
+        }
+        pthread_create(&probeTid, NULL, probe_thread, probeFds);
+    }
+
+    // replay every record in trace order
+    PsTraceRecord record;
+    unsigned long refused = 0, failed = 0;
+    uint64_t start = now_ns(), maxLag = 0;
+    int opened = 0;
+    while (pstrace_next(&reader, &record)) {
+        int *fd = &connFds[record.conn];
+        if (config.fast && opened && record.type != PSTRACE_OPEN) {
+            wait_accepted();
+            opened = 0;
+        }
+        if (!config.fast) {
+            uint64_t due = start + (uint64_t)(record.timeUs * 1000
+                    / config.speed), now = now_ns();
+            if (now < due) {
+                sleep_until(due);
+            } else if (now - due > maxLag) {
+                maxLag = now - due;
+            }
+        }
+        if (record.type == PSTRACE_OPEN) {
+            *fd = connect_server();
+            if (*fd < 0) {
+                refused++;
+                continue;
+            }
+            struct epoll_event ev = {EPOLLIN, {.fd = *fd}};
+            epoll_ctl(drainEpfd, EPOLL_CTL_ADD, *fd, &ev);
+            opened = 1;
+        } else if (*fd >= 0 && record.type == PSTRACE_DATA) {
+            if (send_all(*fd, record.data, record.len) != 0) {
+                failed++;
+                close(*fd);
+                *fd = -1;
+            }
+        } else if (*fd >= 0 && !config.fast) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+    uint64_t sent = now_ns();
+    __atomic_store_n(&lastReply, sent, __ATOMIC_RELAXED);
+    while (now_ns() - __atomic_load_n(&lastReply, __ATOMIC_RELAXED)
+            < QUIET_MS * 1000000ULL
+            && now_ns() - sent < QUIET_LIMIT_MS * 1000000ULL) {
+        usleep(10000);
+    }
+    stopProbe = 1;
+    if (config.probeRate > 0) {
+        pthread_join(probeTid, NULL);
+    }
+    for (uint32_t i = 0; i <= connCount; i++) {
+        if (connFds[i] >= 0) {
+            close(connFds[i]);
+        }
+    }
+
+    double sendSecs = (sent - start) / 1e9;
+    double replySecs = (__atomic_load_n(&lastReply, __ATOMIC_RELAXED)
+            - start) / 1e9;
+    double runSecs = replySecs > sendSecs ? replySecs : sendSecs;
+    ReplayResult result;
+    result.recordsPerSec = runSecs > 0 ? records / runSecs : 0;
+    result.bytesPerSec = runSecs > 0 ? bytes / runSecs : 0;
+    result.probeP50 = pshist_percentile(&probeHist, 50) / 1e3;
+    result.probeP99 = pshist_percentile(&probeHist, 99) / 1e3;
+    result.probeP999 = pshist_percentile(&probeHist, 99.9) / 1e3;
+    printf("trace         %u connections, %lu records, %lu bytes over"
+            " %.2fs\n", connCount, records, bytes, lengthUs / 1e6);
+    if (config.fast) {
+        printf("replayed      as fast as possible in %.2fs\n", sendSecs);
+    } else {
+        printf("replayed      at %.2fx pace in %.2fs, at most %.1fms"
+                " behind\n", config.speed, sendSecs, maxLag / 1e6);
+    }
+    printf("replies       %lu bytes, the last %.2fs in\n", bytesIn,
+            replySecs);
+    printf("throughput    %.0f records/s, %.2f MB/s over %.2fs\n",
+            result.recordsPerSec, result.bytesPerSec / 1e6, runSecs);
+    if (refused > 0 || failed > 0) {
+        printf("errors        %lu connections refused, %lu cut off\n",
+                refused, failed);
+    }
+    printf("probe usec    p50 %.1f  p99 %.1f  p999 %.1f  max %.1f"
+            "  mean %.1f  (%lu msgs)\n", result.probeP50, result.probeP99,
+            result.probeP999, probeHist.max / 1e3,
+            pshist_mean(&probeHist) / 1e3, (unsigned long)probeHist.total);
+    pstrace_read_close(&reader);
+
+    if (config.save != NULL && save_result(config.save, &result) != 0) {
+        fprintf(stderr, "psreplay: unable to save results to %s\n",
+                config.save);
+        return 1;
+    }
+    if (config.baseline != NULL) {
+        ReplayResult was;
+        if (load_result(config.baseline, &was) != 0) {
+            fprintf(stderr, "psreplay: unable to read baseline %s\n",
+                    config.baseline);
+            return 1;
+        }
+        return compare_result(&was, &result) ? 2 : 0;
+    }
+    return 0;
+}
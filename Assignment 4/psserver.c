@@ -7,69 +7,661 @@
 #include <string.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #include "stringmap.h"
+#include "pslog.h"
+#include "psio.h"
+#include "psproto.h"
+#include "psshm.h"
+#include "psstats.h"
+#include "psepoch.h"
+#include "pswheel.h"
+#include "pstrace.h"
+#include "psrate.h"
 
+// names and topics must be shorter than this
+#define MAX_NAME_LEN 30
+// most messages one pubbatch command may carry
+#define MAX_BATCH 10000
+// longest token get_token() and command type find_msg_type() copy out
+// (callers' buffers hold 1024 and 128 bytes)
+#define MAX_TOKEN_LEN 1023
+#define MAX_TYPE_LEN 127
+// topic the server publishes its own metrics on. Topics and names
+// starting with '$' are reserved: clients may subscribe to them but not
+// publish to them or use them as names.
+#define SYS_TOPIC "$SYS"
+#define SYS_SENDER "psserver"
+// milliseconds between attempts to (re)connect to a configured peer
+#define PEER_RETRY_MS 1000
+// PeerConfig fd of a peer that needs no link of our own
+#define PEER_COVERED -2
+// milliseconds per tick of the timer wheel
+#define WHEEL_TICK_MS 100
+// memory charged to a client for each subscription: its entries in the
+// topic's list and its own, and the topic in case it made it
+#define SUB_BYTES ((long) (sizeof(Topic) + 2 * sizeof(void*)))
+// largest input buffer a connection keeps once it is empty again
+#define KEEP_INPUT_CAP 65536
+// longest a recorded command waits to be written to the trace file
+#define TRACE_FLUSH_MS 100
+// topics each connection remembers it published to (power of two)
+#define TOPIC_CACHE_SIZE 16
+// topics one connection may add by asking for their ids
+#define TOPICID_ADD_MAX 1024
 
+
+// Newest message on one topic not yet sent to a sublatest subscriber
+// that has fallen behind, already formatted for its protocol
+typedef struct LatestSlot {
+    struct Topic *topic;
+    char *data;
+    int len;
+} LatestSlot;
+
+// A named client. Topic subscriber lists point straight at it, so a
+// delivery needs no name lookup. It is freed only once it is off every
+// list and no publisher can still be reading one that held it.
 typedef struct ClientData {
     // sockfd is key
     int sockfd;
+    int binary;     // client negotiated the binary protocol
+    int peer;       // a link to another server rather than a client
+    int dialed;     // for a link: this server made the connection
+    char name[MAX_NAME_LEN];    // client name, or the peer's server id
     StringMap *msgRoot;
+    struct Topic **topics;  // topics subscribed to, for cleanup
+    int topicCount;
+    int topicCap;
+    // sublatest messages held back while the client is behind; at most
+    // one per topic, each replaced by anything newer
+    pthread_mutex_t latestLock;
+    LatestSlot *latest;
+    int latestCount;
+    int latestCap;
+    int flushing;   // flush_latest() is sending what was held
+    // held while sending to the client; closed is set (under both locks)
+    // once it has gone, after which its sockfd may be a new connection
+    pthread_mutex_t sendLock;
+    int closed;
 } ClientData;
 
+// Subscribers of a topic at one moment. Never changed once published:
+// sub and unsub build a new list and swap it in.
+typedef struct SubList {
+    int count;
+    ClientData *clients[];
+} SubList;
+
+// A topic and the clients subscribed to it. Topics are never removed,
+// so a Topic found in topicRoot stays valid once topicLock is released.
+// Publishers read subs with no lock inside a psepoch read section; the
+// list they were using is freed once they have all finished with it.
+typedef struct Topic {
+    pthread_mutex_t lock;   // serialises changes to subs and latest
+    SubList *subs;          // current subscribers, NULL if none
+    SubList *latest;        // subscribers that want only the newest
+                            // message if they fall behind
+    int localCount;         // subscribers that are clients, not links
+    uint64_t rateBucket;    // PSSERVER_TOPIC_RATE token bucket
+    uint32_t id;            // index in topicTable
+    int nameLen;
+    char name[MAX_NAME_LEN];
+} Topic;
+
 typedef struct MsgData {
     char *topic;
     char *msgSentBy;
     char *msg;
 } MsgData;
 
-typedef struct StatsData {
-    int connCli;
-    int disconnCli;
-    int pubCount;
-    int subCount;
-    int unsubCount;
-} StatsData;
+// Protocol a connection speaks. Decided by its first byte.
+typedef enum ConnMode {
+    MODE_UNKNOWN,
+    MODE_TEXT,
+    MODE_BINARY
+} ConnMode;
+
+// One accepted connection. pending holds the start of a command or frame
+// that has not fully arrived yet. discard counts bytes of an oversized
+// frame still to be thrown away.
+typedef struct Connection {
+    int sockfd;
+    ConnMode mode;
+    char *pending;
+    int pendingLen;
+    int pendingCap;
+    long discard;
+    struct PubBatch *batch;     // pubbatch being collected, if any
+    int batchLeft;              // lines of it still to come
+    ClientData *client;         // set once the client has a name
+    int dialed;                 // this server connected to a peer here
+    PsTimer idleTimer;          // next ping or idle check
+    uint64_t lastActive;        // now_ms() when bytes last arrived
+    uint64_t pingedAt;          // now_ms() of the last ping sent
+    long inputCharged;          // pending bytes charged to the connection
+    uint32_t traceId;           // connection number in the trace, 0 = none
+    uint64_t rateBucket;        // PSSERVER_CLIENT_RATE token bucket
+    // topics published to lately, by a hash of the name
+    struct Topic *topicCache[TOPIC_CACHE_SIZE];
+    int topicsAdded;            // topics added by its TOPICID frames
+} Connection;
+
+// Deliveries for one subscriber gathered while a batch is processed
+typedef struct BatchOut {
+    ClientData *client;
+    char *data;
+    int len;
+    int cap;
+} BatchOut;
+
+// A batch of publishes from one client. Each message is looked up and
+// formatted once, appended to its subscribers' buffers, and every
+// subscriber then gets all of its messages in a single send. The
+// subscribers are held by their ClientData, so from the first publish
+// until the send the batch stays in a psepoch read section: none of them
+// can be freed before the send, and one that closes meanwhile is
+// skipped rather than sent to on a reused fd.
+typedef struct PubBatch {
+    char sender[MAX_NAME_LEN];
+    int named;
+    BatchOut *outs;
+    int count;
+    int cap;
+    int *index;     // open addressing table of client -> outs slot + 1
+    int indexSize;
+    int sockfd;     // sender, which is charged for the buffers
+    long bytes;
+    int reading;    // inside the read section holding the clients
+} PubBatch;
+
+// Optional settings, read from PSSERVER_* environment variables so the
+// command line stays "psserver connections [portnum]".
+//   PSSERVER_LOG_DIR         - directory for the publish log (off if unset)
+//   PSSERVER_LOG_SEGMENT     - bytes per log segment file
+//   PSSERVER_LOG_FSYNC_BATCH - records written between fsyncs, 0 = never
+//   PSSERVER_LOG_FSYNC_MS    - longest time a record stays unsynced
+//   PSSERVER_LOG_WAIT        - 1 = deliver a pub only once it is durable
+//                              (thread backend only)
+//   PSSERVER_BACKEND         - thread (default), epoll or uring
+//   PSSERVER_UNIX_PATH       - also listen on this Unix domain socket
+//   PSSERVER_SHM_RING        - bytes in each shared memory ring
+//   PSSERVER_SYS_MS          - milliseconds between $SYS metrics, 0 = off
+//   PSSERVER_BIND            - address to listen on, default 127.0.0.1
+//   PSSERVER_PEERS           - host:port,... of other servers to link to
+//   PSSERVER_IDLE_MS         - close a connection silent this long, 0 = off
+//   PSSERVER_PING_MS         - ping a connection silent this long, 0 = off
+//   PSSERVER_CLIENT_BYTES    - most memory one client may hold, 0 = no limit
+//   PSSERVER_MAX_BYTES       - most memory all clients may hold, 0 = no limit
+//   PSSERVER_SEND_POLICY     - latency (default) or throughput
+//   PSSERVER_CORK_BYTES      - throughput mode: bytes that end a cork
+//   PSSERVER_CORK_US         - throughput mode: longest a send is corked
+//   PSSERVER_TRACE           - record all client traffic to this file
+//   PSSERVER_CLIENT_RATE     - pubs a second one client may make, 0 = any
+//   PSSERVER_CLIENT_BURST    - pubs a client may make at once over its rate
+//   PSSERVER_TOPIC_RATE      - pubs a second one topic may take, 0 = any
+//   PSSERVER_TOPIC_BURST     - pubs a topic may take at once over its rate
+//   PSSERVER_RATE_ACTION     - throttle (default) or reject
+// The connections argument caps how many connections are open at once
+// (0 = no limit). A client holds its queued output, held sublatest
+// messages, unfinished input, pubbatch buffers and subscriptions. A
+// client can change its own send policy with "policy latency" or
+// "policy throughput". A client over a rate limit is throttled by no
+// longer reading from it until it is back under, or with reject has its
+// pubs answered with an invalid response. Bursts default to a tenth of
+// a second's worth.
+typedef struct ServerConfig {
+    PsIoBackend backend;
+    PsIoSendPolicy sendPolicy;
+    char *bindAddr;
+    char *peers;
+    char *unixPath;
+    long shmRingSize;
+    int sysIntervalMs;
+    int idleMs;
+    int pingMs;
+    long clientBytes;
+    long maxBytes;
+    char *tracePath;
+    PsRate clientRate;
+    PsRate topicRate;
+    int rateReject;
+    char *logDir;
+    long logSegmentSize;
+    int logFsyncBatch;
+    int logFsyncMs;
+    int logWait;
+} ServerConfig;
+
+// A server named in PSSERVER_PEERS. fd is the link this server dialled
+// to it, -1 while there is none, or PEER_COVERED if it needs none: the
+// peer dialled us and that link was kept, or the peer is this server.
+typedef struct PeerConfig {
+    char *spec;
+    struct sockaddr_in addr;
+    int fd;
+} PeerConfig;
+
+// Shared memory ring a local client takes its deliveries from. Kept per
+// socket slot and reused, so a publisher thread holding a pointer to it
+// never sees it freed.
+typedef struct ShmClient {
+    PsShmRing ring;
+    int active;
+    pthread_mutex_t lock;   // publishers on several threads may deliver
+    char *overflow;         // bytes waiting for room in the ring
+    int overLen;
+    int overCap;
+} ShmClient;
 
 // clientRoot - variable to store all clients and related data associated
 // to client.
 // topicRoot - variable to store all topics and related data associated
 // to topics.
 StringMap *clientRoot, *topicRoot;
-// store statistics of transactions. 
-StatsData *statsData;
+// Locking: topicLock guards the topicRoot map itself and is only held
+// to look a topic up or add one, so work on one topic never waits for
+// work on another. Each Topic's own lock serialises sub and unsub;
+// publishers take no topic lock at all. clientLock guards clientRoot.
+pthread_rwlock_t topicLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t clientLock = PTHREAD_RWLOCK_INITIALIZER;
+// Topics by id. Each topic is given the next id when it is added, and
+// as topics are never removed an id stays good for as long as the
+// server runs. The table only grows, with topicLock held for writing;
+// it is indexed without a lock inside a psepoch read section and a
+// table outgrown is freed once nobody can still be reading it.
+Topic **topicTable;
+uint32_t topicTableCap;
+uint32_t topicIdCount;
+ServerConfig config;
+// publish log, NULL unless persistence is enabled
+PsLog *pubLog;
+// traffic capture for psreplay, NULL unless PSSERVER_TRACE is set
+PsTrace *trace;
+// when the server started, by psstats_now()
+uint64_t startTime;
+// shared memory rings by client socket, NULL for socket delivery
+ShmClient **shmClients;
+int shmClientsSize;
+// named clients by socket, so the I/O layer's drained() callback can
+// find one. Same size as shmClients.
+ClientData **fdClients;
+// Federation. Servers linked together act as one broker: each tells
+// the others which topics it has local subscribers for, and forwards a
+// local publish once over every link that asked for its topic. Anything
+// that arrives over a link goes to local subscribers only, so the
+// servers must form a full mesh. linkLock guards peers and links and is
+// taken after a topic's lock, never before.
+PeerConfig *peers;
+int peerCount;
+ClientData **links;     // links that are up, whichever end dialled
+int linkCount;
+int linkCap;
+pthread_mutex_t linkLock = PTHREAD_MUTEX_INITIALIZER;
+char serverId[MAX_NAME_LEN];
+// socket dial_peers() is handing to the I/O layer on this thread
+static __thread int dialingFd = -1;
+// Timers. Idle and heartbeat timers for every connection, $SYS and peer
+// retries all live on one wheel advanced by the I/O layer's tick, so the
+// tick costs the same with 10 connections or 100K. wheelLock guards it;
+// timer functions run with it held and must not block. A connection's
+// timer is only touched when it fires: receiving just stamps lastActive
+// and the timer moves itself on if it finds the connection was busy.
+PsWheel wheel;
+pthread_mutex_t wheelLock = PTHREAD_MUTEX_INITIALIZER;
+int idleTimers;         // PSSERVER_IDLE_MS or PSSERVER_PING_MS is set
+PsTimer sysTimer, peerTimer;
+// set by the periodic timers, run by server_tick() once the wheel is
+// unlocked
+int sysDue, peersDue;
 
-void show_stats(int signal);
-void *handle_connection(void *socketPtr);
-void form_and_send_msg(int sockfd, char *sentBy, char *topic, char *msg);
-void handle_command(int sockfd, char *buffer);
+void show_stats(void);
+void *open_connection(int sockfd);
+void handle_connection(void *conn, char *data, int length);
+void close_connection(void *conn);
+void form_and_send_msg(int sockfd, int binary, char *sentBy, int sentByLen,
+        char *topic, int topicLen, char *msg, int msgLen);
+void handle_command(Connection *conn, char *buffer);
+void handle_frame(Connection *conn, PsFrame *frame, char *body);
 int init_socket(int port);
+int init_unix_socket(char *path);
 void print_topic_tree();
 void print_client_tree();
 void print_names_only();
-void process_name(int sockfd, char *command);
-void process_sub(int sockfd, char *command);
-void process_unsub(int sockfd, char *command);
-void process_pub(int sockfd, char *command);
+void process_name(Connection *conn, char *command);
+void process_sub(Connection *conn, char *command, int latest);
+void process_unsub(Connection *conn, char *command);
+void process_pub(Connection *conn, char *command);
+void process_replay(Connection *conn, char *command);
+void do_name(Connection *conn, char *name);
+void do_sub(Connection *conn, char *topic, int latest);
+void do_unsub(Connection *conn, char *topic);
+void do_pub(Connection *conn, struct Topic *pubTopic, char *topic,
+        char *msg, int msgLen);
+void publish_msg(char *sentBy, char *topic, char *msg, int msgLen,
+        int localOnly);
+void publish_topic(struct Topic *pubTopic, char *sentBy, char *msg,
+        int msgLen, int localOnly);
+void process_pubbatch(Connection *conn, char *command);
+void dispatch_line(Connection *conn, char *line);
+int frame_name(char *field, int len, char *out);
+int send_frame(int sockfd, int opcode, char *name, int nameLen,
+        char *topic, int topicLen, char *payload, int payloadLen);
+int deliver(int sockfd, char *data, int len);
+int deliverv(int sockfd, struct iovec *iov, int count);
+void send_invalid(Connection *conn);
+void process_shmring(Connection *conn);
+void process_shmack(Connection *conn);
+void process_policy(Connection *conn, char *command);
+void publish_latest(Topic *pubTopic, char *sentBy, int cliLen,
+        char *topic, int topicLen, char *msg, int msgLen);
+void flush_latest(int fd);
+void drop_latest(ClientData *client, Topic *topic);
+int lock_client(ClientData *client);
+void batch_append(struct BatchOut *out, int binary, char *sentBy,
+        int sentByLen, char *topic, int topicLen, char *msg, int msgLen);
+void batch_send(PubBatch *batch);
+void peer_link(Connection *conn, char *id);
+void handle_peer_frame(Connection *conn, PsFrame *frame, char *body);
+
+// **********************************************************************
+// Print one latency histogram (recorded in nanoseconds) in microseconds
+// **********************************************************************
+void show_latency(char *label, PsHist *hist) {
+    fprintf(stderr, "%s usec:p50 %.1f p99 %.1f p999 %.1f max %.1f"
+            " mean %.1f count %lu\n", label,
+            pshist_percentile(hist, 50) / 1e3,
+            pshist_percentile(hist, 99) / 1e3,
+            pshist_percentile(hist, 99.9) / 1e3, hist->max / 1e3,
+            pshist_mean(hist) / 1e3, (unsigned long) hist->total);
+}
 
 //**********************************************************
-// Prints stats when SIGHUP is initiated. It takes data 
-// that is stored in global structure that is keeping 
-// track of transactions. It is printed
+// Prints stats when SIGHUP is received. Counters and
+// histograms are added up over every thread that has kept
+// them, then printed
 //**********************************************************
-void show_stats(int signal) {
-    fprintf(stderr, "Connected clients:%d\n"
-            , statsData->connCli - statsData->disconnCli);
-    fprintf(stderr, "Completed clients:%d\n",statsData->disconnCli);
-    fprintf(stderr, "pub operations:%d\n",statsData->pubCount);
-    fprintf(stderr, "sub operations:%d\n",statsData->subCount);
-    fprintf(stderr, "unsub operations:%d\n",statsData->unsubCount);
+void show_stats(void) {
+    static PsStatsTotals totals;
+    psstats_snapshot(&totals);
+    uint64_t *counters = totals.counters;
+    fprintf(stderr, "Connected clients:%lu\n", (unsigned long)
+            (counters[PS_STAT_CONNECTED] - counters[PS_STAT_DISCONNECTED]));
+    fprintf(stderr, "Completed clients:%lu\n",
+            (unsigned long) counters[PS_STAT_DISCONNECTED]);
+    fprintf(stderr, "pub operations:%lu\n",
+            (unsigned long) counters[PS_STAT_PUB]);
+    fprintf(stderr, "sub operations:%lu\n",
+            (unsigned long) counters[PS_STAT_SUB]);
+    fprintf(stderr, "unsub operations:%lu\n",
+            (unsigned long) counters[PS_STAT_UNSUB]);
+    fprintf(stderr, "conflated messages:%lu\n",
+            (unsigned long) counters[PS_STAT_CONFLATED]);
+    fprintf(stderr, "idle timeouts:%lu\n",
+            (unsigned long) counters[PS_STAT_TIMEDOUT]);
+    fprintf(stderr, "pubs throttled:%lu\n",
+            (unsigned long) counters[PS_STAT_THROTTLED]);
+    fprintf(stderr, "pubs rejected:%lu\n",
+            (unsigned long) counters[PS_STAT_REJECTED]);
+
+    PsIoStats ioStats;
+    struct rusage usage;
+    psio_get_stats(&ioStats);
+    fprintf(stderr, "memory held:%lu\n", ioStats.queued + ioStats.charged);
+    fprintf(stderr, "queued bytes:%lu\n", ioStats.queued);
+    fprintf(stderr, "connections refused:%lu\n", ioStats.refused);
+    fprintf(stderr, "clients dropped over memory limit:%lu\n",
+            ioStats.dropped);
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    unsigned long sends = ioStats.sends ? ioStats.sends : 1;
+    fprintf(stderr, "io backend:%s\n", psio_backend_name(psio_backend()));
+    fprintf(stderr, "io syscalls:%lu\n", ioStats.syscalls);
+    fprintf(stderr, "corked sends:%lu\n", ioStats.corked);
+    fprintf(stderr, "reads paused:%lu\n", ioStats.paused);
+    fprintf(stderr, "messages sent:%lu\n", ioStats.sends);
+    fprintf(stderr, "syscalls per message:%.3f\n",
+            (double)ioStats.syscalls / sends);
+    fprintf(stderr, "cpu usec per message:%.3f\n", cpu * 1e6 / sends);
+    show_latency("command latency", &totals.commandLatency);
+    show_latency("delivery latency", &totals.deliveryLatency);
     fflush(stderr);
 }
 
+// **********************************************************************
+// Called by the I/O layer every PSSERVER_SYS_MS. Publishes a line of
+// metrics on the $SYS topic: current sizes, and rates per second since
+// the last one. Totals are read from the per-thread stats, so nothing
+// on the command path is locked to collect them.
+// **********************************************************************
+void publish_sys(void) {
+    static PsStatsTotals now, last;
+    static PsIoStats lastIo;
+    static uint64_t lastTime;
+    PsIoStats io;
+    char msg[512];
+    psstats_snapshot(&now);
+    psio_get_stats(&io);
+    uint64_t time = psstats_now();
+    double secs = (time - (lastTime ? lastTime : startTime)) / 1e9;
+    uint64_t *c = now.counters, *l = last.counters;
+    snprintf(msg, sizeof(msg), "uptime=%.0f clients=%lu names=%lu"
+            " topics=%lu subscriptions=%lu pub_rate=%.1f sub_rate=%.1f"
+            " unsub_rate=%.1f delivery_rate=%.1f queued_bytes=%lu"
+            " memory_bytes=%lu bytes_in=%lu bytes_out=%lu bytes_in_rate=%.1f"
+            " bytes_out_rate=%.1f command_p99_usec=%.1f"
+            " delivery_p99_usec=%.1f", (time - startTime) / 1e9,
+            (unsigned long) (c[PS_STAT_CONNECTED] - c[PS_STAT_DISCONNECTED]),
+            (unsigned long) c[PS_STAT_NAMES],
+            (unsigned long) c[PS_STAT_TOPICS],
+            (unsigned long) c[PS_STAT_SUBSCRIPTIONS],
+            (c[PS_STAT_PUB] - l[PS_STAT_PUB]) / secs,
+            (c[PS_STAT_SUB] - l[PS_STAT_SUB]) / secs,
+            (c[PS_STAT_UNSUB] - l[PS_STAT_UNSUB]) / secs,
+            (now.deliveryLatency.total - last.deliveryLatency.total) / secs,
+            io.queued, io.queued + io.charged, io.bytesIn, io.bytesOut,
+            (io.bytesIn - lastIo.bytesIn) / secs,
+            (io.bytesOut - lastIo.bytesOut) / secs,
+            pshist_percentile(&now.commandLatency, 99) / 1e3,
+            pshist_percentile(&now.deliveryLatency, 99) / 1e3);
+    memcpy(&last, &now, sizeof(PsStatsTotals));
+    lastIo = io;
+    lastTime = time;
+    psstats_command_begin();
+    publish_msg(SYS_SENDER, SYS_TOPIC, msg, strlen(msg), 0);
+}
+
+// **********************************************************************
+// Connect to every configured peer that has no link yet. The connect
+// does not block: a peer that is down fails later through the normal
+// close path and is tried again on a later tick.
+// **********************************************************************
+void dial_peers(void) {
+    pthread_mutex_lock(&linkLock);
+    for (int i = 0; i < peerCount; i++) {
+        if (peers[i].fd != -1) {
+            continue;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, (struct sockaddr *)&peers[i].addr,
+                sizeof(peers[i].addr)) != 0 && errno != EINPROGRESS) {
+            close(fd);
+            continue;
+        }
+        peers[i].fd = fd;
+        dialingFd = fd;
+        int err = psio_connect(fd);
+        dialingFd = -1;
+        if (err != 0) {
+            peers[i].fd = -1;
+            continue;
+        }
+        psio_send(fd, (char*) PSPROTO_HELLO, PSPROTO_HELLO_LEN);
+        send_frame(fd, PS_OP_PEER, serverId, strlen(serverId), "", 0,
+                "", 0);
+    }
+    pthread_mutex_unlock(&linkLock);
+}
+
+// **********************************************************************
+// Milliseconds on the monotonic clock
+// **********************************************************************
+uint64_t now_ms(void) {
+    return psstats_now() / 1000000;
+}
+
+// **********************************************************************
+// First wheel tick at or after a time in milliseconds
+// **********************************************************************
+uint64_t wheel_tick(uint64_t ms) {
+    return (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+}
+
+// **********************************************************************
+// Set a connection's timer for the next thing due on it: a ping once it
+// has been silent PSSERVER_PING_MS (and again each PSSERVER_PING_MS it
+// stays silent), or closing it once silent PSSERVER_IDLE_MS. Called with
+// wheelLock held.
+// **********************************************************************
+void schedule_idle(Connection *conn) {
+    uint64_t last = __atomic_load_n(&conn->lastActive, __ATOMIC_RELAXED);
+    uint64_t due = UINT64_MAX;
+    if (config.idleMs > 0) {
+        due = last + config.idleMs;
+    }
+    if (config.pingMs > 0) {
+        uint64_t from = conn->pingedAt > last ? conn->pingedAt : last;
+        if (from + config.pingMs < due) {
+            due = from + config.pingMs;
+        }
+    }
+    pswheel_add(&wheel, &conn->idleTimer, wheel_tick(due));
+}
+
+// **********************************************************************
+// Ask a connection to show it is alive. Sent only if it can go straight
+// out: a client whose socket is full is not silent, just slow.
+// **********************************************************************
+void send_ping(Connection *conn) {
+    unsigned char frame[PSPROTO_HEADER_LEN];
+    char *data = ":ping\n";
+    int len = strlen(data);
+    if (conn->mode == MODE_BINARY) {
+        psproto_encode(frame, PS_OP_PING, 0, 0, 0);
+        data = (char*) frame;
+        len = PSPROTO_HEADER_LEN;
+    }
+    if (conn->sockfd < shmClientsSize && __atomic_load_n(
+            &shmClients[conn->sockfd], __ATOMIC_ACQUIRE) != NULL) {
+        deliver(conn->sockfd, data, len);
+    } else {
+        psio_try_send(conn->sockfd, data, len);
+    }
+}
+
+// **********************************************************************
+// A connection's timer is due. If bytes arrived since it was set it just
+// moves on; otherwise the connection is pinged or, once it has been
+// silent PSSERVER_IDLE_MS, shut down so the I/O layer closes it the
+// usual way. Runs on the tick with wheelLock held.
+// **********************************************************************
+void idle_expired(PsTimer *timer) {
+    Connection *conn = timer->arg;
+    uint64_t now = now_ms();
+    uint64_t last = __atomic_load_n(&conn->lastActive, __ATOMIC_RELAXED);
+    if (config.idleMs > 0 && now - last >= config.idleMs) {
+        shutdown(conn->sockfd, SHUT_RDWR);
+        psstats_count(PS_STAT_TIMEDOUT, 1);
+        return;
+    }
+    uint64_t from = conn->pingedAt > last ? conn->pingedAt : last;
+    if (config.pingMs > 0 && conn->mode != MODE_UNKNOWN
+            && now - from >= config.pingMs) {
+        send_ping(conn);
+        conn->pingedAt = now;
+    }
+    schedule_idle(conn);
+}
+
+// **********************************************************************
+// Periodic timers: note the job is due and set the timer again
+// **********************************************************************
+void sys_expired(PsTimer *timer) {
+    sysDue = 1;
+    pswheel_add(&wheel, timer,
+            timer->expires + wheel_tick(config.sysIntervalMs));
+}
+
+void peers_expired(PsTimer *timer) {
+    peersDue = 1;
+    pswheel_add(&wheel, timer, timer->expires + wheel_tick(PEER_RETRY_MS));
+}
+
+// **********************************************************************
+// Start the timer wheel and the periodic timers
+// **********************************************************************
+void init_timers() {
+    uint64_t now = now_ms() / WHEEL_TICK_MS;
+    pswheel_init(&wheel, now);
+    idleTimers = config.idleMs > 0 || config.pingMs > 0;
+    if (config.sysIntervalMs > 0) {
+        pswheel_timer_init(&sysTimer, sys_expired, NULL);
+        pswheel_add(&wheel, &sysTimer,
+                now + wheel_tick(config.sysIntervalMs));
+    }
+    if (peerCount > 0) {
+        pswheel_timer_init(&peerTimer, peers_expired, NULL);
+        pswheel_add(&wheel, &peerTimer, now + 1);
+    }
+}
+
+// **********************************************************************
+// Called by the I/O layer every WHEEL_TICK_MS: fires the timers that are
+// due, publishes $SYS and retries peers if their time has come, then
+// frees whatever retired subscriber lists and clients are out of use
+// **********************************************************************
+void server_tick(void) {
+    pthread_mutex_lock(&wheelLock);
+    pswheel_advance(&wheel, now_ms() / WHEEL_TICK_MS);
+    pthread_mutex_unlock(&wheelLock);
+    if (sysDue) {
+        sysDue = 0;
+        publish_sys();
+    }
+    if (peersDue) {
+        peersDue = 0;
+        dial_peers();
+    }
+    psepoch_reclaim();
+}
+
+// **********************************************************************
+// Thread that waits for SIGHUP and prints the stats. SIGHUP is blocked
+// in every other thread, so the report is printed from an ordinary
+// thread rather than from inside a signal handler.
+// **********************************************************************
+void *stats_thread(void *arg) {
+    sigset_t *hup = arg;
+    int sig;
+    while (1) {
+        if (sigwait(hup, &sig) == 0) {
+            show_stats();
+        }
+    }
+    return NULL;
+}
+
 // **********************************************************************
 // Validate names and other parameters recieved as part of commands
 // **********************************************************************
@@ -95,6 +687,13 @@ int valid_name(char *str) {
     return 0;
 }
 
+// **********************************************************************
+// Return 1 if a topic or name is reserved for the server's own use
+// **********************************************************************
+int reserved_name(char *str) {
+    return str[0] == '$';
+}
+
 // **********************************************************************
 // Validate if a string contains only digits
 // **********************************************************************
@@ -146,6 +745,144 @@ int check_parms(int argc, char **argv) {
     return 0;
 }
 
+// **********************************************************************
+// Read a numeric setting from the environment, or use defVal if it is
+// not set or not a number
+// **********************************************************************
+long env_long(char *name, long defVal) {
+    char *value = getenv(name);
+    if (value == NULL || strlen(value) == 0 || is_numeric(value)) {
+        return defVal;
+    }
+    return atol(value);
+}
+
+// **********************************************************************
+// Load optional settings from the environment
+// **********************************************************************
+void load_config() {
+    config.logDir = getenv("PSSERVER_LOG_DIR");
+    config.logSegmentSize = env_long("PSSERVER_LOG_SEGMENT",
+            64 * 1024 * 1024);
+    config.logFsyncBatch = env_long("PSSERVER_LOG_FSYNC_BATCH", 256);
+    config.logFsyncMs = env_long("PSSERVER_LOG_FSYNC_MS", 10);
+    config.logWait = env_long("PSSERVER_LOG_WAIT", 0);
+    config.unixPath = getenv("PSSERVER_UNIX_PATH");
+    config.shmRingSize = env_long("PSSERVER_SHM_RING", PSSHM_DEFAULT_SIZE);
+    config.sysIntervalMs = env_long("PSSERVER_SYS_MS", 10000);
+    config.idleMs = env_long("PSSERVER_IDLE_MS", 0);
+    config.pingMs = env_long("PSSERVER_PING_MS", 0);
+    config.clientBytes = env_long("PSSERVER_CLIENT_BYTES", 64 * 1024 * 1024);
+    config.maxBytes = env_long("PSSERVER_MAX_BYTES", 0);
+    config.bindAddr = getenv("PSSERVER_BIND");
+    if (config.bindAddr == NULL || strlen(config.bindAddr) == 0) {
+        config.bindAddr = "127.0.0.1";
+    }
+    config.peers = getenv("PSSERVER_PEERS");
+    config.tracePath = getenv("PSSERVER_TRACE");
+    char *backend = getenv("PSSERVER_BACKEND");
+    config.backend = PSIO_THREAD;
+    if (backend != NULL && psio_parse_backend(backend) >= 0) {
+        config.backend = psio_parse_backend(backend);
+    }
+    char *policy = getenv("PSSERVER_SEND_POLICY");
+    config.sendPolicy.policy = PSIO_LATENCY;
+    if (policy != NULL && psio_parse_policy(policy) >= 0) {
+        config.sendPolicy.policy = psio_parse_policy(policy);
+    }
+    config.sendPolicy.corkBytes = env_long("PSSERVER_CORK_BYTES", 16384);
+    config.sendPolicy.corkUs = env_long("PSSERVER_CORK_US", 500);
+    long rate = env_long("PSSERVER_CLIENT_RATE", 0);
+    psrate_init(&config.clientRate, rate,
+            env_long("PSSERVER_CLIENT_BURST", rate / 10));
+    rate = env_long("PSSERVER_TOPIC_RATE", 0);
+    psrate_init(&config.topicRate, rate,
+            env_long("PSSERVER_TOPIC_BURST", rate / 10));
+    char *action = getenv("PSSERVER_RATE_ACTION");
+    config.rateReject = action != NULL && strcmp(action, "reject") == 0;
+}
+
+// **********************************************************************
+// Resolve every host:port in PSSERVER_PEERS and make up this server's
+// id. Exits if a peer cannot be resolved.
+// **********************************************************************
+void init_peers() {
+    snprintf(serverId, sizeof(serverId), "%08lx%08lx",
+            (unsigned long) getpid(), (unsigned long) psstats_now());
+    peerCount = 0;
+    if (config.peers == NULL) {
+        return;
+    }
+    char *list = strdup(config.peers), *save, *spec;
+    for (spec = strtok_r(list, ",", &save); spec != NULL;
+            spec = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(spec, ':');
+        struct addrinfo hints, *found;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (colon != NULL) {
+            *colon = '\0';
+        }
+        if (colon == NULL || getaddrinfo(spec, colon + 1, &hints,
+                &found) != 0) {
+            fprintf(stderr, "psserver: unable to resolve peer %s\n", spec);
+            fflush(stderr);
+            exit(EXIT_FAILURE);
+        }
+        *colon = ':';
+        peers = realloc(peers, sizeof(PeerConfig) * (peerCount + 1));
+        peers[peerCount].spec = spec;
+        memcpy(&peers[peerCount].addr, found->ai_addr,
+                sizeof(struct sockaddr_in));
+        peers[peerCount++].fd = -1;
+        freeaddrinfo(found);
+    }
+}
+
+// **********************************************************************
+// Open the publish log if persistence is enabled. Waiting for each pub
+// to be durable blocks the thread that reads it, which with epoll or
+// uring is the only I/O thread, so it is refused with those backends.
+// **********************************************************************
+void init_pub_log() {
+    pubLog = NULL;
+    if (config.logDir == NULL || strlen(config.logDir) == 0) {
+        return;
+    }
+    if (config.logWait && config.backend != PSIO_THREAD) {
+        fprintf(stderr, "psserver: PSSERVER_LOG_WAIT needs the thread"
+                " backend\n");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+    pubLog = pslog_open(config.logDir, config.logSegmentSize,
+            config.logFsyncBatch, config.logFsyncMs, config.logWait);
+    if (pubLog == NULL) {
+        fprintf(stderr, "psserver: unable to open publish log %s\n",
+                config.logDir);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// **********************************************************************
+// Start recording client traffic if PSSERVER_TRACE is set
+// **********************************************************************
+void init_trace() {
+    trace = NULL;
+    if (config.tracePath == NULL || strlen(config.tracePath) == 0) {
+        return;
+    }
+    trace = pstrace_open(config.tracePath, TRACE_FLUSH_MS);
+    if (trace == NULL) {
+        fprintf(stderr, "psserver: unable to create trace %s\n",
+                config.tracePath);
+        fflush(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
 // **********************************************************************
 // initiate all global varialbles
 // **********************************************************************
@@ -153,12 +890,16 @@ void init_global_var(){
 
     clientRoot = stringmap_init();
     topicRoot = stringmap_init();
-    statsData = malloc(sizeof(StatsData));
-    statsData->connCli = 0;
-    statsData->disconnCli = 0;
-    statsData->pubCount = 0;
-    statsData->subCount = 0;
-    statsData->unsubCount = 0;
+    // one slot per possible descriptor, so it never has to grow while
+    // connection threads are reading it
+    struct rlimit limit;
+    shmClientsSize = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+            && limit.rlim_cur != RLIM_INFINITY) {
+        shmClientsSize = limit.rlim_cur < (1 << 20) ? limit.rlim_cur : 1 << 20;
+    }
+    shmClients = calloc(shmClientsSize, sizeof(ShmClient*));
+    fdClients = calloc(shmClientsSize, sizeof(ClientData*));
 }
 
 // **********************************************************************
@@ -178,31 +919,50 @@ int main(int argc, char **argv){
     }
     int maxConn = atoi(argv[1]);
 
-    int newSockfds[10];
-    //pthread_t tids[10], pubTId;
-    pthread_t tids[10];
+    // SIGHUP is blocked before any thread is started (the publish log
+    // and trace writers included) so that every thread inherits the
+    // mask and only stats_thread receives it
+    static sigset_t hup;
+    pthread_t statsId;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+    load_config();
+    init_pub_log();
+    init_trace();
+    startTime = psstats_now();
+    init_peers();
 
-    // Bind signals to handling functions
-    signal(SIGHUP, show_stats);
+    pthread_create(&statsId, NULL, stats_thread, &hup);
+    pthread_detach(statsId);
+    // a subscriber that disconnects mid-delivery must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
+    int listenFds[2], listenCount = 0;
     int sockfd = init_socket(mainPort);
 
-    listen(sockfd, maxConn);
+    // maxConn is enforced when connections are accepted (PsIoLimits), not
+    // through the backlog: 0 means no limit there but no backlog here
+    listen(sockfd, SOMAXCONN);
+    listenFds[listenCount++] = sockfd;
+    if (config.unixPath != NULL && strlen(config.unixPath) > 0) {
+        listenFds[listenCount] = init_unix_socket(config.unixPath);
+        listen(listenFds[listenCount++], SOMAXCONN);
+    }
     fflush(stdout);
 
-    // Accept clients
-    unsigned int sinSize = sizeof(struct sockaddr_in);
-    struct sockaddr_in clientAddr;
-    int i = 0;
-    while (1) {
-
-        newSockfds[i] = accept(sockfd, (struct sockaddr *)&clientAddr,
-                &sinSize);
-        pthread_create(&tids[i], NULL, handle_connection,
-                (void *)&newSockfds[i]);
-        statsData->connCli++;
-        i++;
-    }
+    // Accept clients and serve them on the configured I/O backend
+    PsIoCallbacks callbacks = {open_connection, handle_connection,
+            close_connection, flush_latest};
+    // one tick drives the timer wheel ($SYS, peer retries and idle
+    // connections) and epoch reclamation, so it always runs
+    init_timers();
+    psio_set_tick(WHEEL_TICK_MS, server_tick);
+    PsIoLimits limits = {maxConn, config.clientBytes, config.maxBytes};
+    psio_set_limits(&limits);
+    psio_set_send_policy(&config.sendPolicy);
+    psio_run(config.backend, listenFds, listenCount, &callbacks);
     close(sockfd);
 } // The main function creates a server that listens on an ephemeral port
 
@@ -211,7 +971,8 @@ int main(int argc, char **argv){
 // **********************************************************************
 int skip_till_token(char *str, int tokenNum, int *placePtr) {
     int pointer = *placePtr, tokenCount = 1, foundToken = 0;
-    while (pointer < strlen(str)) {
+    int strLen = strlen(str);
+    while (pointer < strLen) {
         if (tokenCount == tokenNum) {
             break;
         }
@@ -219,7 +980,8 @@ int skip_till_token(char *str, int tokenNum, int *placePtr) {
                 || (str[pointer] >= 'A' && str[pointer] <= 'Z')
                 || (str[pointer] >= '0' && str[pointer] <= '9')
                 || str[pointer] == ':' || str[pointer] == '_'
-                || str[pointer] == '-' || str[pointer] == '@') {
+                || str[pointer] == '-' || str[pointer] == '@'
+                || str[pointer] == '$') {
             pointer++;
             foundToken = 1;
             continue;
@@ -227,7 +989,7 @@ int skip_till_token(char *str, int tokenNum, int *placePtr) {
         if (str[pointer] == ' ' || str[pointer] == '\t') {
             while (str[pointer] == ' ' || str[pointer] == '\t') {
                 pointer++;
-                if (pointer > strlen(str)) {
+                if (pointer > strLen) {
                     break;
                 }
             }
@@ -242,7 +1004,7 @@ int skip_till_token(char *str, int tokenNum, int *placePtr) {
             pointer++;
             while (str[pointer] != '"') {
                 pointer++;
-                if (pointer > strlen(str)) {
+                if (pointer > strLen) {
                     break;
                 }
             }
@@ -251,20 +1013,52 @@ int skip_till_token(char *str, int tokenNum, int *placePtr) {
         }
     }
     pointer--;
-    if ((pointer > strlen(str)) || (tokenCount != tokenNum)) {
+    if ((pointer > strLen) || (tokenCount != tokenNum)) {
         return -1;
     }
     *placePtr = pointer;
     return 0;
 }
     
+// **********************************************************************
+// Copy the word at *cursor into outToken and move *cursor past it, so a
+// list of tokens is read in one pass rather than by asking get_token()
+// for each in turn. Like get_token(), the token ends at the first
+// character that cannot be part of one, and the rest of the word is
+// dropped. Returns -1 once there are no words left.
+// **********************************************************************
+int next_token(char **cursor, char *outToken) {
+    char *p = *cursor;
+    int index = 0;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '\0') {
+        return -1;
+    }
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+            || (*p >= '0' && *p <= '9') || *p == '-' || *p == '_'
+            || *p == '$') {
+        if (index < MAX_TOKEN_LEN) {
+            outToken[index++] = *p;
+        }
+        p++;
+    }
+    while (*p != '\0' && *p != ' ' && *p != '\t') {
+        p++;
+    }
+    outToken[index] = '\0';
+    *cursor = p;
+    return 0;
+}
+
 // **********************************************************************
 // find relevant token from the command. input is command recieved and 
 // token number. The word associated with that token number is returned
 // back in outToken
 // **********************************************************************
 int get_token(char *str, int tokenNum, char *outToken) {
-    int pointer = 0, index = 0;
+    int pointer = 0, index = 0, strLen = strlen(str);
     if ((str[pointer] >= 'a' && str[pointer] <= 'z') 
             || (str[pointer] >= 'A' && str[pointer] <= 'Z')) {
         // valid 
@@ -274,36 +1068,40 @@ int get_token(char *str, int tokenNum, char *outToken) {
     if (skip_till_token(str, tokenNum, &pointer) != 0) {
         return -1;
     }
-    while (pointer < strlen(str)) {
+    while (pointer < strLen) {
         if ((str[pointer] >= 'a' && str[pointer] <= 'z')
                 || (str[pointer] >= 'A' && str[pointer] <= 'Z')
                 || (str[pointer] >= '0' && str[pointer] <= '9')
-                || (str[pointer] == '-') || (str[pointer] == '_')) {
-            outToken[index] = str[pointer];
-            index++;
+                || (str[pointer] == '-') || (str[pointer] == '_')
+                || (str[pointer] == '$')) {
+            if (index < MAX_TOKEN_LEN) { // the rest is dropped
+                outToken[index++] = str[pointer];
+            }
             pointer++;
             continue;
         }
         if (str[pointer] == '"') {
-            outToken[index] = str[pointer];
-            index++;
+            if (index < MAX_TOKEN_LEN) {
+                outToken[index++] = str[pointer];
+            }
             pointer++;
             while (str[pointer] != '"') {
-                outToken[index] = str[pointer];
-                index++;
+                if (index < MAX_TOKEN_LEN) {
+                    outToken[index++] = str[pointer];
+                }
                 pointer++;
-                if (pointer > strlen(str)) {
+                if (pointer > strLen) {
                     break;
                 }
             }
         }
-        outToken[index] = '\0';
         break;// not a vlid char for message type
     }
+    outToken[index] = '\0';
     if (index == 0) {
         return -1;
     }
-    if (pointer <= strlen(str)) {
+    if (pointer <= strLen) {
         return 0;
     } else {
         return 1;
@@ -324,7 +1122,7 @@ int find_msg_type(char *command, char *messageType) {
         }
     }
     int index = 0;
-    while (1) {
+    while (index < MAX_TYPE_LEN) { // longer is not a valid type anyway
         if (command[pointer] >= 'a' && command[pointer] <= 'z') {
             messageType[index] = command[pointer];
             index++;
@@ -349,9 +1147,33 @@ int find_msg_type(char *command, char *messageType) {
     if (strcmp(messageType, "sub") == 0) {
         return 0;
     }
+    if (strcmp(messageType, "sublatest") == 0) {
+        return 0;
+    }
     if (strcmp(messageType, "name") == 0) {
         return 0;
     }
+    if (strcmp(messageType, "replay") == 0) {
+        return 0;
+    }
+    if (strcmp(messageType, "pubbatch") == 0) {
+        return 0;
+    }
+    if (strcmp(messageType, "shmring") == 0) {
+        return 0;
+    }
+    if (strcmp(messageType, "shmack") == 0) {
+        return 0;
+    }
+    if (strcmp(messageType, "ping") == 0) {
+        return 0;
+    }
+    if (strcmp(messageType, "pong") == 0) {
+        return 0;
+    }
+    if (strcmp(messageType, "policy") == 0) {
+        return 0;
+    }
     return 1;
 }
 
@@ -359,232 +1181,1559 @@ int find_msg_type(char *command, char *messageType) {
 // Send message to relevant client
 // **********************************************************************
 int send_msg(int sockfd, char *msg) {
-    if (strlen(msg) == 0) {
+    int len = strlen(msg);
+    if (len == 0) {
         return 1;
     }
-    int retCd = send(sockfd, msg, strlen(msg), 0);
-    if (retCd <= 0) {
-        return -1;
+    // message and newline go out together so deliveries from different
+    // threads can never interleave
+    char stackBuf[256], *buf = stackBuf;
+    if (len + 1 > sizeof(stackBuf)) {
+        buf = malloc(len + 1);
     }
-    char retStr[128] = "\n";
-    retCd = send(sockfd, retStr, strlen(retStr), 0);
-    if (retCd <= 0) {
-        return -1;
+    memcpy(buf, msg, len);
+    buf[len] = '\n';
+    int retCd = deliver(sockfd, buf, len + 1);
+    if (buf != stackBuf) {
+        free(buf);
     }
-    return 0;
+    return retCd;
 }
 
 // **********************************************************************
-// Process command received. If received command is not valid, send an 
-// invalid response
+// Send a binary frame made up of a header and the given fields. The
+// frame is assembled in one buffer so it goes out in a single send.
 // **********************************************************************
-void handle_command(int sockfd, char *command) {
-    char msgType[128];
-    if (strlen(command) <= 0) {
-        send_msg(sockfd, ":invalid");
-        return;
-    }
-    int err = find_msg_type(command, msgType);
-    if (err == 1) { // invalid message type
-        send_msg(sockfd, ":invalid");
-        return;
+int send_frame(int sockfd, int opcode, char *name, int nameLen,
+        char *topic, int topicLen, char *payload, int payloadLen) {
+    int len = PSPROTO_HEADER_LEN + nameLen + topicLen + payloadLen;
+    char stackBuf[256], *buf = stackBuf;
+    if (len > sizeof(stackBuf)) {
+        buf = malloc(len);
     }
-    char *namePtr;
-    namePtr = strstr(command, msgType);
-    namePtr += strlen(msgType);
-    if (strcmp(msgType, "sub") == 0) {
-        process_sub(sockfd, command);
-    } else if (strcmp(msgType, "unsub") == 0) {
-        process_unsub(sockfd, command);
-    } else if (strcmp(msgType, "name") == 0) {
-        process_name(sockfd, command);
-    } else if (strcmp(msgType, "pub") == 0) {
-        process_pub(sockfd, command);
+    psproto_encode((unsigned char*) buf, opcode, nameLen, topicLen,
+            payloadLen);
+    memcpy(buf + PSPROTO_HEADER_LEN, name, nameLen);
+    memcpy(buf + PSPROTO_HEADER_LEN + nameLen, topic, topicLen);
+    memcpy(buf + PSPROTO_HEADER_LEN + nameLen + topicLen, payload,
+            payloadLen);
+    int retCd = deliver(sockfd, buf, len);
+    if (buf != stackBuf) {
+        free(buf);
     }
-} // This function does plenty of things
+    return retCd;
+}
 
 // **********************************************************************
-// Process name command. If this name is not already there, add it to the 
-// client tree. Else ignore this name and send an invalid response
+// Move as much overflow as fits into a client's ring. Called with the
+// ring locked. If some is left the client is asked to send shmack once
+// it has made room. A client that broke its ring is dropped.
 // **********************************************************************
-void process_name(int sockfd, char *command) {
-    char retStr[1024];
-    memset(retStr, '\0', 1023);
-    int retCd = get_token(command, 3, retStr);
-    if (retCd == 0) { // 3rd argument present. invlaid
-        send_msg(sockfd, ":invalid");
-        return;
+void shm_drain(ShmClient *shm, int sockfd) {
+    do {
+        int n = psshm_write(&shm->ring, shm->overflow, shm->overLen);
+        if (n < 0) {
+            psio_charge(sockfd, -shm->overLen);
+            shm->overLen = 0;
+            psio_drop(sockfd);
+            return;
+        }
+        memmove(shm->overflow, shm->overflow + n, shm->overLen - n);
+        shm->overLen -= n;
+        psio_charge(sockfd, -n);
+    } while (shm->overLen > 0 && psshm_set_blocked(&shm->ring));
+}
+
+// **********************************************************************
+// Send bytes to a client: through its shared memory ring if it has one,
+// otherwise on its socket. Once anything is waiting for room in the ring
+// later bytes queue behind it so the stream stays in order.
+// **********************************************************************
+int deliver(int sockfd, char *data, int len) {
+    ShmClient *shm = NULL;
+    if (sockfd >= 0 && sockfd < shmClientsSize) {
+        shm = __atomic_load_n(&shmClients[sockfd], __ATOMIC_ACQUIRE);
     }
-    retCd = get_token(command, 2, retStr);
-    if (retCd == 1 || valid_name(retStr) == 1) {
-        send_msg(sockfd, ":invalid");
-        return;
+    if (shm == NULL) {
+        return psio_send(sockfd, data, len);
     }
-    ClientData *clientData;
-    StringMap *msgRoot;
-    clientData = malloc(sizeof(ClientData));
-    msgRoot = stringmap_init();
-    clientData->msgRoot = msgRoot;
-    clientData->sockfd = sockfd;
-    int err = stringmap_add(clientRoot, retStr, clientData);
-    if (err == 0) {
-        send_msg(sockfd, ":invalid");
-        //close(sockfd);
-        //pthread_exit(0);
-        return;
+    pthread_mutex_lock(&shm->lock);
+    if (!shm->active) {
+        pthread_mutex_unlock(&shm->lock);
+        return psio_send(sockfd, data, len);
     }
-
-    //print_names_only();
+    int n = 0;
+    if (shm->overLen == 0) {
+        n = psshm_write(&shm->ring, data, len);
+    }
+    if (n < 0) {
+        // the client moved tail past head, so nothing it says about
+        // the ring can be trusted any more
+        psio_drop(sockfd);
+    } else if (n < len) {
+        if (shm->overLen + len - n > shm->overCap) {
+            shm->overCap = (shm->overLen + len - n) * 2;
+            shm->overflow = realloc(shm->overflow, shm->overCap);
+        }
+        memcpy(shm->overflow + shm->overLen, data + n, len - n);
+        shm->overLen += len - n;
+        // the same rule as output queued on a socket
+        if (psio_charge(sockfd, len - n) != 0) {
+            psio_drop(sockfd);
+        }
+        shm_drain(shm, sockfd);
+    }
+    pthread_mutex_unlock(&shm->lock);
+    return 0;
 }
 
 // **********************************************************************
-// Search through client tree and find clint name for the received
-// socket id
+// deliver() for bytes made up of several pieces. A shared memory ring
+// takes them as one run, so for a client on one they are put together
+// first; on a socket they go to the I/O layer as they are.
 // **********************************************************************
-int get_client_name(int sockfd, char *clientName) {
-    ClientData *clientData;
-    StringMap *currNode;
-    currNode = NULL;
-    currNode = stringmap_iterate(clientRoot, currNode);
-    while (currNode != NULL){
-        clientData = (ClientData*) currNode->item;
-        if (sockfd == clientData->sockfd){
-            strcpy(clientName,currNode->key);
-            return 0;
+int deliverv(int sockfd, struct iovec *iov, int count) {
+    if (sockfd >= 0 && sockfd < shmClientsSize
+            && __atomic_load_n(&shmClients[sockfd], __ATOMIC_ACQUIRE)) {
+        int len = 0;
+        for (int i = 0; i < count; i++) {
+            len += iov[i].iov_len;
         }
-        currNode = stringmap_iterate(clientRoot,currNode);
+        char *buf = malloc(len), *p = buf;
+        for (int i = 0; i < count; i++) {
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        int retCd = deliver(sockfd, buf, len);
+        free(buf);
+        return retCd;
     }
-    strcpy(clientName, "");
-    return -1;
+    return psio_sendv(sockfd, iov, count);
 }
 
 // **********************************************************************
-// Process unsub message from client. It searches topic tree and adds 
-// client to the topic tree. It will not send data in case 
-// name command was not received till this point
+// Process shmring message from a client on the Unix domain socket. The
+// reply carries the ring's memfd and eventfd; every later byte for the
+// client goes into the ring. Invalid over TCP or if a ring is in use.
 // **********************************************************************
-void process_sub(int sockfd, char *command) {
-    char retStr[1024], cliName[30], topic[30], *item;
-    memset(retStr, '\0', 1023);
-    int retCd = get_token(command, 3, retStr);
-    if (retCd == 0) { // 3rd argument present. invlaid
-        send_msg(sockfd, ":invalid");
+void process_shmring(Connection *conn) {
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname(conn->sockfd, (struct sockaddr *)&addr, &addrLen) != 0
+            || addr.ss_family != AF_UNIX || conn->sockfd >= shmClientsSize) {
+        send_invalid(conn);
         return;
     }
-    retCd = get_token(command, 2, retStr);
-    if (retCd == 1 || valid_name(retStr) == 1) {
-        send_msg(sockfd, ":invalid");
-        return;
+    ShmClient *shm = shmClients[conn->sockfd];
+    if (shm == NULL) {
+        shm = calloc(1, sizeof(ShmClient));
+        pthread_mutex_init(&shm->lock, NULL);
+        __atomic_store_n(&shmClients[conn->sockfd], shm, __ATOMIC_RELEASE);
     }
-    strcpy(topic, retStr);
-
-    retCd = get_client_name(sockfd, cliName);
-    if (retCd == -1) { // if we have not received name
-                  // earlier, then ignore command
+    PsShmRing ring;
+    if (shm->active || psshm_create(&ring, config.shmRingSize) != 0) {
+        send_invalid(conn);
         return;
     }
-    StringMap *subCliRoot;
-    subCliRoot = stringmap_search(topicRoot, topic);
-    if (stringmap_search(subCliRoot, cliName) == 0) {
-        //client not present for this topic
-        statsData->subCount++;
-    }
-    item = malloc(strlen(cliName) + 2);
-    strcpy(item, cliName);
-    if (subCliRoot == NULL){
-        subCliRoot = stringmap_init();
-        stringmap_add(subCliRoot, cliName, item);
-        stringmap_add(topicRoot, retStr, subCliRoot);
+    char reply[PSPROTO_HEADER_LEN + 8];
+    int len;
+    if (conn->mode == MODE_BINARY) {
+        psproto_encode((unsigned char*) reply, PS_OP_TEXT, 0, 0, 7);
+        memcpy(reply + PSPROTO_HEADER_LEN, "shmring", 7);
+        len = PSPROTO_HEADER_LEN + 7;
     } else {
-        stringmap_add(subCliRoot, cliName, item);
+        len = sprintf(reply, ":shmring\n");
     }
-    //print_topic_tree();
+    int fds[2] = {ring.memfd, ring.eventfd};
+    if (psio_send_fds(conn->sockfd, reply, len, fds, 2) != 0) {
+        psshm_close(&ring);
+        send_invalid(conn);
+        return;
+    }
+    pthread_mutex_lock(&shm->lock);
+    shm->ring = ring;
+    shm->active = 1;
+    pthread_mutex_unlock(&shm->lock);
 }
 
 // **********************************************************************
-// Process unsub message from client. It searches topic tree and removes 
-// client associated with this topici. It will not send data in case 
-// name command was not received till this point
+// Process shmack message: the client has made room in its ring
 // **********************************************************************
-void process_unsub(int sockfd, char *command) {
-    char retStr[1024], cliName[30];
-    memset(retStr, '\0', 1023);
-    int retCd = get_token(command, 3, retStr);
-    if (retCd == 0) { // 3rd argument present. invlaid
-        send_msg(sockfd, ":invalid");
-        return;
+void process_shmack(Connection *conn) {
+    ShmClient *shm = NULL;
+    if (conn->sockfd < shmClientsSize) {
+        shm = shmClients[conn->sockfd];
     }
-    retCd = get_token(command, 2, retStr);
-    if (retCd == 1 || valid_name(retStr) == 1) {
-        send_msg(sockfd, ":invalid");
-        return;
-    }
-    StringMap *subCliRoot;
-    retCd = get_client_name(sockfd, cliName);
-    if (retCd == -1) { // if we have not received name
-                  // earlier, then ignore command
+    if (shm == NULL) {
         return;
     }
-    subCliRoot = stringmap_search(topicRoot, retStr);
-    // if we get null, it means unsub was issued
-    // before sub. So, nothing needs to be done.
-    if (subCliRoot != NULL) {
-        if (stringmap_search(subCliRoot, cliName) != 0) {
-            statsData->unsubCount++;
-        }
-        stringmap_remove(subCliRoot, cliName);
+    pthread_mutex_lock(&shm->lock);
+    if (shm->active && shm->overLen > 0) {
+        shm_drain(shm, conn->sockfd);
     }
-    //print_topic_tree();
+    pthread_mutex_unlock(&shm->lock);
 }
 
 // **********************************************************************
-// Process pub message from client. It searches topic tree and finds 
-// clients that need to receive messages. It then sends messages to 
-// all these clients. It will not send data in case name command was 
-// not received till this point
+// Release a client's ring when its connection closes
 // **********************************************************************
-void process_pub(int sockfd, char *command) {
-    char retStr[1024], topic[30], toSendCli[30];
-    StringMap *currNode, *subCliRoot;
-    ClientData *clientData;
-    char *remMsg, *msgSt, cliName[30];
-    memset(retStr, '\0', 1023);
-    int retCd = get_token(command, 2, retStr);
-    if (retCd == 1 || valid_name(retStr) == 1) {
-        send_msg(sockfd, ":invalid");
+void free_shm_client(int sockfd) {
+    if (sockfd >= shmClientsSize || shmClients[sockfd] == NULL) {
         return;
     }
-    strcpy(topic, retStr);
+    ShmClient *shm = shmClients[sockfd];
+    pthread_mutex_lock(&shm->lock);
+    if (shm->active) {
+        psshm_close(&shm->ring);
+        shm->active = 0;
+        shm->overLen = 0;
+    }
+    pthread_mutex_unlock(&shm->lock);
+}
+
+// **********************************************************************
+// Send an invalid response in whichever protocol the client speaks
+// **********************************************************************
+void send_invalid(Connection *conn) {
+    if (conn->mode == MODE_BINARY) {
+        send_frame(conn->sockfd, PS_OP_INVALID, "", 0, "", 0, "", 0);
+    } else {
+        send_msg(conn->sockfd, ":invalid");
+    }
+}
+
+// **********************************************************************
+// Process command received. If received command is not valid, send an 
+// invalid response
+// **********************************************************************
+void handle_command(Connection *conn, char *command) {
+    char msgType[128];
+    if (strlen(command) <= 0) {
+        send_invalid(conn);
+        return;
+    }
+    int err = find_msg_type(command, msgType);
+    if (err == 1) { // invalid message type
+        send_invalid(conn);
+        return;
+    }
+    if (strcmp(msgType, "sub") == 0) {
+        process_sub(conn, command, 0);
+    } else if (strcmp(msgType, "sublatest") == 0) {
+        process_sub(conn, command, 1);
+    } else if (strcmp(msgType, "unsub") == 0) {
+        process_unsub(conn, command);
+    } else if (strcmp(msgType, "name") == 0) {
+        process_name(conn, command);
+    } else if (strcmp(msgType, "pub") == 0) {
+        process_pub(conn, command);
+    } else if (strcmp(msgType, "replay") == 0) {
+        process_replay(conn, command);
+    } else if (strcmp(msgType, "pubbatch") == 0) {
+        process_pubbatch(conn, command);
+    } else if (strcmp(msgType, "shmring") == 0) {
+        process_shmring(conn);
+    } else if (strcmp(msgType, "shmack") == 0) {
+        process_shmack(conn);
+    } else if (strcmp(msgType, "policy") == 0) {
+        process_policy(conn, command);
+    } else if (strcmp(msgType, "ping") == 0) {
+        send_msg(conn->sockfd, ":pong");
+    } // pong needs no answer: receiving it shows the client is alive
+} // This function does plenty of things
+
+// **********************************************************************
+// Get the single name or topic argument of a text command. Returns 0 and
+// fills name if present and valid, else -1.
+// **********************************************************************
+int get_name_arg(char *command, char *name) {
+    char retStr[1024];
+    memset(retStr, '\0', 1023);
+    int retCd = get_token(command, 3, retStr);
+    if (retCd == 0) { // 3rd argument present. invlaid
+        return -1;
+    }
+    retCd = get_token(command, 2, retStr);
+    if (retCd == 1 || valid_name(retStr) == 1
+            || strlen(retStr) >= MAX_NAME_LEN) {
+        return -1;
+    }
+    strcpy(name, retStr);
+    return 0;
+}
+
+// **********************************************************************
+// Process policy command: switch how this client's output is sent
+// **********************************************************************
+void process_policy(Connection *conn, char *command) {
+    char policy[MAX_NAME_LEN];
+    if (get_name_arg(command, policy) != 0
+            || psio_parse_policy(policy) < 0) {
+        send_invalid(conn);
+        return;
+    }
+    psio_set_policy(conn->sockfd, psio_parse_policy(policy));
+}
+
+// **********************************************************************
+// Process name command. If this name is not already there, add it to the 
+// client tree. Else ignore this name and send an invalid response
+// **********************************************************************
+void process_name(Connection *conn, char *command) {
+    char name[MAX_NAME_LEN];
+    if (get_name_arg(command, name) != 0) {
+        send_invalid(conn);
+        return;
+    }
+    do_name(conn, name);
+}
+
+// **********************************************************************
+// Add a client name to the client tree. Invalid if the name is in use
+// or reserved.
+// **********************************************************************
+void do_name(Connection *conn, char *name) {
+    ClientData *clientData;
+    StringMap *msgRoot;
+    if (reserved_name(name)) {
+        send_invalid(conn);
+        return;
+    }
+    if (conn->client != NULL) { // already named
+        send_invalid(conn);
+        return;
+    }
+    clientData = calloc(1, sizeof(ClientData));
+    pthread_mutex_init(&clientData->latestLock, NULL);
+    pthread_mutex_init(&clientData->sendLock, NULL);
+    msgRoot = stringmap_init();
+    clientData->msgRoot = msgRoot;
+    clientData->sockfd = conn->sockfd;
+    clientData->binary = (conn->mode == MODE_BINARY);
+    strcpy(clientData->name, name);
+    pthread_rwlock_wrlock(&clientLock);
+    int err = stringmap_add(clientRoot, name, clientData);
+    pthread_rwlock_unlock(&clientLock);
+    if (err == 0) {
+        send_invalid(conn);
+        stringmap_free(msgRoot);
+        free(clientData);
+        return;
+    }
+    conn->client = clientData;
+    if (conn->sockfd < shmClientsSize) {
+        __atomic_store_n(&fdClients[conn->sockfd], clientData,
+                __ATOMIC_RELEASE);
+    }
+    psstats_count(PS_STAT_NAMES, 1);
+
+    //print_names_only();
+}
+
+// **********************************************************************
+// Look a topic up. Returns NULL if nobody has ever subscribed to it.
+// **********************************************************************
+Topic *find_topic(char *topic) {
+    pthread_rwlock_rdlock(&topicLock);
+    Topic *found = stringmap_search(topicRoot, topic);
+    pthread_rwlock_unlock(&topicLock);
+    return found;
+}
+
+// **********************************************************************
+// Look a topic up, adding it if it is new
+// **********************************************************************
+Topic *get_topic(char *topic) {
+    Topic *found = find_topic(topic);
+    if (found != NULL) {
+        return found;
+    }
+    Topic **outgrown = NULL;
+    pthread_rwlock_wrlock(&topicLock);
+    found = stringmap_search(topicRoot, topic);
+    if (found == NULL) { // nobody added it while we waited
+        found = malloc(sizeof(Topic));
+        pthread_mutex_init(&found->lock, NULL);
+        found->subs = NULL;
+        found->latest = NULL;
+        found->localCount = 0;
+        found->rateBucket = 0;
+        found->nameLen = strlen(topic);
+        strcpy(found->name, topic);
+        found->id = topicIdCount;
+        if (topicIdCount == topicTableCap) {
+            topicTableCap = topicTableCap ? topicTableCap * 2 : 1024;
+            Topic **grown = malloc(sizeof(Topic*) * topicTableCap);
+            if (topicIdCount > 0) {
+                memcpy(grown, topicTable, sizeof(Topic*) * topicIdCount);
+            }
+            outgrown = topicTable;
+            __atomic_store_n(&topicTable, grown, __ATOMIC_RELEASE);
+        }
+        topicTable[found->id] = found;
+        // readers check the count before they look in the table
+        __atomic_store_n(&topicIdCount, found->id + 1, __ATOMIC_RELEASE);
+        stringmap_add(topicRoot, topic, found);
+        psstats_count(PS_STAT_TOPICS, 1);
+    }
+    pthread_rwlock_unlock(&topicLock);
+    if (outgrown != NULL) {
+        psepoch_retire(outgrown, free);
+    }
+    return found;
+}
+
+// **********************************************************************
+// Look a topic up by id. Returns NULL if no topic has that id.
+// **********************************************************************
+Topic *topic_by_id(uint32_t id) {
+    if (id >= __atomic_load_n(&topicIdCount, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    psepoch_enter();
+    Topic *found = __atomic_load_n(&topicTable, __ATOMIC_ACQUIRE)[id];
+    psepoch_exit();
+    return found;
+}
+
+// **********************************************************************
+// Look up a topic a connection publishes to. The topics it used last
+// are kept in a small table by a hash of their names, so a client that
+// keeps publishing to the same few topics only searches topicRoot the
+// first time. Returns NULL if nobody has ever subscribed to the topic.
+// **********************************************************************
+Topic *cached_topic(Connection *conn, char *topic) {
+    unsigned hash = 0;
+    for (char *p = topic; *p != '\0'; p++) {
+        hash = hash * 31 + (unsigned char) *p;
+    }
+    Topic **slot = &conn->topicCache[hash & (TOPIC_CACHE_SIZE - 1)];
+    if (*slot != NULL && strcmp((*slot)->name, topic) == 0) {
+        return *slot;
+    }
+    Topic *found = find_topic(topic);
+    if (found != NULL) {
+        *slot = found;
+    }
+    return found;
+}
+
+// **********************************************************************
+// Current contents of one of a topic's subscriber lists (&topic->subs
+// or &topic->latest). Call inside a psepoch read section and do not use
+// the list after leaving it.
+// **********************************************************************
+SubList *topic_subs(SubList **list) {
+    return __atomic_load_n(list, __ATOMIC_ACQUIRE);
+}
+
+// **********************************************************************
+// Replace one of a topic's subscriber lists with one that has client
+// added, or removed if remove is set. Called with the topic locked.
+// Returns 0 if the list changed, -1 if client was already (or was not)
+// there.
+// **********************************************************************
+int change_subs(SubList **list, ClientData *client, int remove) {
+    SubList *old = *list, *new;
+    int count = old ? old->count : 0, at = -1;
+    for (int i = 0; i < count; i++) {
+        if (old->clients[i] == client) {
+            at = i;
+            break;
+        }
+    }
+    if ((at >= 0) != remove) {
+        return -1;
+    }
+    int newCount = remove ? count - 1 : count + 1;
+    new = NULL;
+    if (newCount > 0) {
+        new = malloc(sizeof(SubList) + newCount * sizeof(ClientData*));
+        new->count = 0;
+        for (int i = 0; i < count; i++) {
+            if (i != at) {
+                new->clients[new->count++] = old->clients[i];
+            }
+        }
+        if (!remove) {
+            new->clients[new->count++] = client;
+        }
+    }
+    __atomic_store_n(list, new, __ATOMIC_RELEASE);
+    if (old != NULL) {
+        psepoch_retire(old, free);
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Tell every linked server that this server now has (op PS_OP_SUB) or
+// no longer has (PS_OP_UNSUB) local subscribers for a topic. Reserved
+// topics are this server's own and are never shared.
+// **********************************************************************
+void send_interest(Topic *topic, int op) {
+    if (reserved_name(topic->name)) {
+        return;
+    }
+    pthread_mutex_lock(&linkLock);
+    for (int i = 0; i < linkCount; i++) {
+        send_frame(links[i]->sockfd, op, "", 0, topic->name,
+                strlen(topic->name), "", 0);
+    }
+    pthread_mutex_unlock(&linkLock);
+}
+
+// **********************************************************************
+// Count a client (not a link) joining, delta 1, or leaving, delta -1, a
+// topic's subscribers. Linked servers hear about the first to join and
+// the last to leave. Called with the topic locked so the news goes out
+// in the order the changes were made.
+// **********************************************************************
+void local_interest(Topic *topic, ClientData *client, int delta) {
+    if (client->peer) {
+        return;
+    }
+    topic->localCount += delta;
+    if (delta > 0 && topic->localCount == 1) {
+        send_interest(topic, PS_OP_SUB);
+    } else if (delta < 0 && topic->localCount == 0) {
+        send_interest(topic, PS_OP_UNSUB);
+    }
+}
+
+// **********************************************************************
+// Process sub message from client. "sub t1 t2 ..." subscribes to every
+// topic listed. Invalid, and nothing is subscribed, unless all of them
+// are valid topics. "sublatest t1 t2 ..." (latest set) is the same, but
+// while the client is not keeping up it is sent only the newest message
+// on each topic rather than all of them.
+// **********************************************************************
+void process_sub(Connection *conn, char *command, int latest) {
+    char retStr[1024], *cursor = command;
+    char (*topics)[MAX_NAME_LEN] = NULL;
+    int count = 0, cap = 0;
+    next_token(&cursor, retStr); // the command itself
+    while (next_token(&cursor, retStr) == 0) {
+        if (valid_name(retStr) == 1 || strlen(retStr) >= MAX_NAME_LEN) {
+            count = 0;
+            break;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 8;
+            topics = realloc(topics, sizeof(*topics) * cap);
+        }
+        strcpy(topics[count], retStr);
+        count++;
+    }
+    if (count == 0) {
+        send_invalid(conn);
+    }
+    for (int i = 0; i < count; i++) {
+        do_sub(conn, topics[i], latest);
+    }
+    free(topics);
+}
+
+// **********************************************************************
+// Search topic tree and add client to the topic tree, to the latest
+// list if latest is set. A client already subscribed the other way is
+// moved across. It will not do anything in case name command was not
+// received till this point
+// **********************************************************************
+void do_sub(Connection *conn, char *topic, int latest) {
+    ClientData *client = conn->client;
+    if (client == NULL) { // if we have not received name
+                  // earlier, then ignore command
+        return;
+    }
+    if (!client->peer && psio_charge(conn->sockfd, SUB_BYTES) != 0) {
+        psio_charge(conn->sockfd, -SUB_BYTES);
+        send_invalid(conn);
+        return;
+    }
+    Topic *subTopic = get_topic(topic);
+    SubList **list = latest ? &subTopic->latest : &subTopic->subs;
+    SubList **other = latest ? &subTopic->subs : &subTopic->latest;
+    pthread_mutex_lock(&subTopic->lock);
+    int added = (change_subs(list, client, 0) == 0);
+    if (added && change_subs(other, client, 1) == 0) {
+        added = 0; // only changed how it is subscribed
+    } else if (added) {
+        local_interest(subTopic, client, 1);
+    }
+    pthread_mutex_unlock(&subTopic->lock);
+    if (!latest) {
+        drop_latest(client, subTopic);
+    }
+    if (added) { // else already subscribed
+        psstats_count(PS_STAT_SUB, 1);
+        psstats_count(PS_STAT_SUBSCRIPTIONS, 1);
+        if (client->topicCount == client->topicCap) {
+            client->topicCap = client->topicCap ? client->topicCap * 2 : 4;
+            client->topics = realloc(client->topics,
+                    client->topicCap * sizeof(Topic*));
+        }
+        client->topics[client->topicCount++] = subTopic;
+    } else if (!client->peer) {
+        psio_charge(conn->sockfd, -SUB_BYTES);
+    }
+    //print_topic_tree();
+}
+
+// **********************************************************************
+// Process unsub message from client. Invalid unless it has exactly one
+// valid topic.
+// **********************************************************************
+void process_unsub(Connection *conn, char *command) {
+    char topic[MAX_NAME_LEN];
+    if (get_name_arg(command, topic) != 0) {
+        send_invalid(conn);
+        return;
+    }
+    do_unsub(conn, topic);
+}
+
+// **********************************************************************
+// Search topic tree and remove client associated with this topic. It
+// will not do anything in case name command was not received till this
+// point
+// **********************************************************************
+void do_unsub(Connection *conn, char *topic) {
+    ClientData *client = conn->client;
+    Topic *subTopic;
+    if (client == NULL) { // if we have not received name
+                  // earlier, then ignore command
+        return;
+    }
+    subTopic = find_topic(topic);
+    // if we get null, it means unsub was issued
+    // before sub. So, nothing needs to be done.
+    if (subTopic != NULL) {
+        pthread_mutex_lock(&subTopic->lock);
+        int removed = (change_subs(&subTopic->subs, client, 1) == 0
+                || change_subs(&subTopic->latest, client, 1) == 0);
+        if (removed) {
+            local_interest(subTopic, client, -1);
+        }
+        pthread_mutex_unlock(&subTopic->lock);
+        drop_latest(client, subTopic);
+        if (removed) {
+            psstats_count(PS_STAT_UNSUB, 1);
+            psstats_count(PS_STAT_SUBSCRIPTIONS, -1);
+            if (!client->peer) {
+                psio_charge(conn->sockfd, -SUB_BYTES);
+            }
+            for (int i = 0; i < client->topicCount; i++) {
+                if (client->topics[i] == subTopic) {
+                    client->topics[i] = client->topics[--client->topicCount];
+                    break;
+                }
+            }
+        }
+    }
+    //print_topic_tree();
+}
+
+// **********************************************************************
+// Split a pub command into its topic and message. Returns 0 if both are
+// present and the topic is valid and not reserved, else -1.
+// **********************************************************************
+int parse_pub(char *command, char *topic, char **msg) {
+    char retStr[1024];
+    memset(retStr, '\0', 1023);
+    int retCd = get_token(command, 2, retStr);
+    if (retCd == 1 || valid_name(retStr) == 1 || reserved_name(retStr)
+            || strlen(retStr) >= MAX_NAME_LEN) {
+        return -1;
+    }
+    strcpy(topic, retStr);
+    memset(retStr, '\0', 1023);
+    retCd = get_token(command, 3, retStr);
+    if (retCd != 0) {
+        return -1;
+    }
+    // look for the message after the topic, not in it: with "pub news
+    // new" the message is the second "new"
+    *msg = strstr(strstr(command + 3, topic) + strlen(topic), retStr);
+    return 0;
+}
+
+// **********************************************************************
+// Process pub message from client. Invalid unless it has a valid topic
+// followed by a message.
+// **********************************************************************
+void process_pub(Connection *conn, char *command) {
+    char topic[MAX_NAME_LEN], *msgSt;
+    if (parse_pub(command, topic, &msgSt) != 0) {
+        send_invalid(conn);
+        return;
+    }
+    do_pub(conn, cached_topic(conn, topic), topic, msgSt, strlen(msgSt));
+}
+
+// **********************************************************************
+// Charge n pubs to pubTopic (NULL if it has no subscribers) from a named
+// client against its own and the topic's rate limits. Returns 0 if they
+// may go ahead, or -1 if they are over a limit and PSSERVER_RATE_ACTION
+// is reject, in which case nothing is charged. When throttling they
+// always go ahead, but the client is charged even beyond its limits and
+// its connection is not read again until it is back under them, so a
+// flood only slows the client itself.
+// **********************************************************************
+int rate_limit(Connection *conn, Topic *pubTopic, int n) {
+    int client = psrate_enabled(&config.clientRate);
+    int borrow = !config.rateReject;
+    uint64_t now, wait = 0;
+    if ((!client && !psrate_enabled(&config.topicRate))
+            || conn->client == NULL || conn->client->peer) {
+        return 0;
+    }
+    now = psstats_now();
+    if (client) {
+        wait = psrate_take(&config.clientRate, &conn->rateBucket, n, now,
+                borrow);
+        if (wait > 0 && !borrow) {
+            psstats_count(PS_STAT_REJECTED, n);
+            return -1;
+        }
+    }
+    // a topic nobody has subscribed to has nobody to flood
+    if (psrate_enabled(&config.topicRate) && pubTopic != NULL) {
+        uint64_t topicWait = psrate_take(&config.topicRate,
+                &pubTopic->rateBucket, n, now, borrow);
+        if (topicWait > 0 && !borrow) {
+            if (client) {
+                psrate_give(&config.clientRate, &conn->rateBucket, n);
+            }
+            psstats_count(PS_STAT_REJECTED, n);
+            return -1;
+        }
+        wait = topicWait > wait ? topicWait : wait;
+    }
+    if (wait > 0) {
+        psstats_count(PS_STAT_THROTTLED, n);
+        psio_pause(conn->sockfd, (wait + 999) / 1000);
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Log and count a publish from a client, then send it on. pubTopic is
+// the topic already looked up, NULL if nobody subscribes to it. It will
+// not send data in case name command was not received till this point
+// **********************************************************************
+void do_pub(Connection *conn, Topic *pubTopic, char *topic, char *msg,
+        int msgLen) {
+    if (conn->client == NULL) { // if we have not received name
+                  // earlier, then ignore command
+        return;
+    }
+    if (rate_limit(conn, pubTopic, 1) != 0) {
+        send_invalid(conn);
+        return;
+    }
+    psstats_count(PS_STAT_PUB, 1);
+    if (pubLog != NULL) {
+        pslog_append(pubLog, conn->client->name, topic, msg, msgLen);
+    }
+    if (pubTopic != NULL) {
+        publish_topic(pubTopic, conn->client->name, msg, msgLen, 0);
+    }
+}
+
+// **********************************************************************
+// Send a sublatest subscriber one message if it is keeping up. If it is
+// behind the message is held instead, replacing any older one held for
+// the same topic, and goes out once the I/O layer reports the client
+// has caught up. Clients on a shared memory ring are always sent it.
+// **********************************************************************
+void deliver_latest(ClientData *client, Topic *topic, char *data, int len) {
+    ShmClient *shm = NULL;
+    pthread_mutex_lock(&client->latestLock);
+    if (client->closed) {
+        pthread_mutex_unlock(&client->latestLock);
+        return;
+    }
+    if (client->sockfd < shmClientsSize) {
+        shm = __atomic_load_n(&shmClients[client->sockfd], __ATOMIC_ACQUIRE);
+    }
+    if (shm != NULL && shm->active) {
+        deliver(client->sockfd, data, len);
+        pthread_mutex_unlock(&client->latestLock);
+        psstats_delivered();
+        return;
+    }
+    if (client->latestCount == 0 && !client->flushing
+            && psio_try_send(client->sockfd, data, len) != 1) {
+        pthread_mutex_unlock(&client->latestLock);
+        psstats_delivered();
+        return;
+    }
+    LatestSlot *slot = NULL;
+    for (int i = 0; i < client->latestCount; i++) {
+        if (client->latest[i].topic == topic) {
+            slot = &client->latest[i];
+            psstats_count(PS_STAT_CONFLATED, 1);
+            break;
+        }
+    }
+    if (slot == NULL) {
+        if (client->latestCount == client->latestCap) {
+            client->latestCap = client->latestCap ? client->latestCap * 2 : 4;
+            client->latest = realloc(client->latest,
+                    sizeof(LatestSlot) * client->latestCap);
+        }
+        slot = &client->latest[client->latestCount++];
+        slot->topic = topic;
+        slot->data = NULL;
+        slot->len = 0;
+    }
+    psio_charge(client->sockfd, len - slot->len);
+    slot->data = realloc(slot->data, len);
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    pthread_mutex_unlock(&client->latestLock);
+}
+
+// **********************************************************************
+// Send one publish to a topic's sublatest subscribers. The message is
+// formatted at most once for each protocol. Called inside a psepoch
+// read section.
+// **********************************************************************
+void publish_latest(Topic *pubTopic, char *sentBy, int cliLen,
+        char *topic, int topicLen, char *msg, int msgLen) {
+    SubList *latest = topic_subs(&pubTopic->latest);
+    if (latest == NULL) {
+        return;
+    }
+    BatchOut formatted[2];  // text, binary
+    memset(formatted, 0, sizeof(formatted));
+    for (int i = 0; i < latest->count; i++) {
+        ClientData *client = latest->clients[i];
+        BatchOut *out = &formatted[client->binary];
+        if (out->len == 0) {
+            batch_append(out, client->binary, sentBy, cliLen, topic,
+                    topicLen, msg, msgLen);
+        }
+        deliver_latest(client, pubTopic, out->data, out->len);
+    }
+    free(formatted[0].data);
+    free(formatted[1].data);
+}
+
+// **********************************************************************
+// Called by the I/O layer once a client that was behind has caught up:
+// everything held for it, one message per topic, goes out in one send.
+// latestLock is not held while sending, so publishers are never kept
+// waiting; whatever they hold meanwhile is sent next, in order.
+// **********************************************************************
+void flush_latest(int fd) {
+    if (fd < 0 || fd >= shmClientsSize) {
+        return;
+    }
+    psepoch_enter();
+    ClientData *client = __atomic_load_n(&fdClients[fd], __ATOMIC_ACQUIRE);
+    if (client != NULL && lock_client(client) == 0) {
+        pthread_mutex_lock(&client->latestLock);
+        while (client->latestCount > 0) {
+            int total = 0;
+            for (int i = 0; i < client->latestCount; i++) {
+                total += client->latest[i].len;
+            }
+            char *buf = malloc(total), *p = buf;
+            for (int i = 0; i < client->latestCount; i++) {
+                memcpy(p, client->latest[i].data, client->latest[i].len);
+                p += client->latest[i].len;
+                free(client->latest[i].data);
+            }
+            client->latestCount = 0;
+            client->flushing = 1;
+            pthread_mutex_unlock(&client->latestLock);
+            psio_charge(fd, -total);
+            psio_send(fd, buf, total);
+            free(buf);
+            pthread_mutex_lock(&client->latestLock);
+        }
+        client->flushing = 0;
+        pthread_mutex_unlock(&client->latestLock);
+        pthread_mutex_unlock(&client->sendLock);
+    }
+    psepoch_exit();
+}
+
+// **********************************************************************
+// Throw away anything held back for a client on a topic it no longer
+// has a sublatest subscription to
+// **********************************************************************
+void drop_latest(ClientData *client, Topic *topic) {
+    pthread_mutex_lock(&client->latestLock);
+    for (int i = 0; i < client->latestCount; i++) {
+        if (client->latest[i].topic == topic) {
+            psio_charge(client->sockfd, -client->latest[i].len);
+            free(client->latest[i].data);
+            client->latest[i] = client->latest[--client->latestCount];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client->latestLock);
+}
+
+// **********************************************************************
+// Search topic tree and find clients that need to receive the message.
+// It then sends the message to all these clients, each in the protocol
+// it speaks. A linked server with subscribers gets it once, as a MSG
+// frame, unless localOnly is set because it came over a link.
+// **********************************************************************
+void publish_msg(char *sentBy, char *topic, char *msg, int msgLen,
+        int localOnly) {
+    Topic *pubTopic = find_topic(topic);
+    if (pubTopic != NULL) {
+        publish_topic(pubTopic, sentBy, msg, msgLen, localOnly);
+    }
+}
+
+// **********************************************************************
+// publish_msg() for a topic already looked up
+// **********************************************************************
+void publish_topic(Topic *pubTopic, char *sentBy, char *msg, int msgLen,
+        int localOnly) {
+    ClientData *clientData;
+    char *topic = pubTopic->name;
+    int cliLen = strlen(sentBy), topicLen = pubTopic->nameLen;
+    psepoch_enter();
+    publish_latest(pubTopic, sentBy, cliLen, topic, topicLen, msg, msgLen);
+    SubList *subs = topic_subs(&pubTopic->subs);
+    for (int i = 0; subs != NULL && i < subs->count; i++) {
+        clientData = subs->clients[i];
+        if ((localOnly && clientData->peer) || lock_client(clientData)) {
+            continue;
+        }
+        form_and_send_msg(clientData->sockfd, clientData->binary,
+                sentBy, cliLen, topic, topicLen, msg, msgLen);
+        pthread_mutex_unlock(&clientData->sendLock);
+        psstats_delivered();
+    }
+    psepoch_exit();
+}
+
+// **********************************************************************
+// Start a batch of publishes from the client on this connection
+// **********************************************************************
+PubBatch *batch_init(Connection *conn) {
+    PubBatch *batch = calloc(1, sizeof(PubBatch));
+    batch->named = (conn->client != NULL);
+    if (batch->named) {
+        strcpy(batch->sender, conn->client->name);
+    }
+    batch->indexSize = 64;
+    batch->index = calloc(batch->indexSize, sizeof(int));
+    batch->sockfd = conn->sockfd;
+    return batch;
+}
+
+// **********************************************************************
+// Slot in a batch's index to start looking for a client at
+// **********************************************************************
+int batch_slot(PubBatch *batch, ClientData *client) {
+    return ((uintptr_t) client / sizeof(ClientData))
+            & (batch->indexSize - 1);
+}
+
+// **********************************************************************
+// Find (or add) the delivery buffer for a subscriber in a batch
+// **********************************************************************
+BatchOut *batch_out(PubBatch *batch, ClientData *client) {
+    if ((batch->count + 1) * 2 > batch->indexSize) {
+        // grow the index and rehash every subscriber seen so far
+        free(batch->index);
+        batch->indexSize *= 2;
+        batch->index = calloc(batch->indexSize, sizeof(int));
+        for (int i = 0; i < batch->count; i++) {
+            int slot = batch_slot(batch, batch->outs[i].client);
+            while (batch->index[slot] != 0) {
+                slot = (slot + 1) & (batch->indexSize - 1);
+            }
+            batch->index[slot] = i + 1;
+        }
+    }
+    int slot = batch_slot(batch, client);
+    while (batch->index[slot] != 0) {
+        BatchOut *out = &batch->outs[batch->index[slot] - 1];
+        if (out->client == client) {
+            return out;
+        }
+        slot = (slot + 1) & (batch->indexSize - 1);
+    }
+    if (batch->count == batch->cap) {
+        batch->cap = batch->cap ? batch->cap * 2 : 16;
+        batch->outs = realloc(batch->outs, sizeof(BatchOut) * batch->cap);
+    }
+    BatchOut *out = &batch->outs[batch->count++];
+    out->client = client;
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+    batch->index[slot] = batch->count;
+    return out;
+}
+
+// **********************************************************************
+// Append one delivery, formatted for the subscriber's protocol, to its
+// batch buffer
+// **********************************************************************
+void batch_append(BatchOut *out, int binary, char *sentBy, int sentByLen,
+        char *topic, int topicLen, char *msg, int msgLen) {
+    int len = sentByLen + topicLen + msgLen
+            + (binary ? PSPROTO_HEADER_LEN : 3);
+    if (out->len + len > out->cap) {
+        out->cap = out->cap ? out->cap * 2 : 1024;
+        while (out->cap < out->len + len) {
+            out->cap *= 2;
+        }
+        out->data = realloc(out->data, out->cap);
+    }
+    char *p = out->data + out->len;
+    if (binary) {
+        psproto_encode((unsigned char*) p, PS_OP_MSG, sentByLen, topicLen,
+                msgLen);
+        p += PSPROTO_HEADER_LEN;
+    }
+    memcpy(p, sentBy, sentByLen);
+    p += sentByLen;
+    if (!binary) {
+        *p++ = ':';
+    }
+    memcpy(p, topic, topicLen);
+    p += topicLen;
+    if (!binary) {
+        *p++ = ':';
+    }
+    memcpy(p, msg, msgLen);
+    p += msgLen;
+    if (!binary) {
+        *p++ = '\n';
+    }
+    out->len += len;
+}
+
+// **********************************************************************
+// Add one publish to a batch: log it and queue the message for each
+// subscriber of pubTopic (NULL if it has none)
+// **********************************************************************
+void batch_pub(PubBatch *batch, Topic *pubTopic, char *topic, char *msg,
+        int msgLen) {
+    ClientData *clientData;
+    if (!batch->named) {
+        return;
+    }
+    psstats_count(PS_STAT_PUB, 1);
+    if (pubLog != NULL) {
+        pslog_append(pubLog, batch->sender, topic, msg, msgLen);
+    }
+    int cliLen = strlen(batch->sender), topicLen = strlen(topic);
+    if (pubTopic == NULL) {
+        return;
+    }
+    if (!batch->reading) { // left by batch_send()
+        psepoch_enter();
+        batch->reading = 1;
+    }
+    publish_latest(pubTopic, batch->sender, cliLen, topic, topicLen, msg,
+            msgLen);
+    SubList *subs = topic_subs(&pubTopic->subs);
+    long added = 0;
+    for (int i = 0; subs != NULL && i < subs->count; i++) {
+        clientData = subs->clients[i];
+        BatchOut *out = batch_out(batch, clientData);
+        int before = out->len;
+        batch_append(out, clientData->binary, batch->sender, cliLen,
+                topic, topicLen, msg, msgLen);
+        added += out->len - before;
+    }
+    batch->bytes += added;
+    if (added > 0 && psio_charge(batch->sockfd, added) != 0) {
+        batch_send(batch); // too big to hold: send what there is now
+    }
+}
+
+// **********************************************************************
+// Send every subscriber its combined deliveries and empty the batch
+// **********************************************************************
+void batch_send(PubBatch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        ClientData *client = batch->outs[i].client;
+        if (lock_client(client) == 0) {
+            deliver(client->sockfd, batch->outs[i].data,
+                    batch->outs[i].len);
+            pthread_mutex_unlock(&client->sendLock);
+            psstats_delivered();
+        }
+        free(batch->outs[i].data);
+    }
+    if (batch->reading) {
+        psepoch_exit();
+        batch->reading = 0;
+    }
+    batch->count = 0;
+    memset(batch->index, 0, batch->indexSize * sizeof(int));
+    psio_charge(batch->sockfd, -batch->bytes);
+    batch->bytes = 0;
+}
+
+// **********************************************************************
+// Send every subscriber its combined deliveries and free the batch
+// **********************************************************************
+void batch_flush(PubBatch *batch) {
+    batch_send(batch);
+    free(batch->outs);
+    free(batch->index);
+    free(batch);
+}
+
+// **********************************************************************
+// Process pubbatch message from client. "pubbatch N" is followed by N
+// lines of the form "topic message", which are published together once
+// the last one arrives, or as far as they have arrived when a read ends
+// part way through the batch. Invalid if N is not a number from 1 to
+// MAX_BATCH.
+// **********************************************************************
+void process_pubbatch(Connection *conn, char *command) {
+    char retStr[1024];
+    memset(retStr, '\0', 1023);
+    if (get_token(command, 3, retStr) == 0
+            || get_token(command, 2, retStr) != 0
+            || is_numeric(retStr) || strlen(retStr) > 5
+            || atoi(retStr) < 1 || atoi(retStr) > MAX_BATCH) {
+        send_invalid(conn);
+        return;
+    }
+    conn->batch = batch_init(conn);
+    conn->batchLeft = atoi(retStr);
+}
+
+// **********************************************************************
+// Process one "topic message" line of a text pubbatch. Bad lines are
+// answered with an invalid response and left out of the batch.
+// **********************************************************************
+void pubbatch_line(Connection *conn, char *line) {
+    char topic[MAX_NAME_LEN], *msgSt;
+    Topic *pubTopic = NULL;
+    char *command = malloc(strlen(line) + 5);
+    sprintf(command, "pub %s", line);
+    if (parse_pub(command, topic, &msgSt) != 0
+            || rate_limit(conn, pubTopic = cached_topic(conn, topic), 1)
+            != 0) {
+        send_invalid(conn);
+    } else {
+        batch_pub(conn->batch, pubTopic, topic, msgSt, strlen(msgSt));
+    }
+    free(command);
+    if (--conn->batchLeft == 0) {
+        batch_flush(conn->batch);
+        conn->batch = NULL;
+    }
+}
+
+// **********************************************************************
+// Route a text line either into the pubbatch being collected or to the
+// normal command handling
+// **********************************************************************
+void dispatch_line(Connection *conn, char *line) {
+    if (strcmp(line, "shmack") == 0) { // may arrive in the middle of a batch
+        process_shmack(conn);
+    } else if (conn->batchLeft > 0) {
+        pubbatch_line(conn, line);
+    } else {
+        handle_command(conn, line);
+    }
+}
+
+// **********************************************************************
+// Process a binary PUBBATCH frame. Its payload is a run of records, each
+// a 2 byte topic length and 4 byte message length (network order)
+// followed by the topic and message. Invalid if a record overruns the
+// payload or has a bad topic; records before it are still published.
+// Records over a rate limit with PSSERVER_RATE_ACTION reject are left
+// out and answered with an invalid response each.
+// **********************************************************************
+void process_pubbatch_frame(Connection *conn, char *payload, uint32_t len) {
+    PubBatch *batch = batch_init(conn);
+    char topic[MAX_NAME_LEN];
+    uint32_t off = 0;
+    int bad = 0, rejected = 0;
+    while (off < len) {
+        uint16_t topicLen;
+        uint32_t msgLen;
+        if (len - off < 6) {
+            bad = 1;
+            break;
+        }
+        memcpy(&topicLen, payload + off, 2);
+        memcpy(&msgLen, payload + off + 2, 4);
+        topicLen = ntohs(topicLen);
+        msgLen = ntohl(msgLen);
+        off += 6;
+        if (topicLen > len - off || msgLen > len - off - topicLen
+                || frame_name(payload + off, topicLen, topic) != 0
+                || reserved_name(topic)) {
+            bad = 1;
+            break;
+        }
+        Topic *pubTopic = cached_topic(conn, topic);
+        if (rate_limit(conn, pubTopic, 1) != 0) {
+            rejected++;
+        } else {
+            batch_pub(batch, pubTopic, topic, payload + off + topicLen,
+                    msgLen);
+        }
+        off += topicLen + msgLen;
+    }
+    batch_flush(batch);
+    for (int i = 0; i < rejected + bad; i++) {
+        send_invalid(conn);
+    }
+}
+
+// **********************************************************************
+// Process a binary TOPICID frame: give the client the id of a topic so
+// it can publish to it with PUBID frames. The topic is added if nobody
+// has subscribed to it yet, as ids are only given to topics that exist.
+// Topics are never freed, so one added here is charged to the connection
+// for as long as it is open, and a connection may add at most
+// TOPICID_ADD_MAX. Invalid if it is over either limit.
+// **********************************************************************
+void process_topicid(Connection *conn, char *topic) {
+    if (conn->client == NULL) {
+        send_invalid(conn);
+        return;
+    }
+    Topic *found = find_topic(topic);
+    if (found == NULL) {
+        if (conn->topicsAdded == TOPICID_ADD_MAX
+                || psio_charge(conn->sockfd, sizeof(Topic)) != 0) {
+            if (conn->topicsAdded < TOPICID_ADD_MAX) {
+                psio_charge(conn->sockfd, -(long) sizeof(Topic));
+            }
+            send_invalid(conn);
+            return;
+        }
+        conn->topicsAdded++;
+        found = get_topic(topic);
+    }
+    uint32_t id = htonl(found->id);
+    send_frame(conn->sockfd, PS_OP_TOPICID, "", 0, found->name,
+            found->nameLen, (char*) &id, 4);
+}
+
+// **********************************************************************
+// Process a binary PUBID frame, a publish whose payload starts with the
+// 4 byte id of its topic. Invalid if no topic has that id, or if it is
+// one of the server's own topics, which clients may not publish to.
+// **********************************************************************
+void process_pubid(Connection *conn, char *payload, uint32_t len) {
+    uint32_t id;
+    memcpy(&id, payload, 4);
+    Topic *pubTopic = topic_by_id(ntohl(id));
+    if (pubTopic == NULL || reserved_name(pubTopic->name)
+            || conn->client == NULL) {
+        send_invalid(conn);
+        return;
+    }
+    do_pub(conn, pubTopic, pubTopic->name, payload + 4, len - 4);
+}
+
+// Topic being replayed and the client asking for it
+typedef struct ReplayData {
+    Connection *conn;
+    char *topic;
+} ReplayData;
+
+// **********************************************************************
+// Called for every record in the publish log. Records for the requested
+// topic are sent to the client in the same form as a live message.
+// **********************************************************************
+void replay_record(void *arg, uint64_t seq, char *sentBy, int sentByLen,
+        char *topic, int topicLen, char *msg, int msgLen) {
+    ReplayData *replay = (ReplayData*) arg;
+    if (topicLen != strlen(replay->topic)
+            || strncmp(topic, replay->topic, topicLen) != 0) {
+        return;
+    }
+    form_and_send_msg(replay->conn->sockfd,
+            replay->conn->mode == MODE_BINARY, sentBy, sentByLen,
+            topic, topicLen, msg, msgLen);
+}
+
+// **********************************************************************
+// Process replay message from client. Every logged message for the
+// topic, optionally starting from a sequence number, is read back from
+// the publish log and sent to the client. Invalid if persistence is off
+// or name command was not received till this point.
+// **********************************************************************
+void process_replay(Connection *conn, char *command) {
+    char retStr[1024], topic[MAX_NAME_LEN];
     memset(retStr, '\0', 1023);
-    retCd = get_token(command, 3, retStr);
+    uint64_t fromSeq = 0;
+    if (get_token(command, 4, retStr) == 0) { // 4th argument. invalid
+        send_invalid(conn);
+        return;
+    }
+    int retCd = get_token(command, 3, retStr);
     if (retCd == 0) {
-    } else {
-        send_msg(sockfd, ":invalid");
+        if (is_numeric(retStr)) {
+            send_invalid(conn);
+            return;
+        }
+        fromSeq = strtoull(retStr, NULL, 10);
+    }
+    retCd = get_token(command, 2, retStr);
+    if (retCd == 1 || valid_name(retStr) == 1
+            || strlen(retStr) >= MAX_NAME_LEN || pubLog == NULL) {
+        send_invalid(conn);
         return;
     }
-    msgSt = strstr(command, retStr);
-    remMsg = malloc(strlen(msgSt) + 2);
-    strcpy(remMsg, msgSt);
-    retCd = get_client_name(sockfd, cliName);
-    if (retCd == -1) { // if we have not received name
-                  // earlier, then ignore command
+    strcpy(topic, retStr);
+    if (conn->client == NULL) {
         return;
     }
-    statsData->pubCount++;
-    get_client_name(sockfd, cliName);
-    subCliRoot = (StringMap*) stringmap_search(topicRoot, topic);
+    ReplayData replay = {conn, topic};
+    pslog_replay(pubLog, fromSeq, replay_record, &replay);
+}
+
+// **********************************************************************
+// Copy a name or topic field of a binary frame into out. Returns -1 if
+// it is empty, too long or not a valid name.
+// **********************************************************************
+int frame_name(char *field, int len, char *out) {
+    if (len <= 0 || len >= MAX_NAME_LEN) {
+        return -1;
+    }
+    memcpy(out, field, len);
+    out[len] = '\0';
+    return valid_name(out) ? -1 : 0;
+}
+
+// **********************************************************************
+// Send a link every topic this server has local subscribers for, so the
+// other end knows what to forward from the start
+// **********************************************************************
+void send_all_interest(ClientData *link) {
+    StringMap *currNode;
+    Topic *topic;
+    pthread_rwlock_rdlock(&topicLock);
     currNode = NULL;
-    currNode = stringmap_iterate(subCliRoot, currNode);
-    while (currNode != NULL){
-        strcpy(toSendCli, currNode->key);
-        clientData = stringmap_search(clientRoot,toSendCli);
-        if (clientData == NULL){
+    do {
+        currNode = stringmap_iterate(topicRoot, currNode);
+        if (currNode != NULL) {
+            topic = (Topic*) currNode->item;
+            pthread_mutex_lock(&topic->lock);
+            if (topic->localCount > 0 && !reserved_name(topic->name)) {
+                send_frame(link->sockfd, PS_OP_SUB, "", 0, topic->name,
+                        strlen(topic->name), "", 0);
+            }
+            pthread_mutex_unlock(&topic->lock);
+        }
+    } while (currNode != NULL);
+    pthread_rwlock_unlock(&topicLock);
+}
+
+// **********************************************************************
+// Mark the configured peer dialled on sockfd as needing no link of our
+// own. Called with linkLock held.
+// **********************************************************************
+void peer_covered(int sockfd) {
+    for (int i = 0; i < peerCount; i++) {
+        if (peers[i].fd == sockfd) {
+            peers[i].fd = PEER_COVERED;
+        }
+    }
+}
+
+// **********************************************************************
+// Process PEER frame: the other end of this connection is the server
+// with the given id, so it becomes a link. If the two servers already
+// have a link (both were told to dial the other) the one dialled by the
+// server with the smaller id is kept, which both ends agree on, and the
+// other is shut down.
+// **********************************************************************
+void peer_link(Connection *conn, char *id) {
+    if (conn->client != NULL) {
+        send_invalid(conn);
+        return;
+    }
+    if (!conn->dialed) {
+        send_frame(conn->sockfd, PS_OP_PEER, serverId, strlen(serverId),
+                "", 0, "", 0);
+    }
+    pthread_mutex_lock(&linkLock);
+    if (strcmp(id, serverId) == 0) { // dialled ourselves
+        peer_covered(conn->sockfd);
+        pthread_mutex_unlock(&linkLock);
+        shutdown(conn->sockfd, SHUT_RDWR);
+        return;
+    }
+    ClientData *link = calloc(1, sizeof(ClientData));
+    link->sockfd = conn->sockfd;
+    link->binary = 1;
+    link->peer = 1;
+    link->dialed = conn->dialed;
+    pthread_mutex_init(&link->latestLock, NULL);
+    pthread_mutex_init(&link->sendLock, NULL);
+    strcpy(link->name, id);
+    for (int i = 0; i < linkCount; i++) {
+        if (strcmp(links[i]->name, id) != 0) {
             continue;
         }
-        form_and_send_msg(clientData->sockfd, cliName, topic, remMsg);
-        currNode = stringmap_iterate(subCliRoot,currNode);
+        ClientData *old = links[i];
+        int keepOurs = strcmp(serverId, id) < 0;
+        ClientData *drop = (link->dialed == keepOurs) ? old : link;
+        if (drop->dialed) {
+            peer_covered(drop->sockfd);
+        }
+        if (drop == link) {
+            pthread_mutex_unlock(&linkLock);
+            free(link);
+            shutdown(conn->sockfd, SHUT_RDWR);
+            return;
+        }
+        links[i] = links[--linkCount];
+        shutdown(old->sockfd, SHUT_RDWR);
+        break;
+    }
+    if (linkCount == linkCap) {
+        linkCap = linkCap ? linkCap * 2 : 4;
+        links = realloc(links, sizeof(ClientData*) * linkCap);
+    }
+    links[linkCount++] = link;
+    conn->client = link;
+    pthread_mutex_unlock(&linkLock);
+    send_all_interest(link);
+}
+
+// **********************************************************************
+// Process a frame from a linked server. SUB and UNSUB add or remove the
+// link as a subscriber of the topic, and MSG is a publish delivered to
+// this server's own subscribers. A link is another server rather than a
+// person, so anything else is dropped rather than answered.
+// **********************************************************************
+void handle_peer_frame(Connection *conn, PsFrame *frame, char *body) {
+    char name[MAX_NAME_LEN], topic[MAX_NAME_LEN];
+    char *topicPtr = body + frame->nameLen;
+    char *payload = topicPtr + frame->topicLen;
+    if (frame_name(topicPtr, frame->topicLen, topic) != 0
+            || reserved_name(topic)) {
+        return;
+    }
+    switch (frame->opcode) {
+        case PS_OP_SUB:
+            do_sub(conn, topic, 0);
+            break;
+        case PS_OP_UNSUB:
+            do_unsub(conn, topic);
+            break;
+        case PS_OP_MSG:
+            if (frame_name(body, frame->nameLen, name) == 0) {
+                publish_msg(name, topic, payload, frame->payloadLen, 1);
+            }
+            break;
+    }
+}
+
+// **********************************************************************
+// Process one binary frame. The header has already been bounds checked
+// against the received data, so fields are used in place without
+// scanning the payload.
+// **********************************************************************
+void handle_frame(Connection *conn, PsFrame *frame, char *body) {
+    char name[MAX_NAME_LEN], topic[MAX_NAME_LEN];
+    char *topicPtr = body + frame->nameLen;
+    char *payload = topicPtr + frame->topicLen;
+    if (frame->opcode == PS_OP_PING) {
+        send_frame(conn->sockfd, PS_OP_PONG, "", 0, "", 0, "", 0);
+        return;
+    }
+    if (frame->opcode == PS_OP_PONG) {
+        return;
+    }
+    if (conn->client != NULL && conn->client->peer) {
+        handle_peer_frame(conn, frame, body);
+        return;
+    }
+    switch (frame->opcode) {
+        case PS_OP_NAME:
+            if (frame_name(body, frame->nameLen, name) == 0
+                    && frame->topicLen == 0 && frame->payloadLen == 0) {
+                do_name(conn, name);
+                return;
+            }
+            break;
+        case PS_OP_SUB:
+            if (frame->nameLen == 0 && frame->payloadLen == 0
+                    && frame->topicLen > 0) {
+                // topic field may list several topics split by spaces
+                char *command = malloc(frame->topicLen + 5);
+                sprintf(command, "sub %.*s", frame->topicLen, topicPtr);
+                process_sub(conn, command, 0);
+                free(command);
+                return;
+            }
+            break;
+        case PS_OP_UNSUB:
+            if (frame_name(topicPtr, frame->topicLen, topic) == 0
+                    && frame->nameLen == 0 && frame->payloadLen == 0) {
+                do_unsub(conn, topic);
+                return;
+            }
+            break;
+        case PS_OP_PUB:
+            if (frame_name(topicPtr, frame->topicLen, topic) == 0
+                    && !reserved_name(topic) && frame->nameLen == 0
+                    && frame->payloadLen > 0) {
+                do_pub(conn, cached_topic(conn, topic), topic, payload,
+                        frame->payloadLen);
+                return;
+            }
+            break;
+        case PS_OP_TOPICID:
+            if (frame_name(topicPtr, frame->topicLen, topic) == 0
+                    && !reserved_name(topic) && frame->nameLen == 0
+                    && frame->payloadLen == 0) {
+                process_topicid(conn, topic);
+                return;
+            }
+            break;
+        case PS_OP_PUBID:
+            if (frame->nameLen == 0 && frame->topicLen == 0
+                    && frame->payloadLen > 4) {
+                process_pubid(conn, payload, frame->payloadLen);
+                return;
+            }
+            break;
+        case PS_OP_PUBBATCH:
+            if (frame->nameLen == 0 && frame->topicLen == 0) {
+                process_pubbatch_frame(conn, payload, frame->payloadLen);
+                return;
+            }
+            break;
+        case PS_OP_PEER:
+            if (frame_name(body, frame->nameLen, name) == 0
+                    && frame->topicLen == 0 && frame->payloadLen == 0) {
+                peer_link(conn, name);
+                return;
+            }
+            break;
+        case PS_OP_TEXT:
+            if (frame->nameLen == 0 && frame->topicLen == 0) {
+                char *command = malloc(frame->payloadLen + 1);
+                memcpy(command, payload, frame->payloadLen);
+                command[frame->payloadLen] = '\0';
+                dispatch_line(conn, command);
+                free(command);
+                return;
+            }
+            break;
     }
-    free(remMsg);
+    send_invalid(conn);
 }
 
 // **********************************************************************
@@ -594,23 +2743,24 @@ void process_pub(int sockfd, char *command) {
 // this topic
 // **********************************************************************
 void print_topic_tree(){
-    StringMap *currNode, *cliNode, *subCliRoot;
+    StringMap *currNode;
+    Topic *topic;
     printf("************************** topics list start ***********\n");
+    pthread_rwlock_rdlock(&topicLock);
     currNode =NULL;
     do {
         currNode = stringmap_iterate(topicRoot,currNode);
         if (currNode != NULL){
             printf("topic=%s=\n",currNode->key);
-            subCliRoot = (StringMap*) currNode->item;
-            cliNode = NULL;
-            do {
-                cliNode = stringmap_iterate(subCliRoot,cliNode);
-                if (cliNode != NULL){
-                    printf("\t\tclient=%s=\n",cliNode->key);
-                }
-            } while (cliNode != NULL);
+            topic = (Topic*) currNode->item;
+            pthread_mutex_lock(&topic->lock);
+            for (int i = 0; topic->subs && i < topic->subs->count; i++) {
+                printf("\t\tclient=%s=\n",topic->subs->clients[i]->name);
+            }
+            pthread_mutex_unlock(&topic->lock);
         }
     } while (currNode != NULL);
+    pthread_rwlock_unlock(&topicLock);
     printf("************************** topics list end    ***********\n");
 }
 
@@ -624,6 +2774,7 @@ void print_topic_tree(){
 void print_names_only(){
     StringMap *currNode;
     printf("************************** clients list start ***********\n");
+    pthread_rwlock_rdlock(&clientLock);
     currNode = NULL;
     do {
         currNode = stringmap_iterate(clientRoot,currNode);
@@ -631,6 +2782,7 @@ void print_names_only(){
             printf("client =%s=\n",currNode->key);
         }
     } while (currNode != NULL);
+    pthread_rwlock_unlock(&clientLock);
     printf("************************** clients list end    ***********\n");
 
 }
@@ -643,6 +2795,7 @@ void print_client_tree(){
     ClientData *cliData;
     MsgData *msgData;
     printf("************************** clients tree start ***********\n");
+    pthread_rwlock_rdlock(&clientLock);
     currNode = NULL;
     currNode = stringmap_iterate(clientRoot, currNode);
     while (currNode != NULL){
@@ -658,6 +2811,7 @@ void print_client_tree(){
         }
         currNode = stringmap_iterate(clientRoot,currNode);
     }
+    pthread_rwlock_unlock(&clientLock);
     printf("************************** clients list end    ***********\n");
 }
 
@@ -668,7 +2822,7 @@ int init_socket(int port) {
     int err = 0;
     struct sockaddr_in hostAddr;
     hostAddr.sin_family = AF_INET;
-    hostAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    hostAddr.sin_addr.s_addr = inet_addr(config.bindAddr);
     memset(&(hostAddr.sin_zero), '\0', 8);
     hostAddr.sin_port = htons(port);
 
@@ -702,111 +2856,418 @@ int init_socket(int port) {
 } // This function creates socket and binds it to port
 
 // **********************************************************************
-// Form the message to be sent and initiate sending message.
+// Create a Unix domain socket bound to path for clients on this host. A
+// socket file left behind by an earlier server is replaced.
+// **********************************************************************
+int init_unix_socket(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "psserver: unix socket path too long\n");
+        exit(2);
+    }
+    strcpy(addr.sun_path, path);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (sockfd < 0 || bind(sockfd, (struct sockaddr *)&addr,
+            sizeof(addr)) != 0) {
+        fprintf(stderr, "psserver: unable to open socket for listening\n");
+        fflush(stderr);
+        exit(2);
+    }
+    return sockfd;
+}
+
+// **********************************************************************
+// Form the message to be sent and initiate sending message. Binary
+// clients get a MSG frame, text clients a "name:topic:message" line.
 // **********************************************************************
-void form_and_send_msg(int sockfd, char *sentBy, char *topic, char *msg){
-    char *formatedMsg;
-    formatedMsg = malloc(strlen(sentBy)
-            + strlen(topic)
-            + strlen(msg)
-            + 5); //for :'s and other chars
-    sprintf(formatedMsg, "%s:%s:%s", sentBy
-            , topic, msg);
-    send_msg(sockfd, formatedMsg);
-    free(formatedMsg);
+void form_and_send_msg(int sockfd, int binary, char *sentBy, int sentByLen,
+        char *topic, int topicLen, char *msg, int msgLen){
+    // the message goes out from where it was received, with the fields
+    // around it as separate pieces, so it is never copied here
+    unsigned char header[PSPROTO_HEADER_LEN];
+    struct iovec iov[6];
+    int n = 0;
+    if (binary) {
+        psproto_encode(header, PS_OP_MSG, sentByLen, topicLen, msgLen);
+        iov[n++] = (struct iovec) {header, PSPROTO_HEADER_LEN};
+        iov[n++] = (struct iovec) {sentBy, sentByLen};
+        iov[n++] = (struct iovec) {topic, topicLen};
+        iov[n++] = (struct iovec) {msg, msgLen};
+    } else {
+        iov[n++] = (struct iovec) {sentBy, sentByLen};
+        iov[n++] = (struct iovec) {":", 1};
+        iov[n++] = (struct iovec) {topic, topicLen};
+        iov[n++] = (struct iovec) {":", 1};
+        iov[n++] = (struct iovec) {msg, msgLen};
+        iov[n++] = (struct iovec) {"\n", 1};
+    }
+    deliverv(sockfd, iov, n);
 }
 
 // **********************************************************************
-// Once client disconnects, all data related to client is removed from 
-// all topic related Data Structures
+// Once client disconnects, it is removed from the subscribers of every
+// topic it is subscribed to
 // **********************************************************************
-void remove_client_from_topic_tree(char *topic, char *cliName){
-    StringMap *currNode, *subCliRoot;
-    char *item;
-    currNode =NULL;
-    currNode = stringmap_iterate(topicRoot, currNode);
-    while (currNode != NULL){
-        subCliRoot = (StringMap*) currNode->item;
-        item = (char*) stringmap_search(subCliRoot, cliName);
-        if (item != NULL){
-            free(item);
-            stringmap_remove(subCliRoot, cliName);
+void remove_client_from_topic_tree(ClientData *client){
+    for (int i = 0; i < client->topicCount; i++) {
+        Topic *topic = client->topics[i];
+        pthread_mutex_lock(&topic->lock);
+        if (change_subs(&topic->subs, client, 1) != 0) {
+            change_subs(&topic->latest, client, 1);
         }
-        currNode = stringmap_iterate(topicRoot,currNode);
+        local_interest(topic, client, -1);
+        pthread_mutex_unlock(&topic->lock);
+        psstats_count(PS_STAT_SUBSCRIPTIONS, -1);
     }
+    client->topicCount = 0;
 }
 
 // **********************************************************************
 // Once client disconnects, all data related to client is removed from 
 // all client related Data Structures
 // **********************************************************************
-void remove_client_from_client_tree(char *cliName){
-    ClientData *item;
-    item = (ClientData*) stringmap_search(clientRoot, cliName);
-    if (item != NULL){
-        stringmap_free(item->msgRoot);
-        //free(item->msgRoot);
-        //free(item);
-        stringmap_remove(clientRoot, cliName);
+void remove_client_from_client_tree(ClientData *client){
+    pthread_rwlock_wrlock(&clientLock);
+    stringmap_remove(clientRoot, client->name);
+    pthread_rwlock_unlock(&clientLock);
+    psstats_count(PS_STAT_NAMES, -1);
+}
+
+// **********************************************************************
+// Lock a client for sending to it. Returns 0 with sendLock held, or -1
+// if it has closed, as a publisher that loaded it earlier still can.
+// **********************************************************************
+int lock_client(ClientData *client) {
+    pthread_mutex_lock(&client->sendLock);
+    if (client->closed) {
+        pthread_mutex_unlock(&client->sendLock);
+        return -1;
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Mark a client closed. Once this returns nobody is sending to its fd,
+// so the I/O layer can close it and have the number reused.
+// **********************************************************************
+void close_client(ClientData *client) {
+    pthread_mutex_lock(&client->sendLock);
+    pthread_mutex_lock(&client->latestLock);
+    client->closed = 1;
+    pthread_mutex_unlock(&client->latestLock);
+    pthread_mutex_unlock(&client->sendLock);
+}
+
+// **********************************************************************
+// Free a client or link retired with psepoch_retire()
+// **********************************************************************
+void free_client(void *ptr) {
+    ClientData *client = ptr;
+    stringmap_free(client->msgRoot);
+    for (int i = 0; i < client->latestCount; i++) {
+        free(client->latest[i].data);
     }
+    free(client->latest);
+    pthread_mutex_destroy(&client->latestLock);
+    pthread_mutex_destroy(&client->sendLock);
+    free(client->topics);
+    free(client);
 }
 
 // **********************************************************************
 // Once client disconnects, all data related to client is removed from 
-// all Data Structures
+// all Data Structures. Publishers may still hold it, so it is retired
+// rather than freed, and they skip it as closed.
 // **********************************************************************
-void remove_client_from_ds(char *cliName){
-    StringMap *currNode;
+void remove_client_from_ds(ClientData *client){
     //print_topic_tree();
-    currNode =NULL;
-    currNode = stringmap_iterate(topicRoot, currNode);
-    while (currNode != NULL){
-        remove_client_from_topic_tree(currNode->key, cliName);
-        currNode = stringmap_iterate(topicRoot,currNode);
-    }
+    remove_client_from_topic_tree(client);
     //print_topic_tree();
     //print_client_tree();
-    remove_client_from_client_tree(cliName);
+    remove_client_from_client_tree(client);
     //print_client_tree();
+    if (client->sockfd < shmClientsSize) {
+        __atomic_store_n(&fdClients[client->sockfd], NULL, __ATOMIC_RELEASE);
+    }
+    close_client(client);
+    psepoch_retire(client, free_client);
 }
 
 // **********************************************************************
-// After establishing connection, a thread is initiated and this funtion
-// is called. This function keeps receiving data from that particular
-// client and keeps processing each command.
+// A link to another server has closed: take it off the topics it was
+// subscribed to and retire it, as remove_client_from_ds() does. A
+// configured peer that was dialled on it is tried again on a later tick.
 // **********************************************************************
-void *handle_connection(void *socketPtr) {
-    int sockfd = *((int *)(socketPtr));
-    char request[512], *buffer, cliName[30];
-    int length, lastLength = 0;
+void remove_link(ClientData *link) {
+    pthread_mutex_lock(&linkLock);
+    for (int i = 0; i < linkCount; i++) {
+        if (links[i] == link) {
+            links[i] = links[--linkCount];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&linkLock);
+    remove_client_from_topic_tree(link);
+    close_client(link);
+    psepoch_retire(link, free_client);
+}
 
-    do {
-        length = recv(sockfd, &request, 512, 0);
-        request[length] = '\0';
-        if (length != lastLength) {
-            int k = 0, m;
-            for (m = 0; m < strlen(request); m++) {
-                if (request[m] == '\n') {
-                    buffer = (char *)malloc(64);
-                    strncpy(buffer, request + k, m - k);
-                    buffer[m - k] = '\0';
-                    k = m + 1;
-                    handle_command(sockfd, buffer);
-                    free(buffer);
-                }
-            }
-            if (k < m) {
-                handle_command(sockfd, request + k);
+// **********************************************************************
+// A connection closed: if it was dialled to a configured peer, let the
+// peer be dialled again
+// **********************************************************************
+void forget_dial(int sockfd) {
+    pthread_mutex_lock(&linkLock);
+    for (int i = 0; i < peerCount; i++) {
+        if (peers[i].fd == sockfd) {
+            peers[i].fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&linkLock);
+}
+
+// **********************************************************************
+// Called by the I/O layer for each accepted connection. Returns the
+// state handed back to handle_connection() and close_connection().
+// **********************************************************************
+void *open_connection(int sockfd) {
+    Connection *conn = malloc(sizeof(Connection));
+    conn->sockfd = sockfd;
+    conn->mode = MODE_UNKNOWN;
+    conn->pending = NULL;
+    conn->pendingLen = 0;
+    conn->pendingCap = 0;
+    conn->discard = 0;
+    conn->batch = NULL;
+    conn->batchLeft = 0;
+    conn->client = NULL;
+    conn->dialed = (sockfd == dialingFd);
+    pswheel_timer_init(&conn->idleTimer, idle_expired, conn);
+    conn->lastActive = now_ms();
+    conn->pingedAt = 0;
+    conn->inputCharged = 0;
+    conn->rateBucket = 0;
+    memset(conn->topicCache, 0, sizeof(conn->topicCache));
+    conn->topicsAdded = 0;
+    // links this server dialled are left out: a replay cannot stand in
+    // for the peer at the other end
+    conn->traceId = trace != NULL && !conn->dialed
+            ? pstrace_open_conn(trace) : 0;
+    if (idleTimers) {
+        pthread_mutex_lock(&wheelLock);
+        schedule_idle(conn);
+        pthread_mutex_unlock(&wheelLock);
+    }
+    psstats_count(PS_STAT_CONNECTED, 1);
+    return conn;
+}
+
+// **********************************************************************
+// Work out from the first bytes whether a connection is a binary client
+// (it sends the hello) or a text client. Returns 0 once decided.
+// **********************************************************************
+int negotiate_mode(Connection *conn) {
+    if ((unsigned char) conn->pending[0] != PSPROTO_MAGIC) {
+        conn->mode = MODE_TEXT;
+        return 0;
+    }
+    if (conn->pendingLen < PSPROTO_HELLO_LEN) {
+        return -1;
+    }
+    if (memcmp(conn->pending, PSPROTO_HELLO, PSPROTO_HELLO_LEN) != 0) {
+        conn->mode = MODE_TEXT; // will be answered with :invalid
+        return 0;
+    }
+    conn->mode = MODE_BINARY;
+    conn->pendingLen -= PSPROTO_HELLO_LEN;
+    memmove(conn->pending, conn->pending + PSPROTO_HELLO_LEN,
+            conn->pendingLen);
+    if (!conn->dialed) { // a peer we dialled is answering our hello
+        psio_send(conn->sockfd, (char*) PSPROTO_HELLO, PSPROTO_HELLO_LEN);
+    }
+    return 0;
+}
+
+// **********************************************************************
+// Process every complete frame in buf. Returns the number of bytes used.
+// **********************************************************************
+int handle_frames(Connection *conn, char *buf, int len) {
+    int k = 0;
+    while (len - k >= PSPROTO_HEADER_LEN) {
+        PsFrame frame;
+        psproto_decode((unsigned char*) buf + k, &frame);
+        if (frame.payloadLen > PSPROTO_MAX_PAYLOAD) {
+            send_invalid(conn);
+            conn->discard = psproto_frame_len(&frame);
+            int skip = len - k;
+            if (skip > conn->discard) {
+                skip = conn->discard;
             }
-            lastLength = length;
+            conn->discard -= skip;
+            k += skip;
+            continue;
+        }
+        int frameLen = psproto_frame_len(&frame);
+        if (len - k < frameLen) {
+            break;
         }
-    } while (length != 0);
+        psstats_command_begin();
+        handle_frame(conn, &frame, buf + k + PSPROTO_HEADER_LEN);
+        psstats_command_end();
+        k += frameLen;
+    }
+    return k;
+}
 
-    statsData->disconnCli++;
-    //remove disconnected client form clientsRoot
-    get_client_name(sockfd, cliName);
-    remove_client_from_ds(cliName);
-    pthread_exit(0);
-} // This function handles the requests from clients
+// **********************************************************************
+// Process every complete text command in buf, looking for line ends
+// from byte from on (the bytes before it are known to hold none).
+// Returns the number of bytes used.
+// **********************************************************************
+int handle_lines(Connection *conn, char *buf, int len, int from) {
+    int k = 0;
+    char *end;
+    while ((end = memchr(buf + from, '\n', len - from)) != NULL) {
+        *end = '\0';
+        psstats_command_begin();
+        dispatch_line(conn, buf + k);
+        psstats_command_end();
+        k = from = end - buf + 1;
+    }
+    return k;
+}
+
+// **********************************************************************
+// Process the complete commands in buf in the connection's protocol.
+// Returns the number of bytes used.
+// **********************************************************************
+int handle_input(Connection *conn, char *buf, int len, int from) {
+    if (conn->mode == MODE_BINARY) {
+        return handle_frames(conn, buf, len);
+    }
+    return handle_lines(conn, buf, len, from);
+}
 
+// **********************************************************************
+// Keep bytes that are not yet a whole command until the rest arrives
+// **********************************************************************
+void keep_input(Connection *conn, char *data, int length) {
+    if (conn->pendingLen + length + 1 > conn->pendingCap) {
+        int cap = conn->pendingCap ? conn->pendingCap : 256;
+        while (cap < conn->pendingLen + length + 1) {
+            cap *= 2;
+        }
+        conn->pending = realloc(conn->pending, cap);
+        conn->pendingCap = cap;
+    }
+    memcpy(conn->pending + conn->pendingLen, data, length);
+    conn->pendingLen += length;
+}
+
+// **********************************************************************
+// Charge a connection for the unfinished command it has sent. A client
+// whose unfinished input alone takes it over its limit is cut off.
+// **********************************************************************
+void charge_input(Connection *conn) {
+    long delta = conn->pendingLen - conn->inputCharged;
+    conn->inputCharged = conn->pendingLen;
+    if (delta > 0 && psio_charge(conn->sockfd, delta) == 1
+            && conn->pendingLen > config.clientBytes) {
+        send_invalid(conn);
+        psio_drop(conn->sockfd);
+        conn->pendingLen = 0; // never to be run, even when it closes
+    } else if (delta < 0) {
+        psio_charge(conn->sockfd, delta);
+    }
+}
+
+// **********************************************************************
+// Called by the I/O layer with data received from a client. Commands can
+// arrive split over several reads or many to one read, so any partial
+// command is kept until the rest of it arrives. Each complete command is
+// processed in turn.
+// **********************************************************************
+void handle_connection(void *connPtr, char *data, int length) {
+    Connection *conn = (Connection*) connPtr;
+    if (conn->traceId != 0) {
+        pstrace_record(trace, conn->traceId, data, length);
+    }
+    if (idleTimers) {
+        __atomic_store_n(&conn->lastActive, now_ms(), __ATOMIC_RELAXED);
+    }
+    if (conn->discard > 0) {
+        int skip = length < conn->discard ? length : conn->discard;
+        conn->discard -= skip;
+        data += skip;
+        length -= skip;
+    }
+    if (conn->pendingLen == 0 && conn->mode != MODE_UNKNOWN) {
+        // nothing held over, so commands are run straight out of the
+        // receive buffer and only an unfinished one is copied
+        int k = handle_input(conn, data, length, 0);
+        keep_input(conn, data + k, length - k);
+    } else {
+        int from = conn->mode == MODE_UNKNOWN ? 0 : conn->pendingLen;
+        keep_input(conn, data, length);
+        if (conn->mode == MODE_UNKNOWN && (conn->pendingLen == 0
+                || negotiate_mode(conn) != 0)) {
+            return;
+        }
+        int k = handle_input(conn, conn->pending, conn->pendingLen, from);
+        memmove(conn->pending, conn->pending + k, conn->pendingLen - k);
+        conn->pendingLen -= k;
+    }
+    if (conn->batch != NULL && conn->batch->reading) {
+        // the rest of the batch is still to come, but a read section
+        // left open between reads would hold up reclamation everywhere
+        batch_send(conn->batch);
+    }
+    if (conn->pendingLen == 0 && conn->pendingCap > KEEP_INPUT_CAP) {
+        free(conn->pending); // what a large message needed
+        conn->pending = NULL;
+        conn->pendingCap = 0;
+    }
+    charge_input(conn);
+} // This function handles the requests from clients
 
+// **********************************************************************
+// Called by the I/O layer once a client has disconnected. Any last
+// unterminated command is processed, then all data related to the
+// client is removed.
+// **********************************************************************
+void close_connection(void *connPtr) {
+    Connection *conn = (Connection*) connPtr;
+    if (conn->traceId != 0) {
+        pstrace_record(trace, conn->traceId, NULL, 0);
+    }
+    if (idleTimers) {
+        pthread_mutex_lock(&wheelLock);
+        pswheel_cancel(&conn->idleTimer);
+        pthread_mutex_unlock(&wheelLock);
+    }
+    if (conn->pendingLen > 0 && conn->mode == MODE_TEXT) {
+        conn->pending[conn->pendingLen] = '\0';
+        psstats_command_begin();
+        dispatch_line(conn, conn->pending);
+        psstats_command_end();
+    }
+    if (conn->batch != NULL) { // connection ended part way through a batch
+        batch_flush(conn->batch);
+    }
+    psstats_count(PS_STAT_DISCONNECTED, 1);
+    //remove disconnected client form clientsRoot
+    if (conn->client != NULL && conn->client->peer) {
+        remove_link(conn->client);
+    } else if (conn->client != NULL) {
+        remove_client_from_ds(conn->client);
+    }
+    if (conn->dialed) {
+        forget_dial(conn->sockfd);
+    }
+    free_shm_client(conn->sockfd);
+    free(conn->pending);
+    free(conn);
+}
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "psshm.h"
+#include "psproto.h"
+
+// **********************************************************************
+// Map a segment of the given total length and fill in the ring
+// **********************************************************************
+static int map_ring(PsShmRing *ring, size_t mapLen) {
+    void *mem = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED,
+            ring->memfd, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    ring->hdr = mem;
+    ring->data = (char *)mem + sizeof(PsShmHeader);
+    ring->mapLen = mapLen;
+    return 0;
+}
+
+int psshm_create(PsShmRing *ring, uint32_t size) {
+    uint32_t ringSize = 4096;
+    while (ringSize < size && ringSize < (1U << 30)) {
+        ringSize *= 2;
+    }
+    memset(ring, 0, sizeof(PsShmRing));
+    ring->memfd = memfd_create("psserver-ring", MFD_CLOEXEC);
+    if (ring->memfd < 0) {
+        return -1;
+    }
+    size_t mapLen = sizeof(PsShmHeader) + ringSize;
+    ring->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->eventfd < 0 || ftruncate(ring->memfd, mapLen) != 0
+            || map_ring(ring, mapLen) != 0) {
+        close(ring->memfd);
+        if (ring->eventfd >= 0) {
+            close(ring->eventfd);
+        }
+        return -1;
+    }
+    ring->hdr->size = ringSize;
+    ring->hdr->magic = PSSHM_MAGIC;
+    ring->size = ringSize;
+    return 0;
+}
+
+int psshm_attach(PsShmRing *ring, int memfd, int eventfd) {
+    PsShmHeader hdr;
+    memset(ring, 0, sizeof(PsShmRing));
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+    if (pread(memfd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+            || hdr.magic != PSSHM_MAGIC || (hdr.size & (hdr.size - 1))) {
+        return -1;
+    }
+    ring->size = hdr.size;
+    return map_ring(ring, sizeof(PsShmHeader) + hdr.size);
+}
+
+void psshm_close(PsShmRing *ring) {
+    munmap(ring->hdr, ring->mapLen);
+    close(ring->memfd);
+    close(ring->eventfd);
+}
+
+int psshm_write(PsShmRing *ring, const char *data, int len) {
+    // only tail comes from the segment: the client can write anything
+    // there, so size and head are our own copies
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->size) {
+        return -1;
+    }
+    uint32_t room = ring->size - (uint32_t)(head - tail);
+    if ((uint32_t)len > room) {
+        len = room;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    uint32_t pos = head & (ring->size - 1);
+    uint32_t first = ring->size - pos < (uint32_t)len ? ring->size - pos : len;
+    memcpy(ring->data + pos, data, first);
+    memcpy(ring->data, data + first, len - first);
+    ring->head = head + len;
+    __atomic_store_n(&ring->hdr->head, ring->head, __ATOMIC_RELEASE);
+    // pairs with the fence in psshm_prepare_wait(): either the consumer
+    // sees the new head or we see that it is waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->hdr->consumerWaiting, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(ring->eventfd, &one, sizeof(one)) < 0) {
+            // counter is already non-zero, so the consumer will wake
+        }
+    }
+    return len;
+}
+
+int psshm_set_blocked(PsShmRing *ring) {
+    PsShmHeader *hdr = ring->hdr;
+    __atomic_store_n(&hdr->producerBlocked, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    return ring->head - tail < ring->size;
+}
+
+int psshm_read(PsShmRing *ring, char *buf, int len, int *ack) {
+    PsShmHeader *hdr = ring->hdr;
+    uint64_t tail = hdr->tail;
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    *ack = 0;
+    if ((uint64_t)len > head - tail) {
+        len = head - tail;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    uint32_t pos = tail & (ring->size - 1);
+    uint32_t first = ring->size - pos < (uint32_t)len ? ring->size - pos : len;
+    memcpy(buf, ring->data + pos, first);
+    memcpy(buf + first, ring->data, len - first);
+    __atomic_store_n(&hdr->tail, tail + len, __ATOMIC_RELEASE);
+    // pairs with the fence in psshm_set_blocked()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->producerBlocked, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(&hdr->producerBlocked, 0,
+            __ATOMIC_RELAXED)) {
+        *ack = 1;
+    }
+    return len;
+}
+
+int psshm_prepare_wait(PsShmRing *ring) {
+    PsShmHeader *hdr = ring->hdr;
+    __atomic_store_n(&hdr->consumerWaiting, 1, __ATOMIC_RELAXED);
+    // pairs with the fence in psshm_write()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) != hdr->tail;
+}
+
+void psshm_end_wait(PsShmRing *ring) {
+    uint64_t count;
+    __atomic_store_n(&ring->hdr->consumerWaiting, 0, __ATOMIC_RELAXED);
+    if (read(ring->eventfd, &count, sizeof(count)) < 0) {
+        // nothing was signalled
+    }
+}
+
+int psshm_wait(PsShmRing *ring, int otherFd) {
+    int err = 0;
+    if (!psshm_prepare_wait(ring)) {
+        struct pollfd fds[2] = {{ring->eventfd, POLLIN, 0},
+                {otherFd, POLLIN, 0}};
+        while ((err = poll(fds, otherFd >= 0 ? 2 : 1, -1)) < 0
+                && errno == EINTR) {
+        }
+    }
+    psshm_end_wait(ring);
+    return err < 0 ? -1 : 0;
+}
+
+// **********************************************************************
+// Receive up to len bytes from a Unix domain socket, picking up any
+// descriptors sent with them into *memfd and *eventfd
+// **********************************************************************
+static int recv_fds(int sock, char *buf, int len, int *memfd, int *eventfd) {
+    struct iovec iov = {buf, len};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    int got = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&hdr); got > 0 && cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            int fds[2];
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            *memfd = fds[0];
+            *eventfd = fds[1];
+        }
+    }
+    return got;
+}
+
+// **********************************************************************
+// Send a text command, as a TEXT frame in binary mode
+// **********************************************************************
+static int send_text(int sock, int binary, const char *cmd) {
+    char buf[64];
+    int len = strlen(cmd);
+    if (binary) {
+        psproto_encode((unsigned char *)buf, PS_OP_TEXT, 0, 0, len);
+        memcpy(buf + PSPROTO_HEADER_LEN, cmd, len);
+        len += PSPROTO_HEADER_LEN;
+    } else {
+        memcpy(buf, cmd, len);
+        buf[len++] = '\n';
+    }
+    return send(sock, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+int psshm_request(int sock, int binary, PsShmRing *ring) {
+    char reply[64];
+    int len = 0, want = 0, memfd = -1, eventfd = -1;
+    if (binary && send(sock, PSPROTO_HELLO, PSPROTO_HELLO_LEN, MSG_NOSIGNAL)
+            != PSPROTO_HELLO_LEN) {
+        return -1;
+    }
+    if (send_text(sock, binary, "shmring") != 0) {
+        return -1;
+    }
+    // the reply is a line, or a hello followed by one frame
+    while (1) {
+        int got = recv_fds(sock, reply + len, sizeof(reply) - 1 - len,
+                &memfd, &eventfd);
+        if (got <= 0) {
+            break;
+        }
+        len += got;
+        if (!binary && memchr(reply, '\n', len) != NULL) {
+            break;
+        }
+        int frameAt = PSPROTO_HELLO_LEN;
+        if (binary && len >= frameAt + PSPROTO_HEADER_LEN) {
+            PsFrame frame;
+            psproto_decode((unsigned char *)reply + frameAt, &frame);
+            want = frameAt + psproto_frame_len(&frame);
+            if (len >= want || want >= sizeof(reply)) {
+                break;
+            }
+        }
+        if (len == sizeof(reply) - 1) {
+            break;
+        }
+    }
+    reply[len] = '\0';
+    int ok = binary
+            ? len == want && reply[PSPROTO_HELLO_LEN] == PS_OP_TEXT
+            : strcmp(reply, ":shmring\n") == 0;
+    if (ok && memfd >= 0 && psshm_attach(ring, memfd, eventfd) == 0) {
+        return 0;
+    }
+    if (memfd >= 0) {
+        close(memfd);
+        close(eventfd);
+    }
+    return -1;
+}
+
+void psshm_send_ack(int sock, int binary) {
+    send_text(sock, binary, "shmack");
+}
@@ -0,0 +1,97 @@
+#ifndef PSSHM_H
+#define PSSHM_H
+
+#include <stdint.h>
+
+// Shared memory transport from psserver to a client on the same host.
+// The ring is a single-producer/single-consumer byte stream in a memfd
+// segment: the server copies exactly the bytes it would have written to
+// the client's socket into it, and the client reads them back out and
+// parses them as usual. An eventfd wakes the client when it is asleep
+// waiting for data; while it is busy no system calls are made at all.
+//
+// The client asks for a ring with the "shmring" command over a Unix
+// domain socket connection. The server answers ":shmring" (a TEXT frame
+// in binary mode) with the memfd and eventfd attached as SCM_RIGHTS, and
+// from then on everything it sends to that client goes through the ring.
+// If the ring fills up the server keeps the overflow and sets
+// producerBlocked; the client sends "shmack" on the socket once it has
+// made room.
+
+#define PSSHM_MAGIC 0x50535348
+#define PSSHM_DEFAULT_SIZE (1024 * 1024)
+
+// Header at the start of the segment. head and tail only ever grow and
+// are reduced modulo size to index data; each sits on its own cache line
+// so producer and consumer do not write to the same line.
+typedef struct PsShmHeader {
+    uint32_t magic;
+    uint32_t size;                  // bytes of data, a power of two
+    char pad0[56];
+    uint64_t head;                  // bytes written by the server
+    char pad1[56];
+    uint64_t tail;                  // bytes consumed by the client
+    char pad2[56];
+    uint32_t consumerWaiting;       // client is about to sleep on eventfd
+    uint32_t producerBlocked;       // server has overflow waiting for room
+} PsShmHeader;
+
+typedef struct PsShmRing {
+    PsShmHeader *hdr;
+    char *data;
+    size_t mapLen;
+    int memfd;
+    int eventfd;
+    uint32_t size;                  // size when created or attached
+    uint64_t head;                  // producer's own copy of hdr->head
+} PsShmRing;
+
+// Create a ring with size bytes of data (rounded up to a power of two).
+// Returns 0 on success or -1.
+int psshm_create(PsShmRing *ring, uint32_t size);
+
+// Map a ring created by the other side from its memfd and eventfd.
+// Returns 0 on success or -1.
+int psshm_attach(PsShmRing *ring, int memfd, int eventfd);
+
+// Unmap the ring and close its descriptors
+void psshm_close(PsShmRing *ring);
+
+// Producer: copy up to len bytes into the ring, waking the consumer if it
+// is waiting. Returns the number of bytes copied, which is less than len
+// if the ring is full, or -1 if the consumer has moved tail past head
+// and the ring can no longer be trusted.
+int psshm_write(PsShmRing *ring, const char *data, int len);
+
+// Producer: note that bytes are waiting for room. Returns 1 if room
+// appeared meanwhile and the caller should simply write again.
+int psshm_set_blocked(PsShmRing *ring);
+
+// Consumer: copy up to len bytes out of the ring without blocking.
+// Returns the number of bytes read. *ack is set if the producer was
+// blocked and should be sent "shmack" now that there is room.
+int psshm_read(PsShmRing *ring, char *buf, int len, int *ack);
+
+// Consumer: announce that it is about to sleep on the eventfd (for
+// example in poll or epoll). Returns 1 if data arrived meanwhile, in
+// which case it should read again rather than sleep.
+int psshm_prepare_wait(PsShmRing *ring);
+
+// Consumer: woken up, so the producer need not signal the eventfd again
+// until the next psshm_prepare_wait(). Clears the eventfd counter.
+void psshm_end_wait(PsShmRing *ring);
+
+// Consumer: sleep until the ring has data or otherFd (the socket, to
+// notice the server going away) is readable. Returns -1 on error.
+int psshm_wait(PsShmRing *ring, int otherFd);
+
+// Client: ask the server for a ring on a freshly connected Unix domain
+// socket and attach to it. In binary mode the hello is sent first and
+// the server's hello consumed. Returns 0 once attached or -1 if the
+// server refused, in which case deliveries keep coming over the socket.
+int psshm_request(int sock, int binary, PsShmRing *ring);
+
+// Client: tell the server there is room in the ring again
+void psshm_send_ack(int sock, int binary);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "psstats.h"
+
+// One thread's statistics. seq is odd while the owner is part way
+// through updating a histogram, so a reader copying the slot can tell
+// it has to try again.
+typedef struct PsStatsSlot {
+    uint64_t counters[PS_STAT_COUNTERS];
+    uint64_t seq;
+    uint64_t commandStart;
+    PsHist commandLatency;
+    PsHist deliveryLatency;
+    struct PsStatsSlot *next;
+} __attribute__((aligned(64))) PsStatsSlot;
+
+// every live slot, plus the totals of threads that have exited
+static PsStatsSlot *slots;
+static PsStatsTotals retired;
+static pthread_mutex_t slotsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slotsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t slotKey;
+static __thread PsStatsSlot *mySlot;
+
+// **********************************************************************
+// Add the counters and histograms of from into totals
+// **********************************************************************
+static void add_slot(PsStatsTotals *totals, PsStatsSlot *from) {
+    for (int i = 0; i < PS_STAT_COUNTERS; i++) {
+        totals->counters[i] += from->counters[i];
+    }
+    pshist_merge(&totals->commandLatency, &from->commandLatency);
+    pshist_merge(&totals->deliveryLatency, &from->deliveryLatency);
+}
+
+// **********************************************************************
+// Thread exit: fold the thread's slot into the retired totals
+// **********************************************************************
+static void retire_slot(void *arg) {
+    PsStatsSlot *slot = arg, **prev;
+    pthread_mutex_lock(&slotsLock);
+    for (prev = &slots; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == slot) {
+            *prev = slot->next;
+            break;
+        }
+    }
+    add_slot(&retired, slot);
+    pthread_mutex_unlock(&slotsLock);
+    free(slot);
+}
+
+static void init_slots(void) {
+    pthread_key_create(&slotKey, retire_slot);
+    pshist_init(&retired.commandLatency);
+    pshist_init(&retired.deliveryLatency);
+}
+
+// **********************************************************************
+// The calling thread's slot, created on first use
+// **********************************************************************
+static PsStatsSlot *my_slot(void) {
+    if (mySlot != NULL) {
+        return mySlot;
+    }
+    pthread_once(&slotsOnce, init_slots);
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(PsStatsSlot)) != 0) {
+        abort();
+    }
+    PsStatsSlot *slot = mem;
+    memset(slot, 0, sizeof(PsStatsSlot));
+    pshist_init(&slot->commandLatency);
+    pshist_init(&slot->deliveryLatency);
+    pthread_mutex_lock(&slotsLock);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&slotsLock);
+    pthread_setspecific(slotKey, slot);
+    mySlot = slot;
+    return slot;
+}
+
+// **********************************************************************
+// Record value in one of the calling thread's histograms
+// **********************************************************************
+static void record(PsStatsSlot *slot, PsHist *hist, uint64_t value) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pshist_record(hist, value);
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t psstats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void psstats_count(PsCounter counter, uint64_t n) {
+    PsStatsSlot *slot = my_slot();
+    // only this thread writes the slot, so no atomic add is needed
+    __atomic_store_n(&slot->counters[counter], slot->counters[counter] + n,
+            __ATOMIC_RELAXED);
+}
+
+void psstats_command_begin(void) {
+    my_slot()->commandStart = psstats_now();
+}
+
+void psstats_command_end(void) {
+    PsStatsSlot *slot = my_slot();
+    record(slot, &slot->commandLatency, psstats_now() - slot->commandStart);
+}
+
+void psstats_delivered(void) {
+    PsStatsSlot *slot = my_slot();
+    record(slot, &slot->deliveryLatency, psstats_now() - slot->commandStart);
+}
+
+void psstats_snapshot(PsStatsTotals *totals) {
+    static PsStatsSlot copy;    // too big for the stack, guarded by lock
+    pthread_once(&slotsOnce, init_slots);
+    pthread_mutex_lock(&slotsLock);
+    memcpy(totals, &retired, sizeof(PsStatsTotals));
+    for (PsStatsSlot *slot = slots; slot != NULL; slot = slot->next) {
+        uint64_t before, after;
+        do { // copy again if the owner was updating a histogram
+            before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            memcpy(&copy, slot, sizeof(PsStatsSlot));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        } while ((before & 1) || before != after);
+        add_slot(totals, &copy);
+    }
+    pthread_mutex_unlock(&slotsLock);
+}
@@ -0,0 +1,64 @@
+#ifndef PSSTATS_H
+#define PSSTATS_H
+
+#include <stdint.h>
+#include "pshist.h"
+
+// Statistics for psserver kept without locks or shared cache lines on
+// the hot path. Every thread that counts something gets its own slot,
+// padded to whole cache lines, which only that thread ever writes. A
+// report adds all the slots up; a thread's slot is folded into a
+// retired total when the thread exits so nothing it counted is lost.
+//
+// Besides the counters each slot holds two latency histograms in
+// nanoseconds: how long a command took to process, and how long after
+// a pub started processing each delivery of it was handed to the I/O
+// layer (or shared memory ring).
+//
+// NAMES, TOPICS and SUBSCRIPTIONS are gauges of the server's maps: they
+// go up by 1 and down by (uint64_t)-1, and the sum over every thread
+// wraps round to the right size.
+typedef enum PsCounter {
+    PS_STAT_CONNECTED,
+    PS_STAT_DISCONNECTED,
+    PS_STAT_PUB,
+    PS_STAT_SUB,
+    PS_STAT_UNSUB,
+    PS_STAT_NAMES,
+    PS_STAT_TOPICS,
+    PS_STAT_SUBSCRIPTIONS,
+    PS_STAT_CONFLATED,      // held sublatest messages replaced unsent
+    PS_STAT_TIMEDOUT,       // connections closed for staying silent
+    PS_STAT_THROTTLED,      // pubs over a rate limit that paused reading
+    PS_STAT_REJECTED,       // pubs over a rate limit answered :invalid
+    PS_STAT_COUNTERS
+} PsCounter;
+
+// Totals over all threads, filled in by psstats_snapshot()
+typedef struct PsStatsTotals {
+    uint64_t counters[PS_STAT_COUNTERS];
+    PsHist commandLatency;
+    PsHist deliveryLatency;
+} PsStatsTotals;
+
+// Monotonic clock in nanoseconds
+uint64_t psstats_now(void);
+
+// Add n to one of the calling thread's counters
+void psstats_count(PsCounter counter, uint64_t n);
+
+// Mark the start of processing a command on the calling thread
+void psstats_command_begin(void);
+
+// Record the time since psstats_command_begin() as command latency
+void psstats_command_end(void);
+
+// Record the time since psstats_command_begin() as delivery latency for
+// one message handed to a subscriber
+void psstats_delivered(void);
+
+// Add up every thread's counters and histograms. Safe to call from any
+// thread at any time.
+void psstats_snapshot(PsStatsTotals *totals);
+
+#endif
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pstrace.h"
+
+#define TRACE_BUFFER_LIMIT (16 * 1024 * 1024)
+#define TRACE_RECORD_MAX 16          // type and three varints
+
+// Growable byte buffer for the pending and in-flight batches
+typedef struct TraceBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} TraceBuffer;
+
+struct PsTrace {
+    int fd;
+    int flushMs;
+
+    // protects everything below
+    pthread_mutex_t lock;
+    pthread_cond_t wakeWriter;  // closing or over the buffer limit
+    pthread_cond_t progress;    // a batch was written
+    TraceBuffer pending;
+    uint32_t nextConn;
+    uint64_t lastUs;
+    int closing;
+
+    pthread_t writer;
+};
+
+// **********************************************************************
+// Current CLOCK_MONOTONIC time in microseconds
+// **********************************************************************
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// **********************************************************************
+// Make sure buf can hold extra more bytes
+// **********************************************************************
+static void buffer_reserve(TraceBuffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return;
+    }
+    size_t newCap = buf->cap ? buf->cap * 2 : 64 * 1024;
+    while (newCap < buf->len + extra) {
+        newCap *= 2;
+    }
+    buf->data = realloc(buf->data, newCap);
+    buf->cap = newCap;
+}
+
+// **********************************************************************
+// Append value as a varint. Returns the bytes used.
+// **********************************************************************
+static int put_varint(char *out, uint64_t value) {
+    int len = 0;
+    while (value >= 0x80) {
+        out[len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (char)value;
+    return len;
+}
+
+// **********************************************************************
+// Read a varint at the reader's offset. Returns -1 if it runs past the
+// end.
+// **********************************************************************
+static int get_varint(PsTraceReader *reader, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (reader->off >= reader->size) {
+            return -1;
+        }
+        unsigned char byte = reader->map[reader->off++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// **********************************************************************
+// Append one record to the pending batch. Called with the lock held.
+// **********************************************************************
+static void append_record(PsTrace *trace, int type, uint32_t conn,
+        char *data, int len) {
+    // bound memory if the disk cannot keep up
+    while (trace->pending.len > TRACE_BUFFER_LIMIT) {
+        pthread_cond_signal(&trace->wakeWriter);
+        pthread_cond_wait(&trace->progress, &trace->lock);
+    }
+    uint64_t now = now_us();
+    uint64_t delta = trace->lastUs ? now - trace->lastUs : 0;
+    trace->lastUs = now;
+    buffer_reserve(&trace->pending, TRACE_RECORD_MAX + len);
+    char *out = trace->pending.data + trace->pending.len;
+    int used = 0;
+    out[used++] = type;
+    used += put_varint(out + used, conn);
+    used += put_varint(out + used, delta);
+    if (type == PSTRACE_DATA) {
+        used += put_varint(out + used, len);
+        memcpy(out + used, data, len);
+        used += len;
+    }
+    trace->pending.len += used;
+}
+
+// **********************************************************************
+// Writer thread. Every flushMs, or sooner if the batch grows too big,
+// takes the whole pending batch and writes it with one write().
+// **********************************************************************
+static void *trace_writer(void *arg) {
+    PsTrace *trace = (PsTrace *)arg;
+    TraceBuffer batch = {NULL, 0, 0};
+    pthread_mutex_lock(&trace->lock);
+    while (1) {
+        if (!trace->closing && trace->pending.len <= TRACE_BUFFER_LIMIT) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += trace->flushMs / 1000;
+            ts.tv_nsec += (trace->flushMs % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&trace->wakeWriter, &trace->lock, &ts);
+        }
+        // swap buffers so receivers can keep appending while we write
+        TraceBuffer swap = trace->pending;
+        trace->pending = batch;
+        trace->pending.len = 0;
+        batch = swap;
+        int closing = trace->closing;
+        pthread_mutex_unlock(&trace->lock);
+
+        char *data = batch.data;
+        size_t len = batch.len;
+        while (len > 0) {
+            ssize_t done = write(trace->fd, data, len);
+            if (done < 0 && errno == EINTR) {
+                continue;
+            }
+            if (done <= 0) {
+                break; // disk trouble: the trace just ends early
+            }
+            data += done;
+            len -= done;
+        }
+        batch.len = 0;
+
+        pthread_mutex_lock(&trace->lock);
+        pthread_cond_broadcast(&trace->progress);
+        if (closing) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&trace->lock);
+    free(batch.data);
+    return NULL;
+}
+
+// Create a trace file and start its writer
+PsTrace *pstrace_open(const char *path, int flushMs) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (write(fd, PSTRACE_MAGIC, PSTRACE_MAGIC_LEN) != PSTRACE_MAGIC_LEN) {
+        close(fd);
+        return NULL;
+    }
+    PsTrace *trace = calloc(1, sizeof(PsTrace));
+    trace->fd = fd;
+    trace->flushMs = flushMs > 0 ? flushMs : 1;
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&trace->wakeWriter, &attr);
+    pthread_cond_init(&trace->progress, &attr);
+    pthread_condattr_destroy(&attr);
+    // the writer takes no signals, whatever the caller has blocked, so
+    // one meant for the program is never handled on it
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_create(&trace->writer, NULL, trace_writer, trace);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return trace;
+}
+
+// Number a new connection and record that it opened
+uint32_t pstrace_open_conn(PsTrace *trace) {
+    pthread_mutex_lock(&trace->lock);
+    uint32_t conn = ++trace->nextConn;
+    append_record(trace, PSTRACE_OPEN, conn, NULL, 0);
+    pthread_mutex_unlock(&trace->lock);
+    return conn;
+}
+
+// Record bytes received on a connection, or that it closed
+void pstrace_record(PsTrace *trace, uint32_t conn, char *data, int len) {
+    pthread_mutex_lock(&trace->lock);
+    append_record(trace, data != NULL ? PSTRACE_DATA : PSTRACE_CLOSE, conn,
+            data, len);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+// Write out everything recorded and free the trace
+void pstrace_close(PsTrace *trace) {
+    if (trace == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&trace->lock);
+    trace->closing = 1;
+    pthread_cond_signal(&trace->wakeWriter);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+    close(trace->fd);
+    free(trace->pending.data);
+    free(trace);
+}
+
+// Map a trace file for reading
+int pstrace_read_open(PsTraceReader *reader, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    memset(reader, 0, sizeof(PsTraceReader));
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < PSTRACE_MAGIC_LEN) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    reader->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (reader->map == MAP_FAILED
+            || memcmp(reader->map, PSTRACE_MAGIC, PSTRACE_MAGIC_LEN) != 0) {
+        if (reader->map != MAP_FAILED) {
+            munmap(reader->map, st.st_size);
+        }
+        reader->map = NULL;
+        return -1;
+    }
+    madvise(reader->map, st.st_size, MADV_SEQUENTIAL);
+    reader->size = st.st_size;
+    pstrace_rewind(reader);
+    return 0;
+}
+
+// Read the next record
+int pstrace_next(PsTraceReader *reader, PsTraceRecord *record) {
+    uint64_t conn, delta, len = 0;
+    size_t start = reader->off;
+    if (reader->off >= reader->size) {
+        return 0;
+    }
+    record->type = (unsigned char)reader->map[reader->off++];
+    if (record->type < PSTRACE_OPEN || record->type > PSTRACE_CLOSE
+            || get_varint(reader, &conn) != 0
+            || get_varint(reader, &delta) != 0
+            || (record->type == PSTRACE_DATA
+            && (get_varint(reader, &len) != 0
+            || len > reader->size - reader->off))) {
+        reader->off = start;
+        return 0;
+    }
+    reader->timeUs += delta;
+    record->conn = conn;
+    record->timeUs = reader->timeUs;
+    record->data = reader->map + reader->off;
+    record->len = len;
+    reader->off += len;
+    return 1;
+}
+
+// Go back to the first record
+void pstrace_rewind(PsTraceReader *reader) {
+    reader->off = PSTRACE_MAGIC_LEN;
+    reader->timeUs = 0;
+}
+
+// Unmap a trace file
+void pstrace_read_close(PsTraceReader *reader) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->size);
+        reader->map = NULL;
+    }
+}
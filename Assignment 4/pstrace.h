@@ -0,0 +1,74 @@
+#ifndef PSTRACE_H
+#define PSTRACE_H
+
+#include <stdint.h>
+
+// Capture of everything psserver receives, so a real workload can be
+// replayed against another build of the server (see psreplay). The file
+// starts with the 8 byte PSTRACE_MAGIC and then holds one record per
+// event:
+//   type   1 byte, PSTRACE_OPEN, PSTRACE_DATA or PSTRACE_CLOSE
+//   conn   varint, connections numbered from 1 in the order they opened
+//   delta  varint, microseconds since the previous record
+//   len    varint, DATA only, followed by the len bytes received
+// Varints are 7 bits a byte, low bits first. Bytes are recorded just as
+// they arrived, so text and binary clients, split lines and hellos all
+// replay the way the server first saw them.
+#define PSTRACE_MAGIC "PSTRACE1"
+#define PSTRACE_MAGIC_LEN 8
+
+#define PSTRACE_OPEN 1
+#define PSTRACE_DATA 2
+#define PSTRACE_CLOSE 3
+
+typedef struct PsTrace PsTrace;
+
+// One record read back by pstrace_next()
+typedef struct PsTraceRecord {
+    int type;
+    uint32_t conn;
+    uint64_t timeUs;    // since the first record
+    char *data;         // DATA bytes, pointing into the mapped file
+    uint32_t len;
+} PsTraceRecord;
+
+// A trace file mapped for reading
+typedef struct PsTraceReader {
+    char *map;
+    size_t size;
+    size_t off;
+    uint64_t timeUs;
+} PsTraceReader;
+
+// Create (truncating) a trace file. Records are written by a background
+// thread at least every flushMs milliseconds. Returns NULL if the file
+// cannot be created.
+PsTrace *pstrace_open(const char *path, int flushMs);
+
+// Number a new connection and record that it opened. Callable from any
+// thread.
+uint32_t pstrace_open_conn(PsTrace *trace);
+
+// Record len bytes received on conn, or that conn closed if data is
+// NULL. Callable from any thread; waits if the disk falls far behind.
+void pstrace_record(PsTrace *trace, uint32_t conn, char *data, int len);
+
+// Write out everything recorded, stop the writer and free the trace.
+// Does nothing if trace is NULL.
+void pstrace_close(PsTrace *trace);
+
+// Map a trace file for reading. Returns 0, or -1 if it cannot be read or
+// is not a trace.
+int pstrace_read_open(PsTraceReader *reader, const char *path);
+
+// Read the next record. Returns 1 if one was read, or 0 at the end of
+// the trace (including a record cut short when the server stopped).
+int pstrace_next(PsTraceReader *reader, PsTraceRecord *record);
+
+// Go back to the first record
+void pstrace_rewind(PsTraceReader *reader);
+
+// Unmap a trace file
+void pstrace_read_close(PsTraceReader *reader);
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "psuring.h"
+
+// **********************************************************************
+// Thin wrappers for the io_uring system calls
+// **********************************************************************
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned toSubmit, unsigned minComplete,
+        unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+            NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg,
+        unsigned nrArgs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+// Set up a ring with room for entries submissions
+int psuring_init(PsUring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(PsUring));
+    memset(&params, 0, sizeof(params));
+    // multishot receives can post many completions per submission
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 8;
+    int fd = sys_setup(entries, &params);
+    if (fd < 0) {
+        return -errno;
+    }
+    ring->fd = fd;
+    ring->features = params.features;
+
+    ring->sqRingSize = params.sq_off.array
+            + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes
+            + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(fd);
+        return -ENOMEM;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            close(fd);
+            return -ENOMEM;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(fd);
+        return -ENOMEM;
+    }
+
+    char *sq = ring->sqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->sqLocalTail = *ring->sqTail;
+    char *cq = ring->cqRing;
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    // sqes are always used in order, so the index array is the identity
+    for (unsigned i = 0; i <= ring->sqMask; i++) {
+        ring->sqArray[i] = i;
+    }
+    return 0;
+}
+
+// Tear down the ring and all of its mappings
+void psuring_exit(PsUring *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Return 0 if the kernel supports every opcode in ops, else -1
+int psuring_probe(PsUring *ring, const int *ops, int count) {
+    size_t len = sizeof(struct io_uring_probe)
+            + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (sys_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return -1;
+    }
+    int err = 0;
+    for (int i = 0; i < count; i++) {
+        if (ops[i] > probe->last_op
+                || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            err = -1;
+        }
+    }
+    free(probe);
+    return err;
+}
+
+// Get a zeroed submission entry, submitting first if the queue is full
+struct io_uring_sqe *psuring_get_sqe(PsUring *ring) {
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqLocalTail - head > ring->sqMask) {
+        if (psuring_submit_and_wait(ring, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (ring->sqLocalTail - head > ring->sqMask) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    ring->sqLocalTail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+// Submit every queued entry with one io_uring_enter() call
+int psuring_submit_and_wait(PsUring *ring, unsigned waitNr) {
+    unsigned toSubmit = ring->sqLocalTail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    if (toSubmit == 0 && waitNr == 0) {
+        return 0;
+    }
+    int ret;
+    do {
+        ring->enterCalls++;
+        ret = sys_enter(ring->fd, toSubmit, waitNr,
+                waitNr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -errno : ret;
+}
+
+// Next completion or NULL if there is none
+struct io_uring_cqe *psuring_peek_cqe(PsUring *ring) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void psuring_cqe_seen(PsUring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// Register count fixed buffers for IORING_OP_READ/WRITE_FIXED
+int psuring_register_buffers(PsUring *ring, struct iovec *iovs,
+        unsigned count) {
+    if (sys_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, count) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// Register a provided-buffer ring as buffer group bgid
+int psuring_setup_buf_ring(PsUring *ring, PsUringBufRing *bufRing,
+        unsigned entries, int bgid, char *base, unsigned bufSize) {
+    memset(bufRing, 0, sizeof(PsUringBufRing));
+    bufRing->size = entries * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, bufRing->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return -ENOMEM;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)mem;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = -errno;
+        munmap(mem, bufRing->size);
+        return err;
+    }
+    bufRing->br = mem;
+    bufRing->entries = entries;
+    bufRing->bgid = bgid;
+    bufRing->base = base;
+    bufRing->bufSize = bufSize;
+    for (unsigned i = 0; i < entries; i++) {
+        psuring_buf_ring_recycle(bufRing, i);
+    }
+    return 0;
+}
+
+// Give buffer bid back to the kernel
+void psuring_buf_ring_recycle(PsUringBufRing *bufRing, unsigned short bid) {
+    struct io_uring_buf *buf =
+            &bufRing->br->bufs[bufRing->tail & (bufRing->entries - 1)];
+    buf->addr = (unsigned long)(bufRing->base + (size_t)bid
+            * bufRing->bufSize);
+    buf->len = bufRing->bufSize;
+    buf->bid = bid;
+    bufRing->tail++;
+    __atomic_store_n(&bufRing->br->tail, bufRing->tail, __ATOMIC_RELEASE);
+}
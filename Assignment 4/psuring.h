@@ -0,0 +1,80 @@
+#ifndef PSURING_H
+#define PSURING_H
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring ring built directly on the io_uring_setup(2),
+// io_uring_enter(2) and io_uring_register(2) system calls, so the
+// server does not depend on liburing being installed.
+typedef struct PsUring {
+    int fd;
+    unsigned features;
+    // submission queue
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqLocalTail;   // sqes handed out but not yet submitted
+    // completion queue
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    // mappings to undo in psuring_exit()
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned long enterCalls;
+} PsUring;
+
+// Ring of buffers the kernel picks from for IOSQE_BUFFER_SELECT reads
+typedef struct PsUringBufRing {
+    struct io_uring_buf_ring *br;
+    size_t size;
+    unsigned entries;
+    unsigned short tail;
+    int bgid;
+    char *base;
+    unsigned bufSize;
+} PsUringBufRing;
+
+// Set up a ring with room for entries submissions. Returns 0 on success
+// or a negative errno value if io_uring is unavailable.
+int psuring_init(PsUring *ring, unsigned entries);
+
+// Tear down the ring and all of its mappings
+void psuring_exit(PsUring *ring);
+
+// Return 0 if the kernel supports every opcode in ops, else -1
+int psuring_probe(PsUring *ring, const int *ops, int count);
+
+// Get a zeroed submission entry, submitting queued entries first if the
+// queue is full. Returns NULL only if the ring cannot make progress.
+struct io_uring_sqe *psuring_get_sqe(PsUring *ring);
+
+// Submit every queued entry with one io_uring_enter() call, waiting for
+// at least waitNr completions. Returns the result of io_uring_enter().
+int psuring_submit_and_wait(PsUring *ring, unsigned waitNr);
+
+// Next completion or NULL if there is none. Call psuring_cqe_seen()
+// once it has been handled.
+struct io_uring_cqe *psuring_peek_cqe(PsUring *ring);
+void psuring_cqe_seen(PsUring *ring);
+
+// Register count fixed buffers for IORING_OP_READ/WRITE_FIXED
+int psuring_register_buffers(PsUring *ring, struct iovec *iovs,
+        unsigned count);
+
+// Register a provided-buffer ring of entries buffers of bufSize bytes
+// each, carved out of base, as buffer group bgid. Returns 0 on success.
+int psuring_setup_buf_ring(PsUring *ring, PsUringBufRing *bufRing,
+        unsigned entries, int bgid, char *base, unsigned bufSize);
+
+// Give buffer bid back to the kernel
+void psuring_buf_ring_recycle(PsUringBufRing *bufRing, unsigned short bid);
+
+#endif
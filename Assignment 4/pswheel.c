@@ -0,0 +1,119 @@
+#include <stddef.h>
+#include "pswheel.h"
+
+#define SLOT_MASK (PSWHEEL_SLOTS - 1)
+
+// **********************************************************************
+// Slot number of tick t at level
+// **********************************************************************
+static int slot_of(uint64_t t, int level) {
+    return (t >> (level * PSWHEEL_BITS)) & SLOT_MASK;
+}
+
+// **********************************************************************
+// Link timer into the list headed by head
+// **********************************************************************
+static void link_timer(PsTimer *head, PsTimer *timer) {
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+// **********************************************************************
+// Put a timer that is not scheduled into the slot for its expiry: the
+// lowest level whose span covers the time left
+// **********************************************************************
+static void place(PsWheel *wheel, PsTimer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+    while (level < PSWHEEL_LEVELS - 1
+            && delta >= (uint64_t) 1 << ((level + 1) * PSWHEEL_BITS)) {
+        level++;
+    }
+    link_timer(&wheel->slots[level][slot_of(timer->expires, level)], timer);
+}
+
+// **********************************************************************
+// Take every timer out of one slot and place it again. Called when time
+// reaches the slot, so each one lands on a lower level.
+// **********************************************************************
+static void cascade(PsWheel *wheel, int level, int slot) {
+    PsTimer *head = &wheel->slots[level][slot];
+    PsTimer *timer = head->next;
+    head->next = head->prev = head;
+    while (timer != head) {
+        PsTimer *next = timer->next;
+        place(wheel, timer);
+        timer = next;
+    }
+}
+
+void pswheel_init(PsWheel *wheel, uint64_t now) {
+    wheel->now = now;
+    for (int level = 0; level < PSWHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < PSWHEEL_SLOTS; slot++) {
+            PsTimer *head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+}
+
+void pswheel_timer_init(PsTimer *timer, void (*fn)(PsTimer *), void *arg) {
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void pswheel_add(PsWheel *wheel, PsTimer *timer, uint64_t expires) {
+    uint64_t limit = (uint64_t) 1 << (PSWHEEL_LEVELS * PSWHEEL_BITS);
+    pswheel_cancel(timer);
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now >= limit) {
+        expires = wheel->now + limit - 1;
+    }
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+void pswheel_cancel(PsTimer *timer) {
+    if (timer->next == NULL) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+int pswheel_pending(PsTimer *timer) {
+    return timer->next != NULL;
+}
+
+void pswheel_advance(PsWheel *wheel, uint64_t now) {
+    while (wheel->now < now) {
+        uint64_t t = ++wheel->now;
+        // at the start of each wider slot, spread it over the level below
+        for (int level = 1; level < PSWHEEL_LEVELS
+                && slot_of(t, level - 1) == 0; level++) {
+            cascade(wheel, level, slot_of(t, level));
+        }
+        // detach the due list first so a timer added again from its fn
+        // is not seen twice
+        PsTimer *head = &wheel->slots[0][slot_of(t, 0)], due;
+        if (head->next == head) {
+            continue;
+        }
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head->prev = head;
+        while (due.next != &due) {
+            PsTimer *timer = due.next;
+            pswheel_cancel(timer);
+            timer->fn(timer);
+        }
+    }
+}
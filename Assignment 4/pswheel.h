@@ -0,0 +1,55 @@
+#ifndef PSWHEEL_H
+#define PSWHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timer wheel. Time is counted in ticks of whatever length
+// the caller advances the wheel by. Level 0 has a slot for each of the
+// next PSWHEEL_SLOTS ticks; each level above has slots PSWHEEL_SLOTS
+// times as wide, and when time reaches one of them its timers are
+// spread out over the level below. Adding and cancelling a timer are a
+// few pointer writes however many timers there are, and a tick only
+// touches the timers that are due (plus, now and then, a cascade).
+//
+// The wheel does no locking. Timers are fired from pswheel_advance()
+// and may be added again from their fn.
+#define PSWHEEL_BITS 6
+#define PSWHEEL_SLOTS (1 << PSWHEEL_BITS)
+#define PSWHEEL_LEVELS 4
+
+// One timer, embedded in whatever it is for. next is NULL while it is
+// not scheduled.
+typedef struct PsTimer {
+    struct PsTimer *next;
+    struct PsTimer *prev;
+    uint64_t expires;
+    void (*fn)(struct PsTimer *timer);
+    void *arg;
+} PsTimer;
+
+typedef struct PsWheel {
+    uint64_t now;   // last tick processed
+    PsTimer slots[PSWHEEL_LEVELS][PSWHEEL_SLOTS];   // list heads
+} PsWheel;
+
+// Start an empty wheel at tick now
+void pswheel_init(PsWheel *wheel, uint64_t now);
+
+// Set up a timer that calls fn(timer) when it expires
+void pswheel_timer_init(PsTimer *timer, void (*fn)(PsTimer *), void *arg);
+
+// Schedule timer for tick expires, moving it if it is already scheduled.
+// A time already past fires on the next tick; one further ahead than
+// the wheel reaches fires at the far end of it.
+void pswheel_add(PsWheel *wheel, PsTimer *timer, uint64_t expires);
+
+// Unschedule timer. Does nothing if it is not scheduled.
+void pswheel_cancel(PsTimer *timer);
+
+// 1 if timer is scheduled
+int pswheel_pending(PsTimer *timer);
+
+// Process every tick up to and including now, firing the timers due
+void pswheel_advance(PsWheel *wheel, uint64_t now);
+
+#endif
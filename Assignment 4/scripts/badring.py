@@ -0,0 +1,34 @@
+# usage: badring.py socketpath port tailskip [size]
+# A client that takes a shared memory ring, then writes its header: tail
+# moved tailskip bytes past head, and size set to size if given. Then
+# 40 publishes of 60 KB go to it. The server must stay up; a tail past
+# head gets the client's socket closed.
+import array, mmap, os, socket, struct, sys, time
+
+path, port, skip = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+u = socket.socket(socket.AF_UNIX)
+u.connect(path)
+u.sendall(b"name bad\nsub news\nshmring\n")
+fds = array.array("i")
+msg, anc, flags, addr = u.recvmsg(100, socket.CMSG_LEN(2 * fds.itemsize))
+for level, kind, data in anc:
+    fds.frombytes(data[:len(data) - len(data) % fds.itemsize])
+print("reply", msg, "fds", len(fds))
+ring = mmap.mmap(fds[0], os.fstat(fds[0]).st_size)
+if len(sys.argv) > 4:
+    struct.pack_into("<I", ring, 4, int(sys.argv[4]))
+head = struct.unpack_from("<Q", ring, 64)[0]
+struct.pack_into("<Q", ring, 128, head + skip)
+p = socket.create_connection(("127.0.0.1", port))
+p.sendall(b"name pb\n")
+for i in range(40):
+    p.sendall(b"pub news " + b"x" * 60000 + b"\n")
+time.sleep(0.3)
+u.settimeout(1)
+try:
+    print("socket after:", u.recv(100) or "closed")
+except socket.timeout:
+    print("socket after: still open")
+c = socket.create_connection(("127.0.0.1", port))
+c.sendall(b"name ok\n")
+print("server still accepting")
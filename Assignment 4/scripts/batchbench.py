@@ -0,0 +1,44 @@
+# usage: batchbench.py port batch
+# Publish 50000 messages to 8 subscribers, one pub per line (batch 1) or
+# in pubbatch groups of batch, and report the delivery rate.
+import socket, sys, threading, time
+
+port, batch = int(sys.argv[1]), int(sys.argv[2])
+N, SUBS = 50000, 8
+msg = b"payload-0123456789"
+line = b"pubber:bench:" + msg + b"\n"
+done = []
+ready = threading.Semaphore(0)
+
+def subscriber(i):
+    s = socket.create_connection(("127.0.0.1", port))
+    s.sendall(b"name s%d\nsub bench\n" % i)
+    ready.release()
+    need, got = N * len(line), 0
+    while got < need:
+        d = s.recv(1 << 20)
+        if not d:
+            break
+        got += len(d)
+    done.append(time.time())
+
+ts = [threading.Thread(target=subscriber, args=(i,)) for i in range(SUBS)]
+for t in ts:
+    t.start()
+for t in ts:
+    ready.acquire()
+time.sleep(0.3)
+p = socket.create_connection(("127.0.0.1", port))
+p.sendall(b"name pubber\n")
+start = time.time()
+if batch == 1:
+    data = (b"pub bench " + msg + b"\n") * N
+else:
+    data = ((b"pubbatch %d\n" % batch)
+            + (b"bench " + msg + b"\n") * batch) * (N // batch)
+p.sendall(data)
+for t in ts:
+    t.join()
+took = max(done) - start
+print("batch=%d: %.0f msgs/s, %.0f deliveries/s"
+        % (batch, N / took, N * SUBS / took))
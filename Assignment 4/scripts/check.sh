@@ -0,0 +1,37 @@
+# usage: check.sh [asan]
+# For each backend: start a server on a free port, run psbench, ids.py,
+# pol.py, churn.py and latest.py against it, then stop it. With "asan"
+# the server is first rebuilt with AddressSanitizer into a temp dir and
+# the number of sanitizer errors is reported per backend. Set KEEP=1 to
+# keep the server logs.
+cd "$(dirname "$0")/.." || exit 1
+T=$(mktemp -d)
+SERVER=./psserver
+if [ "$1" = asan ]; then
+    gcc -Wall -pthread -std=gnu99 -g -fsanitize=address -I. -o $T/psserver \
+        psserver.c pslog.c psio.c psuring.c psshm.c psstats.c pshist.c \
+        psepoch.c pswheel.c pstrace.c psrate.c stringmap.c || exit 1
+    SERVER=$T/psserver
+fi
+for B in epoll uring thread; do
+    env PSSERVER_BACKEND=$B ASAN_OPTIONS=detect_leaks=0 LD_LIBRARY_PATH=. \
+        $SERVER 500 0 2>$T/$B.out &
+    P=$!
+    sleep 0.5
+    PORT=$(head -1 $T/$B.out)
+    echo "== $B (port $PORT)"
+    timeout 60 ./psbench --duration 2 --threads 2 --pubs 4 --subs 40 \
+        --topics 2 --rate 500 $PORT | sed -n 3p
+    python3 scripts/ids.py $PORT | tail -1
+    python3 scripts/pol.py $PORT "policy latency;"
+    python3 scripts/churn.py $PORT
+    # a subscriber that stops reading blocks thread-backend sends, so
+    # that backend gets the trickling reader
+    [ $B = thread ] && SLOW=slow || SLOW=
+    timeout 60 python3 scripts/latest.py $PORT $SLOW
+    kill -TERM $P
+    sleep 1
+    kill -9 $P 2>/dev/null
+    [ "$1" = asan ] && echo "asan errors: $(grep -c ERROR $T/$B.out)"
+done
+[ -n "$KEEP" ] && echo "logs in $T" || rm -rf $T
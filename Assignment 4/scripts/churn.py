@@ -0,0 +1,36 @@
+# usage: churn.py port
+# For 4 seconds one client floods a topic while 8 others keep
+# subscribing to and unsubscribing from it, then all disconnect.
+import socket, sys, threading, time
+
+port = int(sys.argv[1])
+stop = time.time() + 4
+
+def publisher():
+    s = socket.create_connection(("127.0.0.1", port))
+    s.sendall(b"name cp\n")
+    while time.time() < stop:
+        s.sendall(b"pub churn hello\n" * 50)
+
+def churner(i):
+    s = socket.create_connection(("127.0.0.1", port))
+    s.sendall(b"name cc%d\n" % i)
+    s.setblocking(False)
+    while time.time() < stop:
+        s.setblocking(True)
+        s.sendall(b"sub churn\nunsub churn\n" * 20)
+        s.setblocking(False)
+        try:
+            while s.recv(65536):
+                pass
+        except BlockingIOError:
+            pass
+    s.close()
+
+ts = [threading.Thread(target=publisher)]
+ts += [threading.Thread(target=churner, args=(i,)) for i in range(8)]
+for t in ts:
+    t.start()
+for t in ts:
+    t.join()
+print("churn done")
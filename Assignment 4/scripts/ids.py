@@ -0,0 +1,29 @@
+# usage: ids.py port
+# Binary TOPICID and PUBID: ask for the ids of an existing topic, a new
+# one and a reserved one, then publish by id (good, unknown id, empty).
+# The text subscriber should get exactly "pubber:alpha:hello by id".
+import socket, struct, sys, time
+
+port = int(sys.argv[1])
+HELLO = bytes([0xB5, ord('P'), ord('S'), 1])
+
+def frame(op, name=b"", topic=b"", payload=b""):
+    return (struct.pack("!BBHI", op, len(name), len(topic), len(payload))
+            + name + topic + payload)
+
+sub = socket.create_connection(("127.0.0.1", port))
+sub.sendall(b"name sub1\nsub alpha\n")
+p = socket.create_connection(("127.0.0.1", port))
+p.sendall(HELLO + frame(1, b"pubber") + frame(12, topic=b"alpha")
+        + frame(12, topic=b"newtopic") + frame(12, topic=b"$SYS"))
+time.sleep(0.3)
+reply = p.recv(1000)
+print("ids:", reply)
+at = reply.find(b"alpha")
+alphaId = reply[at + 5:at + 9]
+p.sendall(frame(13, payload=alphaId + b"hello by id")
+        + frame(13, payload=struct.pack("!I", 999999) + b"x")
+        + frame(13, payload=alphaId))
+time.sleep(0.3)
+print("publisher:", p.recv(1000))
+print("subscriber:", sub.recv(1000))
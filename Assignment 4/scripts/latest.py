@@ -0,0 +1,50 @@
+# usage: latest.py port [slow]
+# A sublatest subscriber on three topics stops reading (or with "slow"
+# reads 4 KB every 10 ms) while 20000 messages go to each. Once it
+# catches up, the last message it has on each topic must be the newest.
+import socket, sys, threading, time
+
+port, N = int(sys.argv[1]), 20000
+
+def connect(name):
+    s = socket.create_connection(("127.0.0.1", port))
+    s.sendall(b"name %s\n" % name)
+    return s
+
+sub = connect(b"lat")
+sub.sendall(b"sublatest ta tb tc\n")
+time.sleep(0.2)
+early = [b""]
+publishing = [True]
+
+def trickle():
+    while publishing[0]:
+        early[0] += sub.recv(4096)
+        time.sleep(0.01)
+
+if len(sys.argv) > 2:
+    threading.Thread(target=trickle, daemon=True).start()
+pub = connect(b"pp")
+for i in range(N):
+    pub.sendall(b"".join(b"pub %s %d %s\n" % (t, i, b"x" * 200)
+            for t in (b"ta", b"tb", b"tc")))
+publishing[0] = False
+time.sleep(0.5)
+sub.settimeout(1)
+data, start = b"", time.time()
+try:
+    while time.time() - start < 15:
+        d = sub.recv(1 << 20)
+        if not d:
+            break
+        data += d
+except socket.timeout:
+    pass
+last, count = {}, 0
+for line in (early[0] + data).split(b"\n"):
+    if line.count(b":") >= 2:
+        _, topic, msg = line.split(b":", 2)
+        last[topic] = int(msg.split()[0])
+        count += 1
+ok = len(last) == 3 and all(v == N - 1 for v in last.values())
+print("received", count, "last", last, "ok" if ok else "BAD")
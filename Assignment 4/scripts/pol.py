@@ -0,0 +1,34 @@
+# usage: pol.py port "commands;..."
+# A client runs the given commands (for example "policy throughput;"),
+# then takes sublatest tt and sub uu while 50 messages go to each and a
+# 100000 byte one to uu. Every uu message must arrive, in order.
+import socket, sys, time
+
+port = int(sys.argv[1])
+cmds = sys.argv[2].encode().replace(b";", b"\n")
+s = socket.create_connection(("127.0.0.1", port))
+s.sendall(b"name a\n" + cmds + b"sublatest tt\nsub uu\n")
+p = socket.create_connection(("127.0.0.1", port))
+p.sendall(b"name b\n")
+time.sleep(0.2)
+for i in range(50):
+    p.sendall(b"pub tt m%d\npub uu n%d\n" % (i, i))
+p.sendall(b"pub uu " + b"z" * 100000 + b"\n")
+time.sleep(0.3)
+s.settimeout(0.5)
+got = b""
+try:
+    while True:
+        d = s.recv(1 << 20)
+        if not d:
+            break
+        got += d
+except socket.timeout:
+    pass
+lines = got.split(b"\n")
+uu = [l[5:] for l in lines if l.startswith(b"b:uu:n")]
+print("invalid", got.count(b":invalid"),
+        "u msgs", sum(1 for l in lines if l.startswith(b"b:uu:")),
+        "t msgs", sum(1 for l in lines if l.startswith(b"b:tt:")),
+        "big ok", any(len(l) == 100000 + 5 for l in lines),
+        "order", uu == [b"n%d" % i for i in range(50)])
@@ -0,0 +1,31 @@
+# usage: retire.py port idle pairs
+# idle connections each publish once (so each reader thread has an
+# epoch slot), then one client does pairs sub/unsub pairs. Prints how
+# long the pairs take. Run it against the thread backend, where every
+# connection has its own reader thread.
+import socket, sys, time
+
+port, idle, pairs = int(sys.argv[1]), int(sys.argv[2]), int(sys.argv[3])
+
+def connect(name):
+    s = socket.create_connection(("127.0.0.1", port))
+    s.sendall(b"name %s\n" % name)
+    return s
+
+q = connect(b"q")
+q.sendall(b"sub quiet\nunsub quiet\n")
+time.sleep(0.2)
+held = [q]
+for i in range(idle):
+    s = connect(b"i%d" % i)
+    s.sendall(b"sub idle\npub quiet x\n")
+    held.append(s)
+time.sleep(1)
+c = connect(b"churner")
+start = time.time()
+c.sendall(b"sub hot\nunsub hot\n" * pairs + b"ping\n")
+buf = b""
+while b"pong" not in buf:
+    buf += c.recv(65536)
+print("idle=%d: %d sub/unsub pairs in %.3f s"
+        % (idle, pairs, time.time() - start))
@@ -0,0 +1,46 @@
+# usage: reuse.py port
+# A subscriber closes part way through a text pubbatch and a new client
+# takes its fd. The stranger must get nothing; a later subscriber gets
+# the later batch.
+import socket, sys, time
+
+port = int(sys.argv[1])
+
+def connect():
+    s = socket.create_connection(("127.0.0.1", port))
+    s.settimeout(0.5)
+    return s
+
+def read_all(s):
+    out = b""
+    try:
+        while True:
+            d = s.recv(65536)
+            if not d:
+                break
+            out += d
+    except socket.timeout:
+        pass
+    return out
+
+a = connect()
+a.sendall(b"name aa\nsub news\n")
+time.sleep(0.1)
+p = connect()
+p.sendall(b"name pp\npubbatch 3\nnews m1\n")
+time.sleep(0.2)
+a.close()
+time.sleep(0.2)
+b = connect()
+b.sendall(b"name bb\n")
+time.sleep(0.1)
+p.sendall(b"t m2\nnews m3\n")
+time.sleep(0.2)
+print("stranger got:", read_all(b))
+a = connect()
+a.sendall(b"name a2\nsub news\n")
+time.sleep(0.1)
+p.sendall(b"pubbatch 2\nnews x1\n")
+time.sleep(0.1)
+p.sendall(b"news x2\n")
+print("subscriber got:", read_all(a))
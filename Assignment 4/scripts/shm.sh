@@ -0,0 +1,27 @@
+# usage: shm.sh backend
+# Shared memory delivery: text and binary --shm clients and a plain one
+# on a Unix socket, and a --shm client over TCP (which must fall back to
+# the socket), each get both of two publishes.
+cd "$(dirname "$0")/.." || exit 1
+B=${1:-thread}
+T=$(mktemp -d)
+S=$T/ps.sock
+env PSSERVER_BACKEND=$B PSSERVER_UNIX_PATH=$S LD_LIBRARY_PATH=. \
+    ./psserver 50 0 2>$T/port &
+P=$!
+sleep 0.3
+PORT=$(head -1 $T/port)
+(sleep 1.5 | timeout 2 ./psclient --shm $S shmsub news >$T/s1 2>&1) &
+(sleep 1.5 | timeout 2 ./psclient --binary --shm $S shmbin news >$T/s2 2>&1) &
+(sleep 1.5 | timeout 2 ./psclient $S plainunix news >$T/s3 2>&1) &
+(sleep 1.5 | timeout 2 ./psclient --shm $PORT tcpshm news >$T/s4 2>&1) &
+sleep 0.5
+printf 'pub news hello world\npub news second\n' \
+    | timeout 1 ./psclient $PORT pubr
+sleep 1.8
+for f in s1 s2 s3 s4; do
+    echo "-- $f"
+    cat $T/$f
+done
+kill $P
+rm -rf $T
@@ -0,0 +1,30 @@
+# usage: shmflood.py socketpath port
+# A --shm client that types lines on stdin while 4000 messages arrive
+# through its ring must receive all 4000.
+import os, socket, subprocess, sys, threading, time
+
+path, port = sys.argv[1], int(sys.argv[2])
+here = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+c = subprocess.Popen([os.path.join(here, "psclient"), "--shm", path, "shmc",
+        "flood"], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+        env=dict(os.environ, LD_LIBRARY_PATH=here))
+time.sleep(0.3)
+got = [0]
+
+def reader():
+    for _ in c.stdout:
+        got[0] += 1
+
+threading.Thread(target=reader, daemon=True).start()
+p = socket.create_connection(("127.0.0.1", port))
+p.sendall(b"name fl\n")
+for i in range(200):
+    p.sendall(b"pub flood m%d\n" % i * 20)
+    if i % 10 == 0:
+        c.stdin.write(b"pub other typed\n")
+        c.stdin.flush()
+    time.sleep(0.005)
+time.sleep(0.5)
+print("received", got[0], "of", 4000)
+c.stdin.close()
+c.wait()
@@ -0,0 +1,52 @@
+# usage: stall.py port serverpid
+# A subscriber that never reads stalls a publisher's sends while a
+# second subscriber disconnects. Its close must still finish (the
+# server's fd count drops) without the server spinning. Linux only.
+import os, socket, sys, threading, time
+
+port, pid = int(sys.argv[1]), int(sys.argv[2])
+
+def connect(name):
+    s = socket.create_connection(("127.0.0.1", port))
+    s.sendall(b"name %s\n" % name)
+    return s
+
+def cpu_ticks():
+    fields = open("/proc/%d/stat" % pid).read().split()
+    return int(fields[13]) + int(fields[14])
+
+def fd_count():
+    return len(os.listdir("/proc/%d/fd" % pid))
+
+slow = connect(b"slow")
+slow.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+slow.sendall(b"sub news\n")
+other = connect(b"other")
+other.sendall(b"sub news\n")
+time.sleep(0.2)
+pub = connect(b"pub")
+
+def flood():
+    try:
+        while True:
+            pub.sendall(b"pub news " + b"x" * 1000 + b"\n")
+    except OSError:
+        pass
+
+def drain():
+    try:
+        while other.recv(65536):
+            pass
+    except OSError:
+        pass
+
+threading.Thread(target=flood, daemon=True).start()
+threading.Thread(target=drain, daemon=True).start()
+time.sleep(1.0)
+before = fd_count()
+other.shutdown(socket.SHUT_RDWR)
+other.close()
+ticks = cpu_ticks()
+time.sleep(1.0)
+print("server cpu while stalled: %d%%" % (cpu_ticks() - ticks))
+print("server fds before/after close: %d/%d" % (before, fd_count()))
@@ -0,0 +1,47 @@
+# usage: subs.py port count
+# Checks sub's parsing of several topics on one line, then times one sub
+# line listing count new topics and one listing a single topic count
+# times.
+import socket, sys, time
+
+port, count = int(sys.argv[1]), int(sys.argv[2])
+
+def connect():
+    s = socket.create_connection(("127.0.0.1", port))
+    s.settimeout(1)
+    return s
+
+def read_all(s):
+    out = b""
+    try:
+        while True:
+            d = s.recv(1 << 20)
+            if not d:
+                break
+            out += d
+    except socket.timeout:
+        pass
+    return out
+
+def timed_sub(name, topics):
+    s = connect()
+    s.sendall(b"name " + name + b"\n")
+    time.sleep(0.1)
+    start = time.time()
+    s.sendall(b"sub " + b" ".join(topics) + b"\nping\n")
+    s.settimeout(120)
+    d = b""
+    while b"pong" not in d:
+        d += s.recv(1000)
+    return time.time() - start
+
+a = connect()
+a.sendall(b"name aa\nsub alpha  beta\tgamma\nsub ok bad:name\nsub\n")
+p = connect()
+p.sendall(b"name pp\npub alpha 1\npub beta 2\npub gamma 3\npub ok 4\n")
+time.sleep(0.3)
+print("parsed:", read_all(a))
+print("sub of %d new topics: %.3fs"
+        % (count, timed_sub(b"bb", [b"t%d" % i for i in range(count)])))
+print("sub of one topic %d times: %.3fs"
+        % (count, timed_sub(b"cc", [b"news"] * count)))
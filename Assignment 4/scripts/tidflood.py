@@ -0,0 +1,36 @@
+# usage: tidflood.py port count
+# Send count TOPICID frames for fresh topic names and count the ids and
+# other replies. A connection may add at most 1024 topics, fewer if
+# PSSERVER_CLIENT_BYTES runs out first.
+import socket, struct, sys
+
+port, count = int(sys.argv[1]), int(sys.argv[2])
+HELLO = bytes([0xB5, ord('P'), ord('S'), 1])
+
+def frame(op, name=b"", topic=b"", payload=b""):
+    return (struct.pack("!BBHI", op, len(name), len(topic), len(payload))
+            + name + topic + payload)
+
+p = socket.create_connection(("127.0.0.1", port))
+p.sendall(HELLO + frame(1, b"flooder")
+        + b"".join(frame(12, topic=b"t%d" % i) for i in range(count)))
+buf = b""
+p.settimeout(1)
+try:
+    while True:
+        d = p.recv(1 << 20)
+        if not d:
+            break
+        buf += d
+except socket.timeout:
+    pass
+buf = buf[len(HELLO):]
+ids = other = 0
+while len(buf) >= 8:
+    op, nl, tl, pl = struct.unpack("!BBHI", buf[:8])
+    buf = buf[8 + nl + tl + pl:]
+    if op == 12:
+        ids += 1
+    else:
+        other += 1
+print("ids", ids, "other", other)
@@ -93,7 +93,7 @@ int stringmap_add(StringMap *sm, char *key, void *item){
         newNode = (StringMap*) malloc(sizeof(StringMapItem));
         currNode->nextNode = newNode;
     }
-    newNode->key = (char*) malloc(sizeof(char) * strlen(key));
+    newNode->key = (char*) malloc(sizeof(char) * (strlen(key) + 1));
     strcpy(newNode->key, key);
     newNode->item = item;
     newNode->nextNode = NULL;
@@ -126,9 +126,9 @@ int stringmap_remove(StringMap *sm, char *key){
                                 // do not delete root node.
                                 // Copy contents from next node to this node.
                 nextNode = currNode->nextNode;
-                strcpy(currNode->key, nextNode->key);
+                free(currNode->key);
+                currNode->key = nextNode->key;
                 currNode->item = nextNode->item;
-                free(nextNode->key);
                 currNode->nextNode = nextNode->nextNode;
                 free(nextNode);
             } else { // only one element is there in node